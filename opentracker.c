@@ -33,9 +33,11 @@
 #include "ot_mutex.h"
 #include "ot_http.h"
 #include "ot_udp.h"
+#include "ot_tcp.h"
 #include "ot_accesslist.h"
 #include "ot_stats.h"
 #include "ot_livesync.h"
+#include "ot_fullscrape.h"
 
 /* Globals */
 time_t       g_now_seconds;
@@ -47,6 +49,18 @@ int          g_self_pipe[2];
 static char * g_serverdir;
 static char * g_serveruser;
 static unsigned int g_udp_workers;
+static unsigned int g_udp_workers_reuseport;
+static unsigned int g_tcp_workers;
+static unsigned int g_tcp_workers_reuseport;
+
+/* UDP and TCP sockets served by worker threads. The workers may only be
+   started after trackerlogic_init() has set up the torrent buckets */
+#define OT_WORKER_SOCKETS_MAX 256
+typedef struct { int64 sock; unsigned int workers; } ot_worker_socket;
+static ot_worker_socket g_udp_worker_sockets[OT_WORKER_SOCKETS_MAX];
+static unsigned int     g_udp_worker_socket_count;
+static ot_worker_socket g_tcp_worker_sockets[OT_WORKER_SOCKETS_MAX];
+static unsigned int     g_tcp_worker_socket_count;
 
 static void panic( const char *routing ) __attribute__ ((noreturn));
 static void panic( const char *routine ) {
@@ -135,28 +149,10 @@ static void help( char *name ) {
 }
 #undef HELPLINE
 
-static size_t header_complete( char * request, ssize_t byte_count ) {
-  int i = 0, state = 0;
-
-  for( i=1; i < byte_count; i+=2 )
-    if( request[i] <= 13 ) {
-      i--;
-      for( state = 0 ; i < byte_count; ++i ) {
-        char c = request[i];
-        if( c == '\r' || c == '\n' )
-          state = ( state >> 2 ) | ( ( c << 6 ) & 0xc0 );
-        else
-          break;
-        if( state >= 0xa0 || state == 0x99 ) return i + 1;
-      }
-  }
-  return 0;
-}
-
 static void handle_dead( const int64 sock ) {
   struct http_data* cookie=io_getcookie( sock );
   if( cookie ) {
-    iob_reset( &cookie->batch );
+    http_release_output( cookie );
     array_reset( &cookie->request );
     if( cookie->flag & STRUCT_HTTP_FLAG_WAITINGFORTASK )
       mutex_workqueue_canceltask( sock );
@@ -165,8 +161,26 @@ static void handle_dead( const int64 sock ) {
   io_close( sock );
 }
 
+/* Answers the complete requests collected in the cookie's buffer. Requests
+   pipelined on a kept alive connection are answered one after the other,
+   as long as the previous reply went out in one piece */
+static void handle_buffered( const int64 sock, struct http_data *cookie, struct ot_workstruct *ws ) {
+  for( ; ; ) {
+    if( !( ws->header_size = http_header_complete( array_start( &cookie->request ), array_bytes( &cookie->request ) ) ) ) {
+      if( array_bytes( &cookie->request ) > 8192 )
+        http_issue_error( sock, ws, CODE_HTTPERROR_500 );
+      return;
+    }
+    ws->request      = array_start( &cookie->request );
+    ws->request_size = array_bytes( &cookie->request );
+    http_handle_request( sock, ws );
+    if( !ws->keep_alive || iob_bytesleft( &cookie->batch ) )
+      return;
+  }
+}
+
 static void handle_read( const int64 sock, struct ot_workstruct *ws ) {
-  struct http_data* cookie = io_getcookie( sock );
+  struct http_data* cookie = ws->cookie = io_getcookie( sock );
   ssize_t byte_count;
 
   if( ( byte_count = io_tryread( sock, ws->inbuf, G_INBUF_SIZE ) ) <= 0 ) {
@@ -176,36 +190,60 @@ static void handle_read( const int64 sock, struct ot_workstruct *ws ) {
 
   /* If we get the whole request in one packet, handle it without copying */
   if( !array_start( &cookie->request ) ) {
-    if( ( ws->header_size = header_complete( ws->inbuf, byte_count ) ) ) {
+    if( ( ws->header_size = http_header_complete( ws->inbuf, byte_count ) ) ) {
       ws->request = ws->inbuf;
       ws->request_size = byte_count;
       http_handle_request( sock, ws );
+      /* Requests pipelined behind it went to the cookie's buffer */
+      if( ws->keep_alive && !iob_bytesleft( &cookie->batch ) )
+        handle_buffered( sock, cookie, ws );
     } else
       array_catb( &cookie->request, ws->inbuf, byte_count );
     return;
   }
 
   array_catb( &cookie->request, ws->inbuf, byte_count );
-  if( array_failed( &cookie->request ) || array_bytes( &cookie->request ) > 8192 ) {
+  if( array_failed( &cookie->request ) ) {
     http_issue_error( sock, ws, CODE_HTTPERROR_500 );
     return;
   }
 
-  while( ( ws->header_size = header_complete( array_start( &cookie->request ), array_bytes( &cookie->request ) ) ) ) {
-    ws->request      = array_start( &cookie->request );
-    ws->request_size = array_bytes( &cookie->request );
-    http_handle_request( sock, ws );
-#ifdef WANT_KEEPALIVE
-    if( !ws->keep_alive )
-#endif
-      return;
-  }
+  handle_buffered( sock, cookie, ws );
 }
 
-static void handle_write( const int64 sock ) {
+static void handle_write( const int64 sock, struct ot_workstruct *ws ) {
   struct http_data* cookie=io_getcookie( sock );
-  if( !cookie || ( iob_send( sock, &cookie->batch ) <= 0 ) )
+  int64 sent;
+  tai6464 t;
+
+  if( !cookie || ( sent = iob_send( sock, &cookie->batch ) ) < 0 ||
+      ( !sent && !( cookie->flag & ( STRUCT_HTTP_FLAG_KEEPALIVE | STRUCT_HTTP_FLAG_STREAMING ) ) ) ) {
     handle_dead( sock );
+    return;
+  }
+  if( sent )
+    return;
+
+  /* Everything streamed so far is out, let the full scrape worker go on */
+  if( cookie->flag & STRUCT_HTTP_FLAG_STREAMING ) {
+    http_release_output( cookie );
+    io_dontwantwrite( sock );
+    mutex_workqueue_streamsent( sock, cookie->streamed );
+    cookie->streamed = 0;
+    return;
+  }
+
+  /* The reply is out, a kept alive connection goes on with its next request */
+  cookie->flag &= ~STRUCT_HTTP_FLAG_KEEPALIVE;
+  http_release_output( cookie );
+  io_dontwantwrite( sock );
+  io_wantread( sock );
+  taia_uint( &t, 0 );
+  tai_unix( &(t.sec), (g_now_seconds + g_keepalive_timeout) );
+  io_timeout( sock, t );
+
+  ws->cookie = cookie;
+  handle_buffered( sock, cookie, ws );
 }
 
 static void handle_accept( const int64 serversocket ) {
@@ -242,15 +280,49 @@ static void handle_accept( const int64 serversocket ) {
   io_eagain(serversocket);
 }
 
+/* Takes over connections from tcp workers, with requests we need to answer
+   in their cookie's buffer */
+static void handle_handover( struct ot_workstruct *ws ) {
+  struct http_data *cookie;
+  int64 sock;
+  tai6464 t;
+
+  while( ( sock = tcp_pop_handover( &cookie ) ) != -1 ) {
+    cookie->flag &= ~( STRUCT_HTTP_FLAG_WORKER | STRUCT_HTTP_FLAG_HANDOVER );
+
+    if( !io_fd( sock ) ) {
+      http_release_output( cookie );
+      array_reset( &cookie->request );
+      free( cookie );
+      io_close( sock );
+      continue;
+    }
+    io_setcookie( sock, cookie );
+
+    /* Kept alive connections have a timeout of their own */
+    taia_uint( &t, 0 );
+    tai_unix( &(t.sec), (g_now_seconds + ( cookie->requests ? g_keepalive_timeout : OT_CLIENT_TIMEOUT ) ) );
+    io_timeout( sock, t );
+    io_wantread( sock );
+
+    ws->cookie = cookie;
+    handle_buffered( sock, cookie, ws );
+  }
+}
+
 static void * server_mainloop( void * args ) {
   struct ot_workstruct ws;
   time_t next_timeout_check = g_now_seconds + OT_CLIENT_TIMEOUT_CHECKINTERVAL;
   struct iovec *iovector;
   int    iovec_entries;
+  struct ot_fullscrape_snapshot *snapshot;
+  int    partial, full;
+  ot_time cursor;
 
   (void)args;
 
   /* Initialize our "thread local storage" */
+  memset( &ws, 0, sizeof( ws ) );
   ws.inbuf   = malloc( G_INBUF_SIZE );
   ws.outbuf  = malloc( G_OUTBUF_SIZE );
 #ifdef _DEBUG_HTTPERROR
@@ -258,6 +330,7 @@ static void * server_mainloop( void * args ) {
 #endif
   if( !ws.inbuf || !ws.outbuf )
     panic( "Initializing worker failed" );
+  workstruct_seed_random( &ws );
 
   for( ; ; ) {
     int64 sock;
@@ -268,19 +341,24 @@ static void * server_mainloop( void * args ) {
       const void *cookie = io_getcookie( sock );
       if( (intptr_t)cookie == FLAG_TCP )
         handle_accept( sock );
-      else if( (intptr_t)cookie == FLAG_UDP )
-        handle_udp6( sock, &ws );
+      else if( (intptr_t)cookie == FLAG_UDP ) {
+        /* Read what has piled up on the socket, but leave the others a chance */
+        int drained = 0;
+        while( drained++ < OT_UDP_DRAIN_MAX && handle_udp6( sock, &ws ) );
+      }
       else if( (intptr_t)cookie == FLAG_SELFPIPE )
         io_tryread( sock, ws.inbuf, G_INBUF_SIZE );
       else
         handle_read( sock, &ws );
     }
 
-    while( ( sock = mutex_workqueue_popresult( &iovec_entries, &iovector ) ) != -1 )
-      http_sendiovecdata( sock, &ws, iovec_entries, iovector );
+    handle_handover( &ws );
+
+    while( ( sock = mutex_workqueue_popresult( &iovec_entries, &iovector, &snapshot, &partial, &cursor, &full ) ) != -1 )
+      http_sendiovecdata( sock, &ws, iovec_entries, iovector, snapshot, partial, cursor, full );
 
     while( ( sock = io_canwrite( ) ) != -1 )
-      handle_write( sock );
+      handle_write( sock, &ws );
 
     if( g_now_seconds > next_timeout_check ) {
       while( ( sock = io_timeouted() ) != -1 )
@@ -298,6 +376,8 @@ static void * server_mainloop( void * args ) {
 
 static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
   int64 sock = proto == FLAG_TCP ? socket_tcp6( ) : socket_udp6( );
+  int   reuseport = ( ( proto == FLAG_UDP ) && g_udp_workers && g_udp_workers_reuseport ) ||
+                    ( ( proto == FLAG_TCP ) && g_tcp_workers && g_tcp_workers_reuseport );
 
 #ifndef WANT_V6
   if( !ip6_isv4mapped(ip) ) {
@@ -320,6 +400,16 @@ static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
   }
 #endif
 
+  if( reuseport ) {
+#ifdef SO_REUSEPORT
+    int one = 1;
+    if( setsockopt( sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof( one ) ) == -1 )
+      panic( "setsockopt SO_REUSEPORT" );
+#else
+    exerr( "listen.udp.workers.reuseport and listen.tcp.workers.reuseport are not supported on this platform." );
+#endif
+  }
+
   if( socket_bind6_reuse( sock, ip, port, 0 ) == -1 )
     panic( "socket_bind6_reuse" );
 
@@ -332,8 +422,17 @@ static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
   io_setcookie( sock, (void*)proto );
 
   if( (proto == FLAG_UDP) && g_udp_workers ) {
+    if( g_udp_worker_socket_count == OT_WORKER_SOCKETS_MAX )
+      exerr( "Too many udp sockets with workers bound." );
     io_block( sock );
-    udp_init( sock, g_udp_workers );
+    g_udp_worker_sockets[g_udp_worker_socket_count].sock = sock;
+    g_udp_worker_sockets[g_udp_worker_socket_count++].workers = reuseport ? 1 : g_udp_workers;
+  } else if( (proto == FLAG_TCP) && g_tcp_workers ) {
+    if( g_tcp_worker_socket_count == OT_WORKER_SOCKETS_MAX )
+      exerr( "Too many tcp sockets with workers bound." );
+    io_nonblock( sock );
+    g_tcp_worker_sockets[g_tcp_worker_socket_count].sock = sock;
+    g_tcp_worker_sockets[g_tcp_worker_socket_count++].workers = reuseport ? 1 : g_tcp_workers;
   } else
     io_wantread( sock );
 
@@ -344,6 +443,23 @@ static int64_t ot_try_bind( ot_ip6 ip, uint16_t port, PROTO_FLAG proto ) {
   return sock;
 }
 
+/* With listen.udp.workers.reuseport each worker gets a socket of its own,
+   all bound to the same address, so that the kernel spreads datagrams
+   over one receive queue per worker */
+static void ot_try_bind_udp( ot_ip6 ip, uint16_t port ) {
+  unsigned int sockets = g_udp_workers && g_udp_workers_reuseport ? g_udp_workers : 1;
+  while( sockets-- )
+    ot_try_bind( ip, port, FLAG_UDP );
+}
+
+/* The same for tcp workers and listen.tcp.workers.reuseport, one accept
+   queue per worker */
+static void ot_try_bind_tcp( ot_ip6 ip, uint16_t port ) {
+  unsigned int sockets = g_tcp_workers && g_tcp_workers_reuseport ? g_tcp_workers : 1;
+  while( sockets-- )
+    ot_try_bind( ip, port, FLAG_TCP );
+}
+
 char * set_config_option( char **option, char *value ) {
 #ifdef _DEBUG
   fprintf( stderr, "Setting config option: %s\n", value );
@@ -411,22 +527,103 @@ int parse_configfile( char * config_filename ) {
     } else if(!byte_diff(p,14,"listen.tcp_udp" ) && isspace(p[14])) {
       uint16_t tmpport = 6969;
       if( !scan_ip6_port( p+15, tmpip, &tmpport )) goto parse_error;
-      ot_try_bind( tmpip, tmpport, FLAG_TCP ); ++bound;
-      ot_try_bind( tmpip, tmpport, FLAG_UDP ); ++bound;
+      ot_try_bind_tcp( tmpip, tmpport ); ++bound;
+      ot_try_bind_udp( tmpip, tmpport ); ++bound;
     } else if(!byte_diff(p,10,"listen.tcp" ) && isspace(p[10])) {
       uint16_t tmpport = 6969;
       if( !scan_ip6_port( p+11, tmpip, &tmpport )) goto parse_error;
-      ot_try_bind( tmpip, tmpport, FLAG_TCP );
+      ot_try_bind_tcp( tmpip, tmpport );
       ++bound;
     } else if(!byte_diff(p, 10, "listen.udp" ) && isspace(p[10])) {
       uint16_t tmpport = 6969;
       if( !scan_ip6_port( p+11, tmpip, &tmpport )) goto parse_error;
-      ot_try_bind( tmpip, tmpport, FLAG_UDP );
+      ot_try_bind_udp( tmpip, tmpport );
       ++bound;
+    } else if(!byte_diff(p,18,"listen.tcp.workers" ) && isspace(p[18])) {
+      char *value = p + 18;
+      while( isspace(*value) ) ++value;
+      scan_uint( value, &g_tcp_workers );
+    } else if(!byte_diff(p,28,"listen.tcp.workers.reuseport" ) && isspace(p[28])) {
+      char *value = p + 28;
+      while( isspace(*value) ) ++value;
+      scan_uint( value, &g_tcp_workers_reuseport );
+    } else if(!byte_diff(p,28,"listen.tcp.keepalive_timeout" ) && isspace(p[28])) {
+      char *value = p + 28;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_keepalive_timeout ) ) goto parse_error;
+    } else if(!byte_diff(p,29,"listen.tcp.keepalive_requests" ) && isspace(p[29])) {
+      char *value = p + 29;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_keepalive_max_requests ) ) goto parse_error;
     } else if(!byte_diff(p,18,"listen.udp.workers" ) && isspace(p[18])) {
       char *value = p + 18;
       while( isspace(*value) ) ++value;
       scan_uint( value, &g_udp_workers );
+    } else if(!byte_diff(p,28,"listen.udp.workers.reuseport" ) && isspace(p[28])) {
+      char *value = p + 28;
+      while( isspace(*value) ) ++value;
+      scan_uint( value, &g_udp_workers_reuseport );
+    } else if(!byte_diff(p,27,"listen.udp.workers.io_uring" ) && isspace(p[27])) {
+      char *value = p + 27;
+      unsigned int tmpenable;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &tmpenable ) ) goto parse_error;
+      udp_set_io_uring( tmpenable );
+    } else if(!byte_diff(p,23,"listen.udp.workers.cpus" ) && isspace(p[23])) {
+      char *value = p + 23;
+      unsigned int cpu;
+      size_t len;
+      while( isspace(*value) ) ++value;
+      while( ( len = scan_uint( value, &cpu ) ) ) {
+        udp_add_worker_cpu( cpu );
+        value += len;
+        while( isspace(*value) || *value == ',' ) ++value;
+      }
+      if( *value ) goto parse_error;
+    } else if(!byte_diff(p,15,"tracker.buckets" ) && isspace(p[15])) {
+      char *value = p + 15;
+      unsigned long tmpbuckets;
+      while( isspace(*value) ) ++value;
+      if( !scan_ulong( value, &tmpbuckets ) ) goto parse_error;
+      mutex_set_bucket_count( tmpbuckets );
+#ifdef WANT_FULLSCRAPE
+    } else if(!byte_diff(p,26,"tracker.fullscrape_max_age" ) && isspace(p[26])) {
+      char *value = p + 26;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_fullscrape_max_age ) ) goto parse_error;
+    } else if(!byte_diff(p,26,"tracker.fullscrape_threads" ) && isspace(p[26])) {
+      char *value = p + 26;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_fullscrape_threads ) ) goto parse_error;
+    } else if(!byte_diff(p,26,"tracker.fullscrape_workers" ) && isspace(p[26])) {
+      char *value = p + 26;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_fullscrape_workers ) ) goto parse_error;
+    } else if(!byte_diff(p,25,"tracker.fullscrape_stream" ) && isspace(p[25])) {
+      char *value = p + 25;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_fullscrape_stream ) ) goto parse_error;
+    } else if(!byte_diff(p,31,"tracker.fullscrape_delta_window" ) && isspace(p[31])) {
+      char *value = p + 31;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_delta_window ) ) goto parse_error;
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+    } else if(!byte_diff(p,18,"tracker.zstd_level" ) && isspace(p[18])) {
+      char *value = p + 18;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_zstd_level ) ) goto parse_error;
+#endif
+    } else if(!byte_diff(p,21,"tracker.stats_workers" ) && isspace(p[21])) {
+      char *value = p + 21;
+      while( isspace(*value) ) ++value;
+      if( !scan_uint( value, &g_stats_workers ) ) goto parse_error;
+    } else if(!byte_diff(p,28,"tracker.peer_cache_threshold" ) && isspace(p[28])) {
+      char *value = p + 28;
+      unsigned long tmpthreshold;
+      while( isspace(*value) ) ++value;
+      if( !scan_ulong( value, &tmpthreshold ) ) goto parse_error;
+      g_peer_cache_threshold = tmpthreshold;
 #ifdef WANT_ACCESSLIST_WHITE
     } else if(!byte_diff(p, 16, "access.whitelist" ) && isspace(p[16])) {
       set_config_option( &g_accesslist_filename, p+17 );
@@ -557,6 +754,7 @@ int main( int argc, char **argv ) {
   int bound = 0, scanon = 1;
   uint16_t tmpport;
   char * statefile = 0;
+  unsigned int i;
 
   memset( serverip, 0, sizeof(ot_ip6) );
 #ifndef WANT_V6
@@ -589,10 +787,10 @@ int main( int argc, char **argv ) {
 #endif
       case 'p':
         if( !scan_ushort( optarg, &tmpport)) { usage( argv[0] ); exit( 1 ); }
-        ot_try_bind( serverip, tmpport, FLAG_TCP ); bound++; break;
+        ot_try_bind_tcp( serverip, tmpport ); bound++; break;
       case 'P':
         if( !scan_ushort( optarg, &tmpport)) { usage( argv[0] ); exit( 1 ); }
-        ot_try_bind( serverip, tmpport, FLAG_UDP ); bound++; break;
+        ot_try_bind_udp( serverip, tmpport ); bound++; break;
 #ifdef WANT_SYNC_LIVE
       case 's':
         if( !scan_ushort( optarg, &tmpport)) { usage( argv[0] ); exit( 1 ); }
@@ -621,8 +819,8 @@ int main( int argc, char **argv ) {
 
   /* Bind to our default tcp/udp ports */
   if( !bound) {
-    ot_try_bind( serverip, 6969, FLAG_TCP );
-    ot_try_bind( serverip, 6969, FLAG_UDP );
+    ot_try_bind_tcp( serverip, 6969 );
+    ot_try_bind_udp( serverip, 6969 );
   }
 
 #ifdef WANT_SYSLOGS
@@ -655,8 +853,12 @@ int main( int argc, char **argv ) {
 
   install_signal_handlers( );
 
-  if( !g_udp_workers )
+  if( !g_udp_worker_socket_count )
     udp_init( -1, 0 );
+  for( i=0; i<g_udp_worker_socket_count; ++i )
+    udp_init( g_udp_worker_sockets[i].sock, g_udp_worker_sockets[i].workers );
+  for( i=0; i<g_tcp_worker_socket_count; ++i )
+    tcp_init( g_tcp_worker_sockets[i].sock, g_tcp_worker_sockets[i].workers );
 
   /* Kick off our initial clock setting alarm */
   alarm(5);
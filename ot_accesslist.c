@@ -25,19 +25,16 @@
 /* GLOBAL VARIABLES */
 #ifdef WANT_ACCESSLIST
        char    *g_accesslist_filename;
+/* g_accesslist holds g_accesslist_size hashes in Eytzinger order, see ot_vector.h */
 static ot_hash *g_accesslist;
 static size_t   g_accesslist_size;
 static pthread_mutex_t g_accesslist_mutex;
 
-static int vector_compare_hash(const void *hash1, const void *hash2 ) {
-  return memcmp( hash1, hash2, OT_HASH_COMPARE_SIZE );
-}
-
 /* Read initial access list */
 static void accesslist_readfile( void ) {
-  ot_hash *info_hash, *accesslist_new = NULL;
+  ot_hash *info_hash, *accesslist_new = NULL, *accesslist_tree;
   char    *map, *map_end, *read_offs;
-  size_t   maplen;
+  size_t   maplen, count;
 
   if( ( map = mmap_read( g_accesslist_filename, &maplen ) ) == NULL ) {
     char *wd = getcwd( NULL, 0 );
@@ -86,13 +83,23 @@ static void accesslist_readfile( void ) {
 
   mmap_unmap( map, maplen);
 
-  qsort( accesslist_new, info_hash - accesslist_new, sizeof( *info_hash ), vector_compare_hash );
+  count = info_hash - accesslist_new;
+  qsort( accesslist_new, count, sizeof( *info_hash ), vector_compare_hash );
+
+  accesslist_tree = malloc( ( count + 1 ) * sizeof( ot_hash ) );
+  if( !accesslist_tree ) {
+    fprintf( stderr, "Warning: Not enough memory to allocate %zd bytes for accesslist. May succeed later.\n", ( count + 1 ) * sizeof( ot_hash ) );
+    free( accesslist_new );
+    return;
+  }
+  vector_eytzinger_hashes( accesslist_tree, accesslist_new, count );
+  free( accesslist_new );
 
   /* Now exchange the accesslist vector in the least race condition prone way */
   pthread_mutex_lock(&g_accesslist_mutex);
   free( g_accesslist );
-  g_accesslist      = accesslist_new;
-  g_accesslist_size = info_hash - accesslist_new;
+  g_accesslist      = accesslist_tree;
+  g_accesslist_size = count;
   pthread_mutex_unlock(&g_accesslist_mutex);
 }
 
@@ -101,7 +108,7 @@ int accesslist_hashisvalid( ot_hash hash ) {
 
   /* Lock should hardly ever be contended */
   pthread_mutex_lock(&g_accesslist_mutex);
-  exactmatch = bsearch( hash, g_accesslist, g_accesslist_size, OT_HASH_COMPARE_SIZE, vector_compare_hash );
+  exactmatch = vector_eytzinger_find_hash( g_accesslist, g_accesslist_size, hash );
   pthread_mutex_unlock(&g_accesslist_mutex);
 
 #ifdef WANT_ACCESSLIST_BLACK
@@ -198,7 +205,29 @@ void *get_value_for_net( const ot_ip6 address, const ot_vector *vector, const si
 
 #ifdef WANT_FULLLOG_NETWORKS
 static ot_vector g_lognets_list;
-ot_log *g_logchain_first, *g_logchain_last;
+static ot_log   *g_logchain_first, *g_logchain_last;
+static pthread_mutex_t g_logchain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void loglist_append( ot_log *log ) {
+  log->next = NULL;
+  pthread_mutex_lock( &g_logchain_mutex );
+  if( !g_logchain_first )
+    g_logchain_first = g_logchain_last = log;
+  else {
+    g_logchain_last->next = log;
+    g_logchain_last = log;
+  }
+  pthread_mutex_unlock( &g_logchain_mutex );
+}
+
+ot_log *loglist_take( ) {
+  ot_log *loglist;
+  pthread_mutex_lock( &g_logchain_mutex );
+  loglist = g_logchain_first;
+  g_logchain_first = g_logchain_last = NULL;
+  pthread_mutex_unlock( &g_logchain_mutex );
+  return loglist;
+}
 
 static pthread_mutex_t g_lognets_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 void loglist_add_network( const ot_net *net ) {
@@ -59,7 +59,11 @@ struct ot_log {
   ot_time  time;
   ot_log  *next;
 };
-extern ot_log *g_logchain_first, *g_logchain_last;
+
+/* Requests from logged networks are collected by whichever thread answers
+   them and taken as a whole by the stats worker */
+void    loglist_append( ot_log *log );
+ot_log *loglist_take( );
 
 void loglist_add_network( const ot_net *net );
 void loglist_reset( );
@@ -0,0 +1,66 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <stdint.h>
+#include <string.h>
+
+/* Opentracker */
+#include "ot_bencode.h"
+
+/* Two digits per division instead of one */
+static const char bencode_digit_pairs[201] =
+  "00010203040506070809" "10111213141516171819" "20212223242526272829" "30313233343536373839" "40414243444546474849"
+  "50515253545556575859" "60616263646566676869" "70717273747576777879" "80818283848586878889" "90919293949596979899";
+
+size_t bencode_decimal( char *dest, uint64_t value ) {
+  char   digits[BENCODE_MAXDECIMAL], *d = digits + sizeof(digits);
+  size_t length;
+
+  while( value >= 100 ) {
+    const char *pair = bencode_digit_pairs + 2 * ( value % 100 );
+    value /= 100;
+    *--d = pair[1];
+    *--d = pair[0];
+  }
+  if( value >= 10 ) {
+    const char *pair = bencode_digit_pairs + 2 * value;
+    *--d = pair[1];
+    *--d = pair[0];
+  } else
+    *--d = '0' + value;
+
+  length = digits + sizeof(digits) - d;
+  memcpy( dest, d, length );
+  return length;
+}
+
+size_t bencode_decimal_signed( char *dest, int64_t value ) {
+  if( value >= 0 )
+    return bencode_decimal( dest, value );
+  *dest = '-';
+  return 1 + bencode_decimal( dest + 1, -(uint64_t)value );
+}
+
+size_t bencode_int( char *dest, int64_t value ) {
+  size_t length = 1 + bencode_decimal_signed( dest + 1, value );
+  dest[0] = 'i';
+  dest[length++] = 'e';
+  return length;
+}
+
+size_t bencode_string_length( char *dest, size_t length ) {
+  size_t written = bencode_decimal( dest, length );
+  dest[written++] = ':';
+  return written;
+}
+
+size_t bencode_string( char *dest, const void *data, size_t length ) {
+  size_t written = bencode_string_length( dest, length );
+  memcpy( dest + written, data, length );
+  return written + length;
+}
+
+const char *g_version_bencode_c = "$Source$: $Revision$\n";
@@ -0,0 +1,28 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef OT_BENCODE_H__
+#define OT_BENCODE_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/* Writers for the replies on the hot paths. Like libowfat's fmt_* family
+   they write to dest without a terminating '\0' and return the amount of
+   bytes written. dest must have enough room for the result */
+
+/* Digits of the largest uint64_t, plus a sign */
+#define BENCODE_MAXDECIMAL 21
+
+/* Copies a string literal, e.g. a bencoded key like "8:complete" */
+#define bencode_literal( dest, literal ) ( memcpy( (dest), (literal), sizeof(literal) - 1 ), sizeof(literal) - 1 )
+
+size_t bencode_decimal( char *dest, uint64_t value );                      /* 1234 */
+size_t bencode_decimal_signed( char *dest, int64_t value );                /* -1234 */
+size_t bencode_int( char *dest, int64_t value );                           /* i1234e */
+size_t bencode_string_length( char *dest, size_t length );                 /* 4: */
+size_t bencode_string( char *dest, const void *data, size_t length );      /* 4:spam */
+
+#endif
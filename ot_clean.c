@@ -48,45 +48,44 @@ static ssize_t clean_single_bucket( ot_peer *peers, size_t peer_count, time_t ti
 */
 int clean_single_torrent( ot_torrent *torrent ) {
   ot_peerlist *peer_list = torrent->peer_list;
-  ot_vector *bucket_list = &peer_list->peers;
   time_t timedout = (time_t)( g_now_minutes - peer_list->base );
-  int num_buckets = 1, removed_seeders = 0;
+  int removed_seeders = 0;
+  size_t removed_peers;
 
   /* No need to clean empty torrent */
   if( !timedout )
     return 0;
 
   /* Torrent has idled out */
-  if( timedout > OT_TORRENT_TIMEOUT )
+  if( timedout > OT_TORRENT_TIMEOUT ) {
+    mutex_bucket_removed( torrent->hash );
     return 1;
+  }
 
   /* Nothing to be cleaned here? Test if torrent is worth keeping */
   if( timedout > OT_PEER_TIMEOUT ) {
-    if( !peer_list->peer_count )
-      return peer_list->down_count ? 0 : 1;
+    if( !peer_list->peer_count ) {
+      if( peer_list->down_count )
+        return 0;
+      mutex_bucket_removed( torrent->hash );
+      return 1;
+    }
     timedout = OT_PEER_TIMEOUT;
   }
 
-  if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-    num_buckets = bucket_list->size;
-    bucket_list = (ot_vector *)bucket_list->data;
-  }
-
-  while( num_buckets-- ) {
-    size_t removed_peers = clean_single_bucket( bucket_list->data, bucket_list->size, timedout, &removed_seeders );
-    peer_list->peer_count -= removed_peers;
-    bucket_list->size     -= removed_peers;
-    if( bucket_list->size < removed_peers )
-      vector_fixup_peers( bucket_list );
-    ++bucket_list;
+  removed_peers = clean_single_bucket( peer_list->peers.data, peer_list->peers.size, timedout, &removed_seeders );
+  peer_list->peer_count -= removed_peers;
+  peer_list->peers.size -= removed_peers;
+  if( removed_peers ) {
+    mutex_bucket_changed( torrent );
+    vector_fixup_peers( &peer_list->peers );
+    /* The cache may hand out peers that just timed out, let the next
+       announce rebuild it */
+    free_peercache( peer_list );
   }
 
   peer_list->seed_count -= removed_seeders;
 
-  /* See, if we need to convert a torrent from simple vector to bucket list */
-  if( ( peer_list->peer_count > OT_PEER_BUCKET_MINCOUNT ) || OT_PEERLIST_HASBUCKETS(peer_list) )
-    vector_redistribute_buckets( peer_list );
-
   if( peer_list->peer_count )
     peer_list->base = g_now_minutes;
   else {
@@ -117,6 +116,7 @@ static void * clean_worker( void * args ) {
           --toffs;
         }
       }
+      mutex_bucket_expire_removals( bucket );
       mutex_bucket_unlock( bucket, delta_torrentcount );
       if( !g_opentracker_running )
         return NULL;
@@ -7,6 +7,7 @@
 
 /* System */
 #include <sys/param.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
@@ -14,17 +15,23 @@
 #ifdef WANT_COMPRESSION_GZIP
 #include <zlib.h>
 #endif
+#ifdef WANT_COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
 
 /* Libowfat */
 #include "byte.h"
 #include "io.h"
 #include "textcode.h"
+#include "uint32.h"
 
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_mutex.h"
 #include "ot_iovec.h"
 #include "ot_fullscrape.h"
+#include "ot_bencode.h"
+#include "ot_stats.h"
 
 /* Fetch full scrape info for all torrents
    Full scrapes usually are huge and one does not want to
@@ -35,96 +42,453 @@
 /* "d8:completei%zde10:downloadedi%zde10:incompletei%zdee" */
 #define OT_SCRAPE_MAXENTRYLEN 256
 
+/* When compressing, entries are collected in a buffer this large and
+   handed to the compressor together, not one by one */
+#define OT_SCRAPE_STAGING_SIZE (64*1024)
+
+#if defined( WANT_COMPRESSION_GZIP ) || defined( WANT_COMPRESSION_ZSTD )
+#define WANT_COMPRESSION
+#define IF_COMPRESSION( TASK ) if( mode & ( TASK_FLAG_GZIP | TASK_FLAG_ZSTD ) ) TASK
+
+/* Compression level from ot_http.c */
+extern unsigned int g_zstd_level;
+
+/* Compresses one slice into its chunks */
+typedef struct {
+  ot_tasktype mode;
 #ifdef WANT_COMPRESSION_GZIP
-#define IF_COMPRESSION( TASK ) if( mode & TASK_FLAG_GZIP ) TASK
-#define WANT_COMPRESSION_GZIP_PARAM( param1, param2, param3 ) , param1, param2, param3
+  z_stream    strm;
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+  ZSTD_CCtx  *zctx;
+#endif
+} ot_fullscrape_encoder;
 #else
 #define IF_COMPRESSION( TASK )
-#define WANT_COMPRESSION_GZIP_PARAM( param1, param2, param3 )
 #endif
 
+/* Everything a full scrape needs to know about a torrent. Copied out of
+   the bucket, so that its lock is not held while we format and compress */
+typedef struct {
+  ot_hash hash;
+  ot_time base;
+  size_t  seed_count;
+  size_t  peer_count;
+  size_t  down_count;
+} ot_scrape_record;
+
+/* A full scrape shared by all requests for its format until it is older
+   than g_fullscrape_max_age. The cache holds one reference, every
+   connection sending it another */
+struct ot_fullscrape_snapshot {
+  ot_tasktype   mode;
+  time_t        made;
+  unsigned int  refcount;
+  int           iovec_entries;
+  struct iovec *iovector;
+};
+
+/* Copies of what a streamed full scrape sent, to become its snapshot */
+typedef struct {
+  int           failed;
+  int           iovec_entries;
+  struct iovec *iovector;
+} ot_fullscrape_copy;
+
+/* One slot per format and compression flag */
+#define OT_FULLSCRAPE_SNAPSHOTS ( ( TASK_FULLSCRAPE_TRACKERSTATE - TASK_FULLSCRAPE ) << 2 )
+#define OT_FULLSCRAPE_SNAPSHOT_SLOT( mode ) ( ( ( (mode) & TASK_TASK_MASK ) - TASK_FULLSCRAPE ) << 2 | ( (mode) & TASK_FLAGS_MASK ) >> 12 )
+
+unsigned int g_fullscrape_max_age = OT_FULLSCRAPE_MAX_AGE;
+
+static pthread_mutex_t                g_snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t                 g_snapshot_made = PTHREAD_COND_INITIALIZER;
+static struct ot_fullscrape_snapshot *g_snapshots[OT_FULLSCRAPE_SNAPSHOTS];
+/* Set while a worker makes the snapshot for a slot, the others wait */
+static int                            g_snapshots_making[OT_FULLSCRAPE_SNAPSHOTS];
+
+/* Full scrapes are made in slices of consecutive buckets by the full
+   scrape worker and g_fullscrape_threads slice workers. With gzip, every
+   slice is a raw deflate stream that ends byte aligned, so that one gzip
+   header and trailer around all of them make a valid gzip stream. With
+   zstd, every slice is a frame of its own, and concatenated frames are
+   what a zstd decoder expects anyway */
+#define OT_FULLSCRAPE_SLICES 16
+
+typedef struct {
+  int           first_bucket;
+  int           last_bucket;
+  ot_time       since;    /* delta full scrapes only list changes since */
+  ot_time       cursor;   /* and tell the client where to continue */
+  ot_taskid     taskid;   /* when streaming, chunks go to this task */
+  ot_fullscrape_copy *copy; /* and are copied here, if set */
+  int           failed;
+  int           iovec_entries;
+  struct iovec *iovector;
+#ifdef WANT_COMPRESSION_GZIP
+  uLong         crc;
+  uLong         length;
+#endif
+} ot_fullscrape_slice;
+
+unsigned int g_fullscrape_threads = OT_FULLSCRAPE_THREADS;
+unsigned int g_fullscrape_workers = OT_FULLSCRAPE_WORKERS;
+unsigned int g_fullscrape_stream;
+
+static pthread_mutex_t      g_slice_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       g_slices_waiting = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t       g_slices_finished = PTHREAD_COND_INITIALIZER;
+static ot_fullscrape_slice *g_slices;
+static ot_tasktype          g_slice_mode;
+static int                  g_slice_next, g_slices_done;
+
 /* Forward declaration */
-static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode );
+static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode, ot_time since, ot_time cursor, ot_taskid stream, ot_fullscrape_copy *copy );
+static void * fullscrape_slice_worker( void * args );
 
 /* Converter function from memory to human readable hex strings
    XXX - Duplicated from ot_stats. Needs fix. */
 static char*to_hex(char*d,uint8_t*s){char*m="0123456789ABCDEF";char *t=d;char*e=d+40;while(d<e){*d++=m[*s>>4];*d++=m[*s++&15];}*d=0;return t;}
 
-/* This is the entry point into this worker thread
-   It grabs tasks from mutex_tasklist and delivers results back
+void fullscrape_release( struct ot_fullscrape_snapshot *snapshot ) {
+  unsigned int refcount;
+
+  pthread_mutex_lock( &g_snapshot_mutex );
+  refcount = --snapshot->refcount;
+  pthread_mutex_unlock( &g_snapshot_mutex );
+
+  if( refcount ) return;
+  iovec_free( &snapshot->iovec_entries, &snapshot->iovector );
+  free( snapshot->iovector );
+  free( snapshot );
+}
+
+/* Workers cancelled by fullscrape_deinit while waiting for a snapshot must
+   not take the mutex with them */
+static void fullscrape_snapshot_unlock( void *args ) {
+  (void)args;
+  pthread_mutex_unlock( &g_snapshot_mutex );
+}
+
+/* Returns a referenced snapshot for mode, made anew if the cached one is
+   too old. NULL means the caller has to make a full scrape of its own.
+   When streaming to stream, the worker making the snapshot sends it to
+   its own client while it copies it, *served then tells that the task is
+   done with */
+static struct ot_fullscrape_snapshot *fullscrape_snapshot( ot_tasktype mode, ot_taskid stream, int *served ) {
+  struct ot_fullscrape_snapshot *snapshot, *stale, *seen;
+  int slot = OT_FULLSCRAPE_SNAPSHOT_SLOT( mode );
+
+  *served = 0;
+
+  /* State dumps must be current, deltas are for one client only */
+  if( !g_fullscrape_max_age || ( mode & TASK_FLAG_DELTA ) ||
+      ( mode & TASK_TASK_MASK ) < TASK_FULLSCRAPE || ( mode & TASK_TASK_MASK ) >= TASK_FULLSCRAPE_TRACKERSTATE )
+    return NULL;
+
+  /* A worker missing a snapshot makes it, the others missing it at the
+     same time wait and share what it made, even if that took longer than
+     g_fullscrape_max_age. If it failed, the next one tries. A streaming
+     worker goes at the pace of its client, nobody waits for that */
+  pthread_mutex_lock( &g_snapshot_mutex );
+  seen = g_snapshots[slot];
+  pthread_cleanup_push( fullscrape_snapshot_unlock, NULL );
+  while( g_snapshots_making[slot] && !stream )
+    pthread_cond_wait( &g_snapshot_made, &g_snapshot_mutex );
+  pthread_cleanup_pop( 0 );
+  if( ( snapshot = g_snapshots[slot] ) && ( snapshot != seen || g_now_seconds - snapshot->made < (time_t)g_fullscrape_max_age ) ) {
+    ++snapshot->refcount;
+    pthread_mutex_unlock( &g_snapshot_mutex );
+    stats_issue_event( EVENT_FULLSCRAPE_SNAPSHOT, FLAG_TCP, 1 );
+    return snapshot;
+  }
+  if( g_snapshots_making[slot] ) {
+    pthread_mutex_unlock( &g_snapshot_mutex );
+    stats_issue_event( EVENT_FULLSCRAPE_SNAPSHOT, FLAG_TCP, 0 );
+    return NULL;
+  }
+  g_snapshots_making[slot] = 1;
+  pthread_mutex_unlock( &g_snapshot_mutex );
+  stats_issue_event( EVENT_FULLSCRAPE_SNAPSHOT, FLAG_TCP, 0 );
+
+  if( ( snapshot = malloc( sizeof( struct ot_fullscrape_snapshot ) ) ) ) {
+    snapshot->mode     = mode;
+    snapshot->made     = g_now_seconds;
+    snapshot->refcount = stream ? 1 : 2;
+    if( stream ) {
+      ot_fullscrape_copy copy;
+      int                iovec_entries;
+      struct iovec      *iovector;
+
+      byte_zero( &copy, sizeof( copy ) );
+      fullscrape_make( &iovec_entries, &iovector, mode, 0, 0, stream, &copy );
+      if( mutex_workqueue_pushresult( stream, iovec_entries, iovector ) )
+        iovec_free( &iovec_entries, &iovector );
+      *served = 1;
+      snapshot->iovec_entries = copy.iovec_entries;
+      snapshot->iovector      = copy.iovector;
+    } else
+      fullscrape_make( &snapshot->iovec_entries, &snapshot->iovector, mode, 0, 0, 0, NULL );
+    if( !snapshot->iovec_entries ) {
+      free( snapshot->iovector );
+      free( snapshot );
+      snapshot = NULL;
+    }
+  }
+
+  pthread_mutex_lock( &g_snapshot_mutex );
+  stale = NULL;
+  if( snapshot ) {
+    stale = g_snapshots[slot];
+    g_snapshots[slot] = snapshot;
+  }
+  g_snapshots_making[slot] = 0;
+  pthread_cond_broadcast( &g_snapshot_made );
+  pthread_mutex_unlock( &g_snapshot_mutex );
+
+  if( stale )
+    fullscrape_release( stale );
+  return *served ? NULL : snapshot;
+}
+
+/* This is the entry point into the full scrape worker threads
+   They grab tasks from mutex_tasklist and deliver results back
 */
 static void * fullscrape_worker( void * args ) {
   int iovec_entries;
   struct iovec *iovector;
+  struct ot_fullscrape_snapshot *snapshot;
+  int served;
 
   (void) args;
 
   while( 1 ) {
     ot_tasktype tasktype = TASK_FULLSCRAPE;
-    ot_taskid   taskid   = mutex_workqueue_poptask( &tasktype );
-    fullscrape_make( &iovec_entries, &iovector, tasktype );
-    if( mutex_workqueue_pushresult( taskid, iovec_entries, iovector ) )
-      iovec_free( &iovec_entries, &iovector );
+    ot_time     since    = 0;
+    ot_taskid   taskid   = mutex_workqueue_popdelta( &tasktype, &since );
+    if( ( snapshot = fullscrape_snapshot( tasktype, g_fullscrape_stream ? taskid : 0, &served ) ) ) {
+      if( mutex_workqueue_pushsnapshot( taskid, snapshot->iovec_entries, snapshot->iovector, snapshot ) )
+        fullscrape_release( snapshot );
+    } else if( !served ) {
+      /* Changes in the second we start in may or may not make it in */
+      ot_time cursor = g_now_seconds - 1;
+
+      /* Cursors older than the removals we remember get everything. The
+         main loop tells the client before the first byte goes out */
+      if( !( tasktype & TASK_FLAG_DELTA ) || since < 0 || since + (ot_time)g_delta_window < g_now_seconds )
+        since = 0;
+      if( tasktype & TASK_FLAG_DELTA )
+        mutex_workqueue_pushcursor( taskid, cursor, !since );
+
+      fullscrape_make( &iovec_entries, &iovector, tasktype, since, cursor, g_fullscrape_stream ? taskid : 0, NULL );
+      if( mutex_workqueue_pushresult( taskid, iovec_entries, iovector ) )
+        iovec_free( &iovec_entries, &iovector );
+    }
     if( !g_opentracker_running )
       return NULL;
   }
   return NULL;
 }
 
-static pthread_t thread_id;
+static pthread_t thread_ids[OT_FULLSCRAPE_WORKERS_MAX];
+static pthread_t slice_thread_ids[OT_FULLSCRAPE_SLICES];
 void fullscrape_init( ) {
-  pthread_create( &thread_id, NULL, fullscrape_worker, NULL );
+  unsigned int i;
+
+  if( g_fullscrape_threads >= OT_FULLSCRAPE_SLICES )
+    g_fullscrape_threads = OT_FULLSCRAPE_SLICES - 1;
+  if( !g_fullscrape_workers )
+    g_fullscrape_workers = 1;
+  if( g_fullscrape_workers > OT_FULLSCRAPE_WORKERS_MAX )
+    g_fullscrape_workers = OT_FULLSCRAPE_WORKERS_MAX;
+  for( i=0; i<g_fullscrape_threads; ++i )
+    pthread_create( slice_thread_ids + i, NULL, fullscrape_slice_worker, NULL );
+  for( i=0; i<g_fullscrape_workers; ++i )
+    pthread_create( thread_ids + i, NULL, fullscrape_worker, NULL );
 }
 
 void fullscrape_deinit( ) {
-  pthread_cancel( thread_id );
+  unsigned int i;
+  int slot;
+
+  for( i=0; i<g_fullscrape_workers; ++i )
+    pthread_cancel( thread_ids[i] );
+  for( i=0; i<g_fullscrape_threads; ++i )
+    pthread_cancel( slice_thread_ids[i] );
+  for( slot=0; slot<OT_FULLSCRAPE_SNAPSHOTS; ++slot )
+    if( g_snapshots[slot] ) {
+      fullscrape_release( g_snapshots[slot] );
+      g_snapshots[slot] = NULL;
+    }
+}
+
+void fullscrape_deliver( int64 sock, ot_tasktype tasktype, ot_time since ) {
+  mutex_workqueue_pushdelta( sock, tasktype, since );
+}
+
+/* Buckets are not sorted, but bencoded dictionaries want sorted keys */
+static int fullscrape_compare_record( const void *record1, const void *record2 ) {
+  return memcmp( ((ot_scrape_record*)record1)->hash, ((ot_scrape_record*)record2)->hash, sizeof( ot_hash ) );
 }
 
-void fullscrape_deliver( int64 sock, ot_tasktype tasktype ) {
-  mutex_workqueue_pushtask( sock, tasktype );
+/* A copy that can not be completed is dropped and stays failed */
+static void fullscrape_copy_drop( ot_fullscrape_copy *copy ) {
+  iovec_free( &copy->iovec_entries, &copy->iovector );
+  free( copy->iovector );
+  copy->iovector = NULL;
+  copy->failed   = 1;
 }
 
-static int fullscrape_increase( int *iovec_entries, struct iovec **iovector,
-                         char **r, char **re  WANT_COMPRESSION_GZIP_PARAM( z_stream *strm, ot_tasktype mode, int zaction ) ) {
-  /* Allocate a fresh output buffer at the end of our buffers list */
-  if( !( *r = iovec_fix_increase_or_free( iovec_entries, iovector, *r, OT_SCRAPE_CHUNK_SIZE ) ) ) {
+/* Appends copies of chunks about to be streamed */
+static void fullscrape_copy( ot_fullscrape_copy *copy, int iovec_entries, struct iovec *iovector ) {
+  int i;
 
-    /* Deallocate gzip buffers */
-    IF_COMPRESSION( deflateEnd(strm); )
+  for( i=0; i<iovec_entries && !copy->failed; ++i ) {
+    char *chunk = iovec_increase( &copy->iovec_entries, &copy->iovector, iovector[i].iov_len );
+    if( !chunk )
+      fullscrape_copy_drop( copy );
+    else
+      memcpy( chunk, iovector[i].iov_base, iovector[i].iov_len );
+  }
+}
+
+/* Hands the chunks of a streamed slice to the main loop, except for the
+   last keep ones still being written to */
+static int fullscrape_stream( ot_fullscrape_slice *slice, int keep ) {
+  int           count = slice->iovec_entries - keep;
+  struct iovec *chunks;
+
+  if( count <= 0 ) return 0;
+  if( !( chunks = malloc( count * sizeof( struct iovec ) ) ) )
+    return -1;
+  memcpy( chunks, slice->iovector, count * sizeof( struct iovec ) );
+  memmove( slice->iovector, slice->iovector + count, keep * sizeof( struct iovec ) );
+  slice->iovec_entries = keep;
+
+  if( slice->copy )
+    fullscrape_copy( slice->copy, count, chunks );
+  return mutex_workqueue_pushchunk( slice->taskid, count, chunks );
+}
+
+/* Opens a fresh output buffer at the end of the slice's buffer list, re
+   is set reserve bytes before its end */
+static int fullscrape_increase( ot_fullscrape_slice *slice, char **r, char **re, size_t reserve ) {
+  if( !( *r = iovec_fix_increase_or_free( &slice->iovec_entries, &slice->iovector, *r, OT_SCRAPE_CHUNK_SIZE ) ) )
+    return -1;
 
-    /* Release lock on current bucket and return */
+  /* Full chunks of streamed slices go out right away */
+  if( slice->taskid && fullscrape_stream( slice, 1 ) ) {
+    iovec_free( &slice->iovec_entries, &slice->iovector );
     return -1;
   }
 
-  /* Adjust new end of output buffer */
-  *re = *r + OT_SCRAPE_CHUNK_SIZE - OT_SCRAPE_MAXENTRYLEN;
+  *re = *r + OT_SCRAPE_CHUNK_SIZE - reserve;
+  return 0;
+}
 
-  /* When compressing, we have all the bytes in output buffer */
+#ifdef WANT_COMPRESSION
+static int fullscrape_encoder_init( ot_fullscrape_encoder *enc, ot_tasktype mode ) {
+  byte_zero( enc, sizeof( ot_fullscrape_encoder ) );
+  enc->mode = mode;
 #ifdef WANT_COMPRESSION_GZIP
-  if( mode & TASK_FLAG_GZIP ) {
-    int zres;
-    *re -= OT_SCRAPE_MAXENTRYLEN;
-    strm->next_out  = (uint8_t*)*r;
-    strm->avail_out = OT_SCRAPE_CHUNK_SIZE;
-    zres = deflate( strm, zaction );
-    if( ( zres < Z_OK ) && ( zres != Z_BUF_ERROR ) )
-      fprintf( stderr, "deflate() failed while in fullscrape_increase(%d).\n", zaction );
-    *r = (char*)strm->next_out;
+  /* Raw deflate, fullscrape_make wraps the slices into one gzip stream */
+  if( mode & TASK_FLAG_GZIP )
+    return deflateInit2( &enc->strm, 7, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) == Z_OK ? 0 : -1;
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+  if( mode & TASK_FLAG_ZSTD ) {
+    if( !( enc->zctx = ZSTD_createCCtx( ) ) )
+      return -1;
+    ZSTD_CCtx_setParameter( enc->zctx, ZSTD_c_compressionLevel, g_zstd_level );
   }
 #endif
-
   return 0;
 }
 
-static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode ) {
+static void fullscrape_encoder_end( ot_fullscrape_encoder *enc ) {
+#ifdef WANT_COMPRESSION_GZIP
+  if( enc->mode & TASK_FLAG_GZIP )
+    deflateEnd( &enc->strm );
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+  ZSTD_freeCCtx( enc->zctx );
+  enc->zctx = NULL;
+#endif
+}
+
+/* Compresses len bytes from in to r, opening new output buffers when re
+   is reached. finish ends the slice's stream. On failure, the encoder and
+   the slice's buffers are released */
+static int fullscrape_encode( ot_fullscrape_slice *slice, ot_fullscrape_encoder *enc, char **r, char **re, char *in, size_t len, int finish ) {
+#ifdef WANT_COMPRESSION_GZIP
+  if( enc->mode & TASK_FLAG_GZIP ) {
+    /* All but the last slice end byte aligned without a final block */
+    int zaction = !finish ? Z_NO_FLUSH : slice->last_bucket == OT_BUCKET_COUNT ? Z_FINISH : Z_SYNC_FLUSH, zres;
+
+    slice->crc     = crc32( slice->crc, (Bytef*)in, len );
+    slice->length += len;
+    enc->strm.next_in  = (uint8_t*)in;
+    enc->strm.avail_in = len;
+    while( 1 ) {
+      enc->strm.next_out  = (uint8_t*)*r;
+      enc->strm.avail_out = *re - *r;
+      zres = deflate( &enc->strm, zaction );
+      *r = (char*)enc->strm.next_out;
+      if( ( zres < Z_OK ) && ( zres != Z_BUF_ERROR ) ) {
+        fprintf( stderr, "deflate() failed while in fullscrape_encode().\n" );
+        break;
+      }
+      /* Space left means deflate has taken and flushed all it needs to */
+      if( enc->strm.avail_out )
+        return 0;
+      if( fullscrape_increase( slice, r, re, 0 ) ) {
+        fullscrape_encoder_end( enc );
+        return -1;
+      }
+    }
+  }
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+  if( enc->mode & TASK_FLAG_ZSTD ) {
+    ZSTD_inBuffer input = { in, len, 0 };
+    while( 1 ) {
+      ZSTD_outBuffer output = { *r, *re - *r, 0 };
+      size_t remaining = ZSTD_compressStream2( enc->zctx, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue );
+      *r += output.pos;
+      if( ZSTD_isError( remaining ) ) {
+        fprintf( stderr, "ZSTD_compressStream2() failed while in fullscrape_encode().\n" );
+        break;
+      }
+      if( input.pos == input.size && ( !finish || !remaining ) )
+        return 0;
+      if( *r == *re && fullscrape_increase( slice, r, re, 0 ) ) {
+        fullscrape_encoder_end( enc );
+        return -1;
+      }
+    }
+  }
+#endif
+  fullscrape_encoder_end( enc );
+  iovec_free( &slice->iovec_entries, &slice->iovector );
+  return -1;
+}
+#endif
+
+static void fullscrape_make_slice( ot_fullscrape_slice *slice, ot_tasktype mode ) {
+  int     *iovec_entries = &slice->iovec_entries;
+  struct iovec **iovector = &slice->iovector;
   int      bucket;
   char    *r, *re;
-#ifdef WANT_COMPRESSION_GZIP
-  char     compress_buffer[OT_SCRAPE_MAXENTRYLEN];
-  z_stream strm;
+  ot_scrape_record *records = NULL;
+  size_t   records_space = 0;
+#ifdef WANT_COMPRESSION
+  char     compress_buffer[OT_SCRAPE_STAGING_SIZE];
+  char    *out = NULL, *oe = NULL;
+  ot_fullscrape_encoder enc;
 #endif
 
   /* Setup return vector... */
+  slice->failed = 1;
   *iovec_entries = 0;
   *iovector = NULL;
   if( !( r = iovec_increase( iovec_entries, iovector, OT_SCRAPE_CHUNK_SIZE ) ) )
@@ -133,116 +497,335 @@ static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tas
   /* re points to low watermark */
   re = r + OT_SCRAPE_CHUNK_SIZE - OT_SCRAPE_MAXENTRYLEN;
 
-#ifdef WANT_COMPRESSION_GZIP
-  if( mode & TASK_FLAG_GZIP ) {
-    re += OT_SCRAPE_MAXENTRYLEN;
-    byte_zero( &strm, sizeof(strm) );
-    strm.next_in   = (uint8_t*)compress_buffer;
-    strm.next_out  = (uint8_t*)r;
-    strm.avail_out = OT_SCRAPE_CHUNK_SIZE;
-    if( deflateInit2(&strm,7,Z_DEFLATED,31,8,Z_DEFAULT_STRATEGY) != Z_OK )
-      fprintf( stderr, "not ok.\n" );
-    r = compress_buffer;
+  /* When compressing, entries are staged in compress_buffer and the
+     compressed bytes fill the whole output buffer */
+#ifdef WANT_COMPRESSION
+  if( mode & ( TASK_FLAG_GZIP | TASK_FLAG_ZSTD ) ) {
+    out = r;
+    oe  = r + OT_SCRAPE_CHUNK_SIZE;
+    r   = compress_buffer;
+    if( fullscrape_encoder_init( &enc, mode ) ) {
+      fullscrape_encoder_end( &enc );
+      iovec_free( iovec_entries, iovector );
+      return;
+    }
   }
 #endif
 
-  if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
-    r += sprintf( r, "d5:filesd" );
+  if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE && !slice->first_bucket ) {
+    *r++ = 'd';
+    if( mode & TASK_FLAG_DELTA ) {
+      r += bencode_literal( r, "6:cursor" );
+      r += bencode_int( r, slice->cursor );
+    }
+    r += bencode_literal( r, "5:filesd" );
+  }
 
   /* For each bucket... */
-  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
+  for( bucket=slice->first_bucket; bucket<slice->last_bucket; ++bucket ) {
     /* Get exclusive access to that bucket */
-    ot_vector *torrents_list = mutex_bucket_lock( bucket );
-    size_t tor_offset;
+    ot_vector        *torrents_list = mutex_bucket_lock( bucket );
+    ot_torrent       *torrents = (ot_torrent*)(torrents_list->data);
+    size_t            record_count = torrents_list->size, tor_offset, removal_count = 0;
+    ot_removal       *removals = NULL;
+    ot_scrape_record *record;
+
+    /* Deltas skip buckets without changes and list removed torrents, too */
+    if( slice->since ) {
+      if( mutex_bucket_changes( bucket, &removals, &removal_count ) < slice->since ) {
+        mutex_bucket_unlock( bucket, 0 );
+        continue;
+      }
+      record_count += removal_count;
+    }
 
-    /* For each torrent in this bucket.. */
+    /* Make room for a copy of all torrents in this bucket */
+    if( record_count > records_space ) {
+      ot_scrape_record *new_records = realloc( records, record_count * sizeof( ot_scrape_record ) );
+      if( !new_records ) {
+        mutex_bucket_unlock( bucket, 0 );
+        IF_COMPRESSION( fullscrape_encoder_end( &enc ); )
+        iovec_free( iovec_entries, iovector );
+        free( records );
+        return;
+      }
+      records       = new_records;
+      records_space = record_count;
+    }
+
+    record = records;
     for( tor_offset=0; tor_offset<torrents_list->size; ++tor_offset ) {
-      /* Address torrents members */
-      ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[tor_offset] ).peer_list;
-      ot_hash     *hash      =&( ((ot_torrent*)(torrents_list->data))[tor_offset] ).hash;
+      ot_peerlist *peer_list = torrents[tor_offset].peer_list;
+      if( peer_list->changed < slice->since )
+        continue;
+      memcpy( record->hash, torrents[tor_offset].hash, sizeof(ot_hash) );
+      record->base       = peer_list->base;
+      record->seed_count = peer_list->seed_count;
+      record->peer_count = peer_list->peer_count;
+      record->down_count = peer_list->down_count;
+      ++record;
+    }
+
+    /* Removed torrents show up without peers, unless they are back */
+    for( ; removal_count; --removal_count, ++removals )
+      if( removals->removed >= slice->since && !vector_find_torrent( torrents_list, removals->hash ) ) {
+        byte_zero( record, sizeof( ot_scrape_record ) );
+        memcpy( record->hash, removals->hash, sizeof(ot_hash) );
+        ++record;
+      }
+    record_count = record - records;
+
+    /* All torrents copied: release lock on current bucket */
+    mutex_bucket_unlock( bucket, 0 );
+
+    /* Sorting also brings together torrents removed more than once */
+    if( record_count && ( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE || slice->since ) )
+      qsort( records, record_count, sizeof( ot_scrape_record ), fullscrape_compare_record );
+
+    /* For each torrent in this bucket.. */
+    for( record=records; record<records+record_count; ++record ) {
+      if( slice->since && record > records && !memcmp( record->hash, record[-1].hash, sizeof(ot_hash) ) )
+        continue;
 
       switch( mode & TASK_TASK_MASK ) {
       case TASK_FULLSCRAPE:
       default:
         /* push hash as bencoded string */
-        *r++='2'; *r++='0'; *r++=':';
-        memcpy( r, hash, sizeof(ot_hash) ); r += sizeof(ot_hash);
+        r += bencode_string( r, record->hash, sizeof(ot_hash) );
         /* push rest of the scrape string */
-        r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee", peer_list->seed_count, peer_list->down_count, peer_list->peer_count-peer_list->seed_count );
+        r += bencode_literal( r, "d8:complete" );    r += bencode_int( r, record->seed_count );
+        r += bencode_literal( r, "10:downloaded" );  r += bencode_int( r, record->down_count );
+        r += bencode_literal( r, "10:incomplete" );  r += bencode_int( r, record->peer_count-record->seed_count );
+        *r++ = 'e';
 
         break;
       case TASK_FULLSCRAPE_TPB_ASCII:
-        to_hex( r, *hash ); r+= 2 * sizeof(ot_hash);
-        r += sprintf( r, ":%zd:%zd\n", peer_list->seed_count, peer_list->peer_count-peer_list->seed_count );
+        to_hex( r, record->hash ); r+= 2 * sizeof(ot_hash);
+        *r++ = ':'; r += bencode_decimal( r, record->seed_count );
+        *r++ = ':'; r += bencode_decimal( r, record->peer_count-record->seed_count );
+        *r++ = '\n';
         break;
       case TASK_FULLSCRAPE_TPB_ASCII_PLUS:
-        to_hex( r, *hash ); r+= 2 * sizeof(ot_hash);
-        r += sprintf( r, ":%zd:%zd:%zd\n", peer_list->seed_count, peer_list->peer_count-peer_list->seed_count, peer_list->down_count );
+        to_hex( r, record->hash ); r+= 2 * sizeof(ot_hash);
+        *r++ = ':'; r += bencode_decimal( r, record->seed_count );
+        *r++ = ':'; r += bencode_decimal( r, record->peer_count-record->seed_count );
+        *r++ = ':'; r += bencode_decimal( r, record->down_count );
+        *r++ = '\n';
         break;
       case TASK_FULLSCRAPE_TPB_BINARY:
-        memcpy( r, *hash, sizeof(ot_hash) ); r += sizeof(ot_hash);
-        *(uint32_t*)(r+0) = htonl( (uint32_t)  peer_list->seed_count );
-        *(uint32_t*)(r+4) = htonl( (uint32_t)( peer_list->peer_count-peer_list->seed_count) );
+        memcpy( r, record->hash, sizeof(ot_hash) ); r += sizeof(ot_hash);
+        *(uint32_t*)(r+0) = htonl( (uint32_t)  record->seed_count );
+        *(uint32_t*)(r+4) = htonl( (uint32_t)( record->peer_count-record->seed_count) );
         r+=8;
         break;
       case TASK_FULLSCRAPE_TPB_URLENCODED:
-        r += fmt_urlencoded( r, (char *)*hash, 20 );
-        r += sprintf( r, ":%zd:%zd\n", peer_list->seed_count, peer_list->peer_count-peer_list->seed_count );
+        r += fmt_urlencoded( r, (char *)record->hash, 20 );
+        *r++ = ':'; r += bencode_decimal( r, record->seed_count );
+        *r++ = ':'; r += bencode_decimal( r, record->peer_count-record->seed_count );
+        *r++ = '\n';
         break;
       case TASK_FULLSCRAPE_TRACKERSTATE:
-        to_hex( r, *hash ); r+= 2 * sizeof(ot_hash);
-        r += sprintf( r, ":%zd:%zd\n", peer_list->base, peer_list->down_count );
+        to_hex( r, record->hash ); r+= 2 * sizeof(ot_hash);
+        *r++ = ':'; r += bencode_decimal_signed( r, record->base );
+        *r++ = ':'; r += bencode_decimal( r, record->down_count );
+        *r++ = '\n';
         break;
       }
 
-#ifdef WANT_COMPRESSION_GZIP
-     if( mode & TASK_FLAG_GZIP ) {
-        int zres;
-        strm.next_in  = (uint8_t*)compress_buffer;
-        strm.avail_in = r - compress_buffer;
-        zres = deflate( &strm, Z_NO_FLUSH );
-        if( ( zres < Z_OK ) && ( zres != Z_BUF_ERROR ) )
-          fprintf( stderr, "deflate() failed while in fullscrape_make().\n" );
-        r = (char*)strm.next_out;
+#ifdef WANT_COMPRESSION
+      if( mode & ( TASK_FLAG_GZIP | TASK_FLAG_ZSTD ) ) {
+        if( r < compress_buffer + OT_SCRAPE_STAGING_SIZE - OT_SCRAPE_MAXENTRYLEN )
+          continue;
+        if( fullscrape_encode( slice, &enc, &out, &oe, compress_buffer, r - compress_buffer, 0 ) ) {
+          free( records );
+          return;
+        }
+        r = compress_buffer;
+        continue;
       }
 #endif
 
       /* Check if there still is enough buffer left */
-      while( r >= re )
-       if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_NO_FLUSH ) ) )
-         return mutex_bucket_unlock( bucket, 0 );
+      if( r >= re && fullscrape_increase( slice, &r, &re, OT_SCRAPE_MAXENTRYLEN ) ) {
+        free( records );
+        return;
+      }
+    }
 
-      IF_COMPRESSION( r = compress_buffer; )
+    /* Parent thread died? */
+    if( !g_opentracker_running ) {
+      IF_COMPRESSION( fullscrape_encoder_end( &enc ); )
+      iovec_free( iovec_entries, iovector );
+      free( records );
+      return;
     }
+  }
 
-    /* All torrents done: release lock on current bucket */
-    mutex_bucket_unlock( bucket, 0 );
+  free( records );
 
-    /* Parent thread died? */
-    if( !g_opentracker_running )
+  if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE && slice->last_bucket == OT_BUCKET_COUNT ) {
+    *r++ = 'e';
+    /* Tell deltas from complete lists, after which clients drop the rest */
+    if( mode & TASK_FLAG_DELTA ) {
+      r += bencode_literal( r, "4:full" );
+      r += bencode_int( r, !slice->since );
+    }
+    *r++ = 'e';
+  }
+
+#ifdef WANT_COMPRESSION
+  if( mode & ( TASK_FLAG_GZIP | TASK_FLAG_ZSTD ) ) {
+    if( fullscrape_encode( slice, &enc, &out, &oe, compress_buffer, r - compress_buffer, 1 ) )
       return;
+    fullscrape_encoder_end( &enc );
+    r = out;
+  }
+#endif
+
+  /* Release unused memory in current output buffer */
+  iovec_fixlast( iovec_entries, iovector, r );
+
+  /* The next slice's chunks must not overtake ours */
+  if( slice->taskid && fullscrape_stream( slice, 0 ) )
+    return;
+  slice->failed = 0;
+}
+
+/* Takes slices off the current job until there are none left. Called and
+   returns with g_slice_mutex held */
+static void fullscrape_take_slices( void ) {
+  while( g_slices && g_slice_next < OT_FULLSCRAPE_SLICES ) {
+    ot_fullscrape_slice *slice = g_slices + g_slice_next++;
+    ot_tasktype          mode  = g_slice_mode;
+
+    pthread_mutex_unlock( &g_slice_mutex );
+    fullscrape_make_slice( slice, mode );
+    pthread_mutex_lock( &g_slice_mutex );
+
+    if( ++g_slices_done == OT_FULLSCRAPE_SLICES )
+      pthread_cond_signal( &g_slices_finished );
+  }
+}
+
+static void * fullscrape_slice_worker( void * args ) {
+  (void) args;
+
+  pthread_mutex_lock( &g_slice_mutex );
+  while( 1 ) {
+    while( !g_slices || g_slice_next == OT_FULLSCRAPE_SLICES )
+      pthread_cond_wait( &g_slices_waiting, &g_slice_mutex );
+    fullscrape_take_slices( );
   }
+  return NULL;
+}
+
+static void fullscrape_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode, ot_time since, ot_time cursor, ot_taskid stream, ot_fullscrape_copy *copy ) {
+  ot_fullscrape_slice slices[OT_FULLSCRAPE_SLICES];
+  int                 slice, failed = 0, buckets_per_slice = OT_BUCKET_COUNT / OT_FULLSCRAPE_SLICES;
+
+  *iovec_entries = 0;
+  *iovector = NULL;
 
-  if( ( mode & TASK_TASK_MASK ) == TASK_FULLSCRAPE )
-    r += sprintf( r, "ee" );
+  byte_zero( slices, sizeof( slices ) );
+  for( slice=0; slice<OT_FULLSCRAPE_SLICES; ++slice ) {
+    slices[slice].first_bucket = slice * buckets_per_slice;
+    slices[slice].last_bucket  = slices[slice].first_bucket + buckets_per_slice;
+    slices[slice].since        = since;
+    slices[slice].cursor       = cursor;
+    slices[slice].taskid       = stream;
+    slices[slice].copy         = copy;
+  }
 
 #ifdef WANT_COMPRESSION_GZIP
+  /* Deflate, no flags, no mtime, unix */
   if( mode & TASK_FLAG_GZIP ) {
-    strm.next_in  = (uint8_t*)compress_buffer;
-    strm.avail_in = r - compress_buffer;
-    if( deflate( &strm, Z_FINISH ) < Z_OK )
-      fprintf( stderr, "deflate() failed while in fullscrape_make()'s endgame.\n" );
-    r = (char*)strm.next_out;
+    static const char gzip_header[10] = { 0x1f, (char)0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    char *header = iovec_increase( iovec_entries, iovector, sizeof( gzip_header ) );
+    if( !header ) {
+      iovec_free( iovec_entries, iovector );
+      free( *iovector );
+      *iovector = NULL;
+      return;
+    }
+    memcpy( header, gzip_header, sizeof( gzip_header ) );
+    /* The chunk belongs to the work queue now, even if it failed */
+    if( stream ) {
+      if( copy )
+        fullscrape_copy( copy, *iovec_entries, *iovector );
+      failed = mutex_workqueue_pushchunk( stream, *iovec_entries, *iovector );
+      *iovec_entries = 0;
+      *iovector = NULL;
+      if( failed ) {
+        if( copy )
+          fullscrape_copy_drop( copy );
+        return;
+      }
+    }
+  }
+#endif
+
+  /* The slice workers help one full scrape at a time, others make their
+     slices on their own */
+  pthread_mutex_lock( &g_slice_mutex );
+  if( stream || g_slices ) {
+    pthread_mutex_unlock( &g_slice_mutex );
+    /* Streamed slices must be made in order, one after the other. So are
+       those the slice workers are too busy for */
+    for( slice=0; slice<OT_FULLSCRAPE_SLICES && !failed; ++slice ) {
+      fullscrape_make_slice( slices + slice, mode );
+      failed = slices[slice].failed;
+    }
+  } else {
+    /* Hand the slices to the slice workers and join in */
+    g_slices      = slices;
+    g_slice_mode  = mode;
+    g_slice_next  = g_slices_done = 0;
+    pthread_cond_broadcast( &g_slices_waiting );
+    fullscrape_take_slices( );
+    while( g_slices_done < OT_FULLSCRAPE_SLICES )
+      pthread_cond_wait( &g_slices_finished, &g_slice_mutex );
+    g_slices = NULL;
+    pthread_mutex_unlock( &g_slice_mutex );
+
+    for( slice=0; slice<OT_FULLSCRAPE_SLICES; ++slice )
+      if( slices[slice].failed )
+        failed = 1;
+  }
 
-    while( r >= re )
-      if( fullscrape_increase( iovec_entries, iovector, &r, &re WANT_COMPRESSION_GZIP_PARAM( &strm, mode, Z_FINISH ) ) )
-        return mutex_bucket_unlock( bucket, 0 );
-    deflateEnd(&strm);
+  /* Stitch the slices together in bucket order */
+  for( slice=0; slice<OT_FULLSCRAPE_SLICES; ++slice ) {
+    if( !failed && iovec_concat( iovec_entries, iovector, &slices[slice].iovec_entries, &slices[slice].iovector ) )
+      failed = 1;
+    iovec_free( &slices[slice].iovec_entries, &slices[slice].iovector );
+    free( slices[slice].iovector );
+  }
+
+#ifdef WANT_COMPRESSION_GZIP
+  if( !failed && ( mode & TASK_FLAG_GZIP ) ) {
+    uLong     crc    = slices[0].crc;
+    uLong     length = slices[0].length;
+    uint32_t *trailer;
+
+    for( slice=1; slice<OT_FULLSCRAPE_SLICES; ++slice ) {
+      crc     = crc32_combine( crc, slices[slice].crc, slices[slice].length );
+      length += slices[slice].length;
+    }
+    if( ( trailer = iovec_increase( iovec_entries, iovector, 8 ) ) ) {
+      uint32_pack( (char*)trailer, crc );
+      uint32_pack( (char*)( trailer + 1 ), length );
+    } else
+      failed = 1;
   }
 #endif
 
-  /* Release unused memory in current output buffer */
-  iovec_fixlast( iovec_entries, iovector, r );
+  if( failed )
+    iovec_free( iovec_entries, iovector );
+
+  /* A stream cut short is no snapshot */
+  if( copy && failed )
+    fullscrape_copy_drop( copy );
+  else if( copy )
+    fullscrape_copy( copy, *iovec_entries, *iovector );
 }
 #endif
 
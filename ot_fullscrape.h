@@ -6,16 +6,47 @@
 #ifndef OT_FULLSCRAPE_H__
 #define OT_FULLSCRAPE_H__
 
+/* Full scrapes are kept this many seconds and handed to every client asking
+   for the same format in that time, see tracker.fullscrape_max_age. 0 makes
+   one for every request */
+#define OT_FULLSCRAPE_MAX_AGE 60
+
+/* Threads helping the full scrape worker, see tracker.fullscrape_threads */
+#define OT_FULLSCRAPE_THREADS 3
+
+/* Full scrape workers taking requests off the queue, so that one big full
+   scrape does not hold up all others, see tracker.fullscrape_workers */
+#define OT_FULLSCRAPE_WORKERS     1
+#define OT_FULLSCRAPE_WORKERS_MAX 16
+
+/* With tracker.fullscrape_stream, full scrapes that are not cached go out
+   while they are made. Making pauses while this many bytes wait to be
+   sent */
+#define OT_FULLSCRAPE_STREAM_BACKLOG (2*1024*1024)
+
+struct ot_fullscrape_snapshot;
+
 #ifdef WANT_FULLSCRAPE
 
 void fullscrape_init( );
 void fullscrape_deinit( );
-void fullscrape_deliver( int64 sock, ot_tasktype tasktype );
+/* With TASK_FLAG_DELTA set, only torrents that changed or went away since
+   the cursor since are listed, the latter with no peers */
+void fullscrape_deliver( int64 sock, ot_tasktype tasktype, ot_time since );
+
+/* Drops a reference on a snapshot, the last one frees it */
+void fullscrape_release( struct ot_fullscrape_snapshot *snapshot );
+
+extern unsigned int g_fullscrape_max_age;
+extern unsigned int g_fullscrape_threads;
+extern unsigned int g_fullscrape_workers;
+extern unsigned int g_fullscrape_stream;
 
 #else
 
 #define fullscrape_init()
 #define fullscrape_deinit()
+#define fullscrape_release( snapshot )
 
 #endif
 
@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <ctype.h>
 #include <pthread.h>
 
 /* Libowfat */
@@ -29,25 +30,100 @@
 #include "ot_fullscrape.h"
 #include "ot_stats.h"
 #include "ot_accesslist.h"
+#include "ot_bencode.h"
 
 #define OT_MAXMULTISCRAPE_COUNT 64
 extern char *g_redirecturl;
 
-char   *g_stats_path;
-ssize_t g_stats_path_len;
+char        *g_stats_path;
+ssize_t      g_stats_path_len;
+unsigned int g_keepalive_timeout = OT_KEEPALIVE_TIMEOUT;
+unsigned int g_keepalive_max_requests = OT_KEEPALIVE_MAX_REQUESTS;
+unsigned int g_zstd_level = OT_ZSTD_LEVEL;
 
 enum {
-  SUCCESS_HTTP_HEADER_LENGTH = 80,
+  SUCCESS_HTTP_HEADER_LENGTH = 104,
   SUCCESS_HTTP_HEADER_LENGTH_CONTENT_ENCODING = 32,
-  SUCCESS_HTTP_SIZE_OFF = 17 };
+  SUCCESS_HTTP_HEADER_LENGTH_DELTA = 72,
+  SUCCESS_HTTP_SIZE_OFF = 41 };
+
+/* Only connections that may persist speak HTTP/1.1, and then every reply
+   on them does. Replies that end one say so, 1.1 clients expect more */
+#ifdef WANT_KEEPALIVE
+#define OT_HTTP_VERSION "HTTP/1.1"
+#define OT_HTTP_CLOSE   "Connection: close\r\n"
+#else
+#define OT_HTTP_VERSION "HTTP/1.0"
+#define OT_HTTP_CLOSE   ""
+#endif
+
+/* Output buffers of G_OUTBUF_SIZE bytes, traded for the workstruct's outbuf
+   when a reply does not go out in one write. The connection keeps the old
+   outbuf until its batch is sent, so the rest of the reply is not copied */
+#define OT_OUTBUF_POOL_MAX 64
+static pthread_mutex_t g_outbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char           *g_outbuf_pool[OT_OUTBUF_POOL_MAX];
+static unsigned int    g_outbuf_pooled;
+
+static char *http_outbuf_get( void ) {
+  char *outbuf = NULL;
+  pthread_mutex_lock( &g_outbuf_mutex );
+  if( g_outbuf_pooled )
+    outbuf = g_outbuf_pool[--g_outbuf_pooled];
+  pthread_mutex_unlock( &g_outbuf_mutex );
+  return outbuf ? outbuf : malloc( G_OUTBUF_SIZE );
+}
+
+static void http_outbuf_put( char *outbuf ) {
+  pthread_mutex_lock( &g_outbuf_mutex );
+  if( g_outbuf_pooled < OT_OUTBUF_POOL_MAX ) {
+    g_outbuf_pool[g_outbuf_pooled++] = outbuf;
+    outbuf = NULL;
+  }
+  pthread_mutex_unlock( &g_outbuf_mutex );
+  free( outbuf );
+}
+
+void http_release_output( struct http_data *cookie ) {
+  iob_reset( &cookie->batch );
+  cookie->pending      = NULL;
+  cookie->pending_size = 0;
+  if( cookie->outbuf ) {
+    http_outbuf_put( cookie->outbuf );
+    cookie->outbuf = NULL;
+  }
+  if( cookie->snapshot ) {
+    fullscrape_release( cookie->snapshot );
+    cookie->snapshot = NULL;
+  }
+}
+
+size_t http_header_complete( char * request, ssize_t byte_count ) {
+  int i = 0, state = 0;
+
+  for( i=1; i < byte_count; i+=2 )
+    if( request[i] <= 13 ) {
+      i--;
+      for( state = 0 ; i < byte_count; ++i ) {
+        char c = request[i];
+        if( c == '\r' || c == '\n' )
+          state = ( state >> 2 ) | ( ( c << 6 ) & 0xc0 );
+        else
+          break;
+        if( state >= 0xa0 || state == 0x99 ) return i + 1;
+      }
+  }
+  return 0;
+}
 
 static void http_senddata( const int64 sock, struct ot_workstruct *ws ) {
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = ws->cookie;
   ssize_t written_size;
 
-  if( !cookie ) { io_close(sock); return; }
+  if( !cookie ) { ws->keep_alive = 0; io_close(sock); return; }
 
-  /* whoever sends data is not interested in its input-array */
+  /* whoever sends data is not interested in its input-array, but in a
+     kept alive connection the next requests may already be in there */
   if( ws->keep_alive && ws->header_size != ws->request_size ) {
     size_t rest = ws->request_size - ws->header_size;
     if( array_start(&cookie->request) ) {
@@ -61,28 +137,62 @@ static void http_senddata( const int64 sock, struct ot_workstruct *ws ) {
   written_size = write( sock, ws->reply, ws->reply_size );
   if( ( written_size < 0 ) || ( ( written_size == ws->reply_size ) && !ws->keep_alive ) ) {
     array_reset( &cookie->request );
+    ws->keep_alive = 0;
+    /* tcp workers close their connections themselves */
+    if( cookie->flag & STRUCT_HTTP_FLAG_WORKER ) return;
     free( cookie ); io_close( sock ); return;
   }
 
   if( written_size < ws->reply_size ) {
+    size_t rest = ws->reply_size - written_size;
     char * outbuf;
     tai6464 t;
 
-    if( !( outbuf = malloc( ws->reply_size - written_size ) ) ) {
+    /* Replies are built in ws->outbuf. Leave it to the batch, or to the
+       tcp worker, and go on with a fresh one. If we can not get one, copy
+       the rest, tcp workers give up on the connection instead */
+    if( ( outbuf = http_outbuf_get( ) ) ) {
+      if( cookie->flag & STRUCT_HTTP_FLAG_WORKER ) {
+        cookie->pending      = ws->reply + written_size;
+        cookie->pending_size = rest;
+      } else
+        iob_addbuf( &cookie->batch, ws->reply + written_size, rest );
+      cookie->outbuf = ws->outbuf;
+      ws->outbuf = outbuf;
+      stats_issue_event( EVENT_PARTIAL_WRITE, FLAG_TCP, 0 );
+    } else if( !( cookie->flag & STRUCT_HTTP_FLAG_WORKER ) && ( outbuf = malloc( rest ) ) ) {
+      memcpy( outbuf, ws->reply + written_size, rest );
+      iob_addbuf_free( &cookie->batch, outbuf, rest );
+      stats_issue_event( EVENT_PARTIAL_WRITE, FLAG_TCP, 1 );
+    } else {
       array_reset( &cookie->request );
+      ws->keep_alive = 0;
+      if( cookie->flag & STRUCT_HTTP_FLAG_WORKER ) return;
       free(cookie); io_close( sock );
       return;
     }
 
-    memcpy( outbuf, ws->reply + written_size, ws->reply_size - written_size );
-    iob_addbuf_free( &cookie->batch, outbuf, ws->reply_size - written_size );
+    /* Pipelined requests wait until this reply is out, see handle_write */
+    if( ws->keep_alive )
+      cookie->flag |= STRUCT_HTTP_FLAG_KEEPALIVE;
+
+    /* tcp workers wait for their sockets to take the rest themselves */
+    if( cookie->flag & STRUCT_HTTP_FLAG_WORKER )
+      return;
 
     /* writeable short data sockets just have a tcp timeout */
-    if( !ws->keep_alive ) {
-      taia_uint( &t, 0 ); io_timeout( sock, t );
-      io_dontwantread( sock );
-    }
+    taia_uint( &t, 0 ); io_timeout( sock, t );
+    io_dontwantread( sock );
     io_wantwrite( sock );
+  } else if( cookie->flag & STRUCT_HTTP_FLAG_WORKER )
+    /* Kept alive, the tcp worker waits for the next request */
+    return;
+  else {
+    /* Kept alive connections wait for the next request a shorter while */
+    tai6464 t;
+    taia_uint( &t, 0 );
+    tai_unix( &(t.sec), (g_now_seconds + g_keepalive_timeout) );
+    io_timeout( sock, t );
   }
 }
 
@@ -100,11 +210,13 @@ ssize_t http_issue_error( const int64 sock, struct ot_workstruct *ws, int code )
                          "403 Not Modest", "403 Access Denied", "404 Not Found", "500 Internal Server Error" };
   char *title = error_code[code];
 
+  /* Errors end the connection */
+  ws->keep_alive = 0;
   ws->reply = ws->outbuf;
   if( code == CODE_HTTPERROR_302 )
-    ws->reply_size = snprintf( ws->reply, G_OUTBUF_SIZE, "HTTP/1.0 302 Found\r\nContent-Length: 0\r\nLocation: %s\r\n\r\n", g_redirecturl );
+    ws->reply_size = snprintf( ws->reply, G_OUTBUF_SIZE, OT_HTTP_VERSION " 302 Found\r\n" OT_HTTP_CLOSE "Content-Length: 0\r\nLocation: %s\r\n\r\n", g_redirecturl );
   else
-    ws->reply_size = snprintf( ws->reply, G_OUTBUF_SIZE, "HTTP/1.0 %s\r\nContent-Type: text/html\r\nContent-Length: %zd\r\n\r\n<title>%s</title>\n", title, strlen(title)+16-4,title+4);
+    ws->reply_size = snprintf( ws->reply, G_OUTBUF_SIZE, OT_HTTP_VERSION " %s\r\n" OT_HTTP_CLOSE "Content-Type: text/html\r\nContent-Length: %zd\r\n\r\n<title>%s</title>\n", title, strlen(title)+16-4,title+4);
 
 #ifdef _DEBUG_HTTPERROR
   fprintf( stderr, "DEBUG: invalid request was: %s\n", ws->debugbuf );
@@ -114,8 +226,16 @@ ssize_t http_issue_error( const int64 sock, struct ot_workstruct *ws, int code )
   return ws->reply_size = -2;
 }
 
-ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector ) {
-  struct http_data *cookie = io_getcookie( sock );
+/* Snapshots are shared, they only lose our reference */
+static void http_free_iovec( int *iovec_entries, struct iovec **iovector, struct ot_fullscrape_snapshot *snapshot ) {
+  if( snapshot )
+    fullscrape_release( snapshot );
+  else
+    iovec_free( iovec_entries, iovector );
+}
+
+ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector, struct ot_fullscrape_snapshot *snapshot, int partial, ot_time cursor, int full ) {
+  struct http_data *cookie = ws->cookie = io_getcookie( sock );
   char *header;
   int i;
   size_t header_size, size = iovec_length( &iovec_entries, &iovector );
@@ -123,15 +243,32 @@ ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iove
 
   /* No cookie? Bad socket. Leave. */
   if( !cookie ) {
-    iovec_free( &iovec_entries, &iovector );
+    http_free_iovec( &iovec_entries, &iovector, snapshot );
     HTTPERROR_500;
   }
 
   /* If this socket collected request in a buffer, free it now */
   array_reset( &cookie->request );
 
-  /* If we came here, wait for the answer is over */
-  cookie->flag &= ~STRUCT_HTTP_FLAG_WAITINGFORTASK;
+  /* Streamed answers have their header out already, queue the next chunks */
+  if( cookie->flag & STRUCT_HTTP_FLAG_STREAMING ) {
+    for( i=0; i<iovec_entries; ++i ) {
+      iob_addbuf_munmap( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
+      cookie->streamed += iovector[i].iov_len;
+    }
+    free( iovector );
+    if( !partial )
+      cookie->flag &= ~( STRUCT_HTTP_FLAG_STREAMING | STRUCT_HTTP_FLAG_WAITINGFORTASK );
+
+    taia_now( &t ); taia_addsec( &t, &t, OT_CLIENT_TIMEOUT_SEND );
+    io_timeout( sock, t );
+    io_wantwrite( sock );
+    return 0;
+  }
+
+  /* If we came here, wait for the answer is over, unless more chunks follow */
+  if( !partial )
+    cookie->flag &= ~STRUCT_HTTP_FLAG_WAITINGFORTASK;
 
   /* Our answers never are 0 vectors. Return an error. */
   if( !iovec_entries ) {
@@ -139,26 +276,54 @@ ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iove
   }
 
   /* Prepare space for http header */
-  header = malloc( SUCCESS_HTTP_HEADER_LENGTH + SUCCESS_HTTP_HEADER_LENGTH_CONTENT_ENCODING );
+  header = malloc( SUCCESS_HTTP_HEADER_LENGTH + SUCCESS_HTTP_HEADER_LENGTH_CONTENT_ENCODING + SUCCESS_HTTP_HEADER_LENGTH_DELTA );
   if( !header ) {
-    iovec_free( &iovec_entries, &iovector );
+    http_free_iovec( &iovec_entries, &iovector, snapshot );
+    if( partial )
+      mutex_workqueue_canceltask( sock );
     HTTPERROR_500;
   }
 
+  header_size = bencode_literal( header, OT_HTTP_VERSION " 200 OK\r\nContent-Type: text/plain\r\n" );
   if( cookie->flag & STRUCT_HTTP_FLAG_GZIP )
-    header_size = sprintf( header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Encoding: gzip\r\nContent-Length: %zd\r\n\r\n", size );
-  else if( cookie->flag & STRUCT_HTTP_FLAG_BZIP2 )
-    header_size = sprintf( header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Encoding: bzip2\r\nContent-Length: %zd\r\n\r\n", size );
-  else
-    header_size = sprintf( header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zd\r\n\r\n", size );
+    header_size += bencode_literal( header + header_size, "Content-Encoding: gzip\r\n" );
+  else if( cookie->flag & STRUCT_HTTP_FLAG_ZSTD )
+    header_size += bencode_literal( header + header_size, "Content-Encoding: zstd\r\n" );
+  /* Only the bencoded format has room for these in its body */
+  if( cursor >= 0 ) {
+    header_size += bencode_literal( header + header_size, "X-Fullscrape-Cursor: " );
+    header_size += bencode_decimal( header + header_size, cursor );
+    if( full )
+      header_size += bencode_literal( header + header_size, "\r\nX-Fullscrape-Full: 1\r\n" );
+    else
+      header_size += bencode_literal( header + header_size, "\r\nX-Fullscrape-Full: 0\r\n" );
+  }
+  if( partial ) {
+    /* The length is not known yet, the end of the connection tells it */
+    header_size += bencode_literal( header + header_size, "Connection: close\r\n\r\n" );
+    cookie->flag |= STRUCT_HTTP_FLAG_STREAMING;
+    cookie->streamed = size;
+  } else {
+    header_size += bencode_literal( header + header_size, "Content-Length: " );
+    header_size += bencode_decimal( header + header_size, size );
+    /* Replies to tasks end kept alive connections */
+    header_size += bencode_literal( header + header_size, "\r\n" OT_HTTP_CLOSE "\r\n" );
+  }
 
   iob_reset( &cookie->batch );
   iob_addbuf_free( &cookie->batch, header, header_size );
 
-  /* Will move to ot_iovec.c */
-  for( i=0; i<iovec_entries; ++i )
-    iob_addbuf_munmap( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
-  free( iovector );
+  /* Snapshots stay mapped until the last connection sending them is done */
+  if( snapshot ) {
+    for( i=0; i<iovec_entries; ++i )
+      iob_addbuf( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
+    cookie->snapshot = snapshot;
+  } else {
+    /* Will move to ot_iovec.c */
+    for( i=0; i<iovec_entries; ++i )
+      iob_addbuf_munmap( &cookie->batch, iovector[i].iov_base, iovector[i].iov_len );
+    free( iovector );
+  }
 
   /* writeable sockets timeout after 10 minutes */
   taia_now( &t ); taia_addsec( &t, &t, OT_CLIENT_TIMEOUT_SEND );
@@ -168,14 +333,73 @@ ssize_t http_sendiovecdata( const int64 sock, struct ot_workstruct *ws, int iove
   return 0;
 }
 
+#if defined( WANT_KEEPALIVE ) || defined( WANT_IP_FROM_PROXY ) || defined( WANT_COMPRESSION_GZIP ) || defined( WANT_COMPRESSION_ZSTD )
+static char* http_header( char *data, size_t byte_count, char *header ) {
+  size_t i;
+  long sl = strlen( header );
+  for( i = 0; i + sl + 2 < byte_count; ++i ) {
+    if( data[i] != '\n' || data[ i + sl + 1] != ':' ) continue;
+    if( !case_equalb( data + i + 1, sl, header ) ) continue;
+    data += i + sl + 2;
+    while( *data == ' ' || *data == '\t' ) ++data;
+    return data;
+  }
+  return 0;
+}
+#endif
+
+#if defined( WANT_COMPRESSION_GZIP ) || defined( WANT_COMPRESSION_ZSTD )
+/* Whether the request's Accept-Encoding lists coding without refusing it
+   with q=0 */
+static int http_accepts_encoding( struct ot_workstruct *ws, const char *coding ) {
+  char  *value = http_header( ws->request, ws->header_size, "accept-encoding" );
+  size_t len = strlen( coding );
+
+  while( value && *value && *value != '\r' && *value != '\n' ) {
+    while( *value == ' ' || *value == '\t' || *value == ',' ) ++value;
+    if( case_equalb( value, len, coding ) && !isalnum( (unsigned char)value[len] ) ) {
+      value += len;
+      while( *value == ' ' || *value == '\t' ) ++value;
+      if( *value != ';' ) return 1;
+      ++value;
+      while( *value == ' ' || *value == '\t' ) ++value;
+      if( ( *value != 'q' && *value != 'Q' ) || value[1] != '=' ) return 1;
+      for( value += 2; *value == '0' || *value == '.'; ++value );
+      return !!isdigit( (unsigned char)*value );
+    }
+    while( *value && *value != ',' && *value != '\r' && *value != '\n' ) ++value;
+  }
+  return 0;
+}
+
+/* Picks zstd over gzip for big replies and flags the cookie. Returns the
+   matching TASK_FLAG_*, 0 for no compression */
+static int http_negotiate_encoding( struct ot_workstruct *ws ) {
+#ifdef WANT_COMPRESSION_ZSTD
+  if( http_accepts_encoding( ws, "zstd" ) ) {
+    ws->cookie->flag |= STRUCT_HTTP_FLAG_ZSTD;
+    return TASK_FLAG_ZSTD;
+  }
+#endif
+#ifdef WANT_COMPRESSION_GZIP
+  if( http_accepts_encoding( ws, "gzip" ) ) {
+    ws->cookie->flag |= STRUCT_HTTP_FLAG_GZIP;
+    return TASK_FLAG_GZIP;
+  }
+#endif
+  return 0;
+}
+#endif
+
 static ssize_t http_handle_stats( const int64 sock, struct ot_workstruct *ws, char *read_ptr ) {
 static const ot_keywords keywords_main[] =
-  { { "mode", 1 }, {"format", 2 }, { NULL, -3 } };
+  { { "mode", 1 }, {"format", 2 }, { "since", 3 }, { NULL, -3 } };
 static const ot_keywords keywords_mode[] =
   { { "peer", TASK_STATS_PEERS }, { "conn", TASK_STATS_CONNS }, { "scrp", TASK_STATS_SCRAPE }, { "udp4", TASK_STATS_UDP }, { "tcp4", TASK_STATS_TCP },
     { "busy", TASK_STATS_BUSY_NETWORKS }, { "torr", TASK_STATS_TORRENTS }, { "fscr", TASK_STATS_FULLSCRAPE },
     { "s24s", TASK_STATS_SLASH24S }, { "tpbs", TASK_STATS_TPB }, { "herr", TASK_STATS_HTTPERRORS }, { "completed", TASK_STATS_COMPLETED },
     { "top100", TASK_STATS_TOP100 }, { "top10", TASK_STATS_TOP10 }, { "renew", TASK_STATS_RENEW }, { "syncs", TASK_STATS_SYNCS }, { "version", TASK_STATS_VERSION },
+    { "slab", TASK_STATS_SLAB }, { "wbuf", TASK_STATS_PARTIAL_WRITES }, { "fscs", TASK_STATS_FULLSCRAPE_SNAPSHOTS }, { "pool", TASK_STATS_WORKERS },
     { "everything", TASK_STATS_EVERYTHING }, { "statedump", TASK_FULLSCRAPE_TRACKERSTATE }, { "fulllog", TASK_STATS_FULLLOG },
     { "woodpeckers", TASK_STATS_WOODPECKERS},
 #ifdef WANT_LOG_NUMWANT
@@ -186,10 +410,12 @@ static const ot_keywords keywords_format[] =
   { { "bin", TASK_FULLSCRAPE_TPB_BINARY }, { "ben", TASK_FULLSCRAPE }, { "url", TASK_FULLSCRAPE_TPB_URLENCODED },
     { "txt", TASK_FULLSCRAPE_TPB_ASCII }, { "txtp", TASK_FULLSCRAPE_TPB_ASCII_PLUS }, { NULL, -3 } };
 
-  int mode = TASK_STATS_PEERS, scanon = 1, format = 0;
+  int mode = TASK_STATS_PEERS, scanon = 1, format = 0, since = -1;
+  char *write_ptr;
+  ssize_t len;
 
 #ifdef WANT_RESTRICT_STATS
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = ws->cookie;
 
   if( !cookie || !accesslist_isblessed( cookie->ip, OT_PERMISSION_MAY_STAT ) )
     HTTPERROR_403_IP;
@@ -206,6 +432,10 @@ static const ot_keywords keywords_format[] =
     case  2: /* matched "format" */
       if( ( format = scan_find_keywords( keywords_format, &read_ptr, SCAN_SEARCHPATH_VALUE ) ) <= 0 ) HTTPERROR_400_PARAM;
       break;
+    case  3: /* matched "since" */
+      len = scan_urlencoded_query( &read_ptr, write_ptr = read_ptr, SCAN_SEARCHPATH_VALUE );
+      if( ( len <= 0 ) || scan_fixed_int( write_ptr, len, &since ) || ( since < 0 ) ) HTTPERROR_400_PARAM;
+      break;
     }
   }
 
@@ -215,25 +445,39 @@ static const ot_keywords keywords_format[] =
   }
 
   if( mode == TASK_STATS_TPB ) {
-    struct http_data* cookie = io_getcookie( sock );
+    struct http_data *cookie = ws->cookie;
     tai6464 t;
+
+    /* Without a format, the full scrape worker would never pick it up */
+    if( !format )
+      format = TASK_FULLSCRAPE;
+
+    /* Mirrors ask for what changed since their last cursor */
+    if( since >= 0 && format != TASK_FULLSCRAPE_TRACKERSTATE )
+      format |= TASK_FLAG_DELTA;
+#ifdef WANT_COMPRESSION_ZSTD
+    if( http_accepts_encoding( ws, "zstd" ) ) {
+      cookie->flag |= STRUCT_HTTP_FLAG_ZSTD;
+      format |= TASK_FLAG_ZSTD;
+    }
+#endif
 #ifdef WANT_COMPRESSION_GZIP
     ws->request[ws->request_size] = 0;
+    if( !( format & TASK_FLAG_ZSTD )
 #ifdef WANT_COMPRESSION_GZIP_ALWAYS
-    if( strstr( read_ptr - 1, "gzip" ) ) {
+        && strstr( read_ptr - 1, "gzip" )
 #endif
+      ) {
       cookie->flag |= STRUCT_HTTP_FLAG_GZIP;
       format |= TASK_FLAG_GZIP;
-#ifdef WANT_COMPRESSION_GZIP_ALWAYS
     }
-#endif
 #endif
     /* Pass this task to the worker thread */
     cookie->flag |= STRUCT_HTTP_FLAG_WAITINGFORTASK;
 
     /* Clients waiting for us should not easily timeout */
     taia_uint( &t, 0 ); io_timeout( sock, t );
-    fullscrape_deliver( sock, format );
+    fullscrape_deliver( sock, format, since );
     io_dontwantread( sock );
     return ws->reply_size = -2;
   }
@@ -244,6 +488,10 @@ static const ot_keywords keywords_format[] =
     tai6464 t;
     /* Complex stats also include expensive memory debugging tools */
     taia_uint( &t, 0 ); io_timeout( sock, t );
+#if defined( WANT_COMPRESSION_GZIP ) || defined( WANT_COMPRESSION_ZSTD )
+    /* Worker made stats can get big, compress them when the client lets us */
+    mode |= http_negotiate_encoding( ws );
+#endif
     stats_deliver( sock, mode );
     return ws->reply_size = -2;
   }
@@ -260,7 +508,7 @@ typedef struct { ot_ip6 ip; ot_time last_fullscrape; } ot_scrape_log;
 
 #ifdef WANT_FULLSCRAPE
 static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *ws ) {
-  struct http_data* cookie = io_getcookie( sock );
+  struct http_data *cookie = ws->cookie;
   int format = 0;
   tai6464 t;
 
@@ -285,6 +533,13 @@ static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *w
   }
 #endif
 
+#ifdef WANT_COMPRESSION_ZSTD
+  if( http_accepts_encoding( ws, "zstd" ) ) {
+    cookie->flag |= STRUCT_HTTP_FLAG_ZSTD;
+    format = TASK_FLAG_ZSTD;
+    stats_issue_event( EVENT_FULLSCRAPE_REQUEST_ZSTD, 0, (uintptr_t)cookie->ip );
+  } else
+#endif
 #ifdef WANT_COMPRESSION_GZIP
   ws->request[ws->request_size-1] = 0;
   if( strstr( ws->request, "gzip" ) ) {
@@ -303,7 +558,7 @@ static ssize_t http_handle_fullscrape( const int64 sock, struct ot_workstruct *w
   cookie->flag |= STRUCT_HTTP_FLAG_WAITINGFORTASK;
   /* Clients waiting for us should not easily timeout */
   taia_uint( &t, 0 ); io_timeout( sock, t );
-  fullscrape_deliver( sock, TASK_FULLSCRAPE | format );
+  fullscrape_deliver( sock, TASK_FULLSCRAPE | format, 0 );
   io_dontwantread( sock );
   return ws->reply_size = -2;
 }
@@ -352,21 +607,6 @@ static ssize_t http_handle_scrape( const int64 sock, struct ot_workstruct *ws, c
   unsigned long long numwants[201];
 #endif
 
-#if defined( WANT_KEEPALIVE ) || defined( WANT_IP_FROM_PROXY )
-static char* http_header( char *data, size_t byte_count, char *header ) {
-  size_t i;
-  long sl = strlen( header );
-  for( i = 0; i + sl + 2 < byte_count; ++i ) {
-    if( data[i] != '\n' || data[ i + sl + 1] != ':' ) continue;
-    if( !case_equalb( data + i + 1, sl, header ) ) continue;
-    data += i + sl + 2;
-    while( *data == ' ' || *data == '\t' ) ++data;
-    return data;
-  }
-  return 0;
-}
-#endif
-
 static ot_keywords keywords_announce[] = { { "port", 1 }, { "left", 2 }, { "event", 3 }, { "numwant", 4 }, { "compact", 5 }, { "compact6", 5 }, { "info_hash", 6 },
 #ifdef WANT_IP_FROM_QUERY_STRING
 { "ip", 7 },
@@ -382,7 +622,7 @@ static ssize_t http_handle_announce( const int64 sock, struct ot_workstruct *ws,
   unsigned short    port = 0;
   char             *write_ptr;
   ssize_t           len;
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = ws->cookie;
 
   /* This is to hack around stupid clients that send "announce ?info_hash" */
   if( read_ptr[-1] != '?' ) {
@@ -528,12 +768,73 @@ static ssize_t http_handle_announce( const int64 sock, struct ot_workstruct *ws,
   return ws->reply_size;
 }
 
+/* Tells whether a tcp worker can answer a request on its own: announces,
+   scrapes and malformed requests. This must match the dispatch in
+   http_handle_request, which looks at the url decoded path, so paths with
+   escapes go to the main loop */
+static int http_worker_may_answer( const char *request ) {
+  const char *path = request + 4, *p;
+
+  if( memcmp( request, "GET /", 5 ) ) return 1;
+  while( *path == '/' ) ++path;
+  for( p = path; *p != '?' && *p != ' ' && *p != '\r' && *p != '\n'; ++p )
+    if( *p == '%' ) return 0;
+
+  if( ( *path == 'a' ) || ( *path == '?' ) ) return 1;
+#ifdef WANT_FULLSCRAPE
+  if( !memcmp( path, "scrape HTTP/", 12 ) ) return 0;
+#endif
+  return !memcmp( path, "sc", 2 );
+}
+
+#ifdef WANT_KEEPALIVE
+/* HTTP/1.1 connections persist unless the client asks to close them,
+   HTTP/1.0 ones only when asked to. Connection is a list of tokens, in
+   which close wins over keep-alive. No connection serves more than
+   g_keepalive_max_requests requests, 0 means no limit */
+static int http_keep_alive( struct ot_workstruct *ws ) {
+  char  *eol = memchr( ws->request, '\n', ws->header_size ), *connection, *token;
+  size_t len;
+  int    keep_alive = 0;
+
+  if( g_keepalive_max_requests && ++ws->cookie->requests >= g_keepalive_max_requests )
+    return 0;
+
+  if( eol && eol > ws->request && eol[-1] == '\r' ) --eol;
+  if( eol && eol - ws->request >= 8 && !memcmp( eol - 8, "HTTP/1.1", 8 ) )
+    keep_alive = 1;
+
+  connection = http_header( ws->request, ws->header_size, "connection" );
+  while( connection && *connection && *connection != '\r' && *connection != '\n' ) {
+    while( *connection == ' ' || *connection == '\t' || *connection == ',' ) ++connection;
+    for( token = connection; *connection && !strchr( " \t,\r\n", *connection ); ++connection );
+    len = connection - token;
+    if( len == 5 && case_equalb( token, 5, "close" ) )
+      return 0;
+    if( len == 10 && case_equalb( token, 10, "keep-alive" ) )
+      keep_alive = 1;
+    while( *connection && *connection != ',' && *connection != '\r' && *connection != '\n' ) ++connection;
+  }
+  return keep_alive;
+}
+#endif
+
 ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
   ssize_t reply_off, len;
-  char   *read_ptr = ws->request, *write_ptr;
+  size_t  size_length;
+  char   *read_ptr = ws->request, *write_ptr, *r, size_digits[BENCODE_MAXDECIMAL];
+
+  /* Leave the request untouched for the main loop, in the cookie's buffer
+     unless it is there already */
+  if( ( ws->cookie->flag & STRUCT_HTTP_FLAG_WORKER ) && !http_worker_may_answer( ws->request ) ) {
+    if( ws->request != array_start( &ws->cookie->request ) )
+      array_catb( &ws->cookie->request, ws->request, ws->request_size );
+    ws->cookie->flag |= STRUCT_HTTP_FLAG_HANDOVER;
+    return 0;
+  }
 
 #ifdef WANT_FULLLOG_NETWORKS
-  struct http_data *cookie = io_getcookie( sock );
+  struct http_data *cookie = ws->cookie;
   if( loglist_check_address( cookie->ip ) ) {
     ot_log *log = malloc( sizeof( ot_log ) );
     if( log ) {
@@ -544,12 +845,7 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
       memcpy( log->ip, cookie->ip, sizeof(ot_ip6));
       if( log->data ) {
         memcpy( log->data, ws->request, ws->request_size );
-        if( !g_logchain_first )
-          g_logchain_first = g_logchain_last = log;
-        else {
-          g_logchain_last->next = log;
-          g_logchain_last = log;  
-        }        
+        loglist_append( log );
       } else
         free( log );
     }
@@ -567,6 +863,13 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
   /* Tell subroutines where to put reply data */
   ws->reply = ws->outbuf + SUCCESS_HTTP_HEADER_LENGTH;
 
+  /* Find out if the client wants to keep this connection alive, before
+     the handlers below start decoding the request in place */
+  ws->keep_alive = 0;
+#ifdef WANT_KEEPALIVE
+  ws->keep_alive = http_keep_alive( ws );
+#endif
+
   /* This one implicitely tests strlen < 5, too -- remember, it is \n terminated */
   if( memcmp( read_ptr, "GET /", 5) ) HTTPERROR_400;
 
@@ -599,15 +902,12 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
   else
     HTTPERROR_404;
 
-  /* Find out if the client wants to keep this connection alive */
-  ws->keep_alive = 0;
-#ifdef WANT_KEEPALIVE
-  read_ptr=http_header( ws->request, ws->header_size, "connection");
-  if( read_ptr && ( *read_ptr == 'K' || *read_ptr == 'k' ) ) ws->keep_alive = 1;
-#endif
-
-  /* If routines handled sending themselves, just return */
-  if( ws->reply_size == -2 ) return 0;
+  /* If routines handled sending themselves, just return. Replies to tasks
+     end kept alive connections */
+  if( ws->reply_size == -2 ) {
+    ws->keep_alive = 0;
+    return 0;
+  }
   /* If routine failed, let http error take over */
   if( ws->reply_size <= 0 ) HTTPERROR_500;
 
@@ -615,18 +915,29 @@ ssize_t http_handle_request( const int64 sock, struct ot_workstruct *ws ) {
 
      1. In order to avoid having two buffers, one for header and one for content, we allow all above functions from trackerlogic to
      write to a fixed location, leaving SUCCESS_HTTP_HEADER_LENGTH bytes in our work buffer, which is enough for the static string
-     plus dynamic space needed to expand our Content-Length value. We reserve SUCCESS_HTTP_SIZE_OFF for its expansion and calculate
-     the space NOT needed to expand in reply_off
+     plus dynamic space needed to expand our Content-Length value and the Connection header. We reserve SUCCESS_HTTP_SIZE_OFF for
+     their expansion and calculate the space NOT needed to expand in reply_off
   */
-  reply_off = SUCCESS_HTTP_SIZE_OFF - snprintf( ws->outbuf, 0, "%zd", ws->reply_size );
+  size_length = bencode_decimal( size_digits, ws->reply_size );
+  reply_off = SUCCESS_HTTP_SIZE_OFF - size_length;
+#ifdef WANT_KEEPALIVE
+  reply_off -= ws->keep_alive ? sizeof( "Connection: keep-alive\r\n" ) - 1 : sizeof( "Connection: close\r\n" ) - 1;
+#endif
   ws->reply = ws->outbuf + reply_off;
 
-  /* 2. Now we sprintf our header so that sprintf writes its terminating '\0' exactly one byte before content starts. Complete
-     packet size is increased by size of header plus one byte '\n', we will copy over '\0' in next step */
-  ws->reply_size += 1 + sprintf( ws->reply, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zd\r\n\r", ws->reply_size );
-
-  /* 3. Finally we join both blocks neatly */
-  ws->outbuf[ SUCCESS_HTTP_HEADER_LENGTH - 1 ] = '\n';
+  /* 2. Now we write our header so that it ends exactly where content starts. Complete packet size is increased by size of
+     the header */
+  r = ws->reply;
+  r += bencode_literal( r, OT_HTTP_VERSION " 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " );
+  memcpy( r, size_digits, size_length ); r += size_length;
+#ifdef WANT_KEEPALIVE
+  if( ws->keep_alive )
+    r += bencode_literal( r, "\r\nConnection: keep-alive" );
+  else
+    r += bencode_literal( r, "\r\nConnection: close" );
+#endif
+  r += bencode_literal( r, "\r\n\r\n" );
+  ws->reply_size += r - ws->reply;
 
   http_senddata( sock, ws );
   return ws->reply_size;
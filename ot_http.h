@@ -9,7 +9,15 @@
 typedef enum {
   STRUCT_HTTP_FLAG_WAITINGFORTASK = 1,
   STRUCT_HTTP_FLAG_GZIP           = 2,
-  STRUCT_HTTP_FLAG_BZIP2          = 4
+  STRUCT_HTTP_FLAG_ZSTD           = 4,
+  /* Served by a tcp worker, which may not touch libowfat's io layer */
+  STRUCT_HTTP_FLAG_WORKER         = 8,
+  /* The tcp worker leaves the connection and its request to the main loop */
+  STRUCT_HTTP_FLAG_HANDOVER       = 16,
+  /* Kept alive, read the next request once the batch is sent */
+  STRUCT_HTTP_FLAG_KEEPALIVE      = 32,
+  /* More chunks of a streamed full scrape are to come */
+  STRUCT_HTTP_FLAG_STREAMING      = 64
 } STRUCT_HTTP_FLAG;
 
 struct http_data {
@@ -17,13 +25,44 @@ struct http_data {
   io_batch         batch;
   ot_ip6           ip;
   STRUCT_HTTP_FLAG flag;
+  unsigned int     requests;
+  /* Pooled output buffer holding the unsent rest of a reply */
+  char            *outbuf;
+  /* Tcp workers send that rest themselves, it is not in the batch */
+  char            *pending;
+  size_t           pending_size;
+  /* Full scrape snapshot the batch is sending from */
+  struct ot_fullscrape_snapshot *snapshot;
+  /* Bytes of a streamed full scrape in the batch */
+  size_t           streamed;
 };
 
+/* With WANT_KEEPALIVE, connections wait this many seconds for their next
+   request and serve at most this many requests, see
+   listen.tcp.keepalive_timeout and listen.tcp.keepalive_requests */
+#define OT_KEEPALIVE_TIMEOUT      15
+#define OT_KEEPALIVE_MAX_REQUESTS 1000
+
+/* With WANT_COMPRESSION_ZSTD, clients accepting zstd get full scrapes and
+   the bigger stats compressed at this level, see tracker.zstd_level */
+#define OT_ZSTD_LEVEL 3
+
+size_t  http_header_complete( char *request, ssize_t byte_count );
 ssize_t http_handle_request( const int64 s, struct ot_workstruct *ws );
-ssize_t http_sendiovecdata( const int64 s, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector );
+/* Delta full scrapes tell the client their cursor and whether they list
+   all torrents in X-Fullscrape-Cursor and X-Fullscrape-Full headers, a
+   negative cursor leaves them out */
+ssize_t http_sendiovecdata( const int64 s, struct ot_workstruct *ws, int iovec_entries, struct iovec *iovector, struct ot_fullscrape_snapshot *snapshot, int partial, ot_time cursor, int full );
 ssize_t http_issue_error( const int64 s, struct ot_workstruct *ws, int code );
 
-extern char   *g_stats_path;
-extern ssize_t g_stats_path_len;
+/* Resets the cookie's batch, returns its output buffer to the pool and
+   releases its snapshot */
+void    http_release_output( struct http_data *cookie );
+
+extern char        *g_stats_path;
+extern ssize_t      g_stats_path_len;
+extern unsigned int g_keepalive_timeout;
+extern unsigned int g_keepalive_max_requests;
+extern unsigned int g_zstd_level;
 
 #endif
@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/uio.h>
 
@@ -36,6 +37,25 @@ void iovec_free( int *iovec_entries, struct iovec **iovector ) {
   *iovec_entries = 0;
 }
 
+int iovec_concat( int *iovec_entries, struct iovec **iovector, int *append_entries, struct iovec **append ) {
+  struct iovec *new_ptr;
+
+  if( !*append_entries ) {
+    free( *append );
+    *append = NULL;
+    return 0;
+  }
+  if( !( new_ptr = realloc( *iovector, ( *iovec_entries + *append_entries ) * sizeof( struct iovec ) ) ) )
+    return -1;
+  memcpy( new_ptr + *iovec_entries, *append, *append_entries * sizeof( struct iovec ) );
+  *iovector = new_ptr;
+  *iovec_entries += *append_entries;
+  free( *append );
+  *append = NULL;
+  *append_entries = 0;
+  return 0;
+}
+
 void  iovec_fixlast( int *iovec_entries, struct iovec **iovector, void *last_ptr ) {
   int page_size = getpagesize();
   size_t old_alloc, new_alloc, old_pages, new_pages;
@@ -12,6 +12,10 @@ void  *iovec_increase( int *iovec_entries, struct iovec **iovector, size_t new_a
 void   iovec_fixlast( int *iovec_entries, struct iovec **iovector, void *last_ptr );
 void   iovec_free( int *iovec_entries, struct iovec **iovector );
 
+/* Moves the entries of append behind those of iovector, append is left
+   empty. Returns -1 if out of memory */
+int    iovec_concat( int *iovec_entries, struct iovec **iovector, int *append_entries, struct iovec **append );
+
 size_t iovec_length( int *iovec_entries, struct iovec **iovector );
 
 void  *iovec_fix_increase_or_free( int *iovec_entries, struct iovec **iovector, void *last_ptr, size_t new_alloc );
@@ -183,6 +183,7 @@ static void * livesync_worker( void * args ) {
   /* Initialize our "thread local storage" */
   ws.inbuf   = ws.request = malloc( LIVESYNC_INCOMING_BUFFSIZE );
   ws.outbuf  = ws.reply   = 0;
+  workstruct_seed_random( &ws );
 
   memcpy( in_ip, V4mappedprefix, sizeof( V4mappedprefix ) );
 
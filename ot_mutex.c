@@ -4,14 +4,16 @@
    $id$ */
 
 /* System */
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
+#include <time.h>
 
 /* Libowfat */
-#include "byte.h"
 #include "io.h"
 #include "uint32.h"
 
@@ -19,176 +21,294 @@
 #include "trackerlogic.h"
 #include "ot_mutex.h"
 #include "ot_stats.h"
+#include "ot_fullscrape.h"
 
 /* #define MTX_DBG( STRING ) fprintf( stderr, STRING ) */
 #define MTX_DBG( STRING )
 
 /* Our global all torrents list */
-static ot_vector all_torrents[OT_BUCKET_COUNT];
-static size_t    g_torrent_count;
-
-/* Bucket Magic */
-static int bucket_locklist[ OT_MAX_THREADS ];
-static int bucket_locklist_count = 0;
-static pthread_mutex_t bucket_mutex;
-static pthread_cond_t bucket_being_unlocked;
+static ot_vector *all_torrents;
+static size_t     g_torrent_count;
+int               g_bucket_count_bits = OT_BUCKET_COUNT_BITS_DEFAULT;
+
+/* Bucket Magic: every bucket has a lock of its own. Each lock lives on its
+   own cache line, so that threads working on neighbouring buckets do not
+   bounce the same line between their cores */
+#define OT_CACHELINE_SIZE 64
+typedef struct {
+  pthread_mutex_t mutex;
+} __attribute__((aligned(OT_CACHELINE_SIZE))) ot_bucket_lock;
+static ot_bucket_lock *bucket_locks;
+
+/* Change generations for delta full scrapes: when the counts in a bucket
+   last changed and which torrents it lost in the last g_delta_window
+   seconds. Both are guarded by the bucket's lock */
+typedef struct {
+  ot_time   changed;
+  ot_vector removals;
+} ot_bucket_changes;
+static ot_bucket_changes *bucket_changes;
+unsigned int              g_delta_window = OT_DELTA_WINDOW;
+
+#define OT_BUCKET_OF( hash ) ( uint32_read_big( (char*)(hash) ) >> OT_BUCKET_COUNT_SHIFT )
 
 /* Self pipe from opentracker.c */
 extern int g_self_pipe[2];
 
-static int bucket_check( int bucket ) {
-  /* C should come with auto-i ;) */
-  int i;
+/* Can block */
+ot_vector *mutex_bucket_lock( int bucket ) {
+  pthread_mutex_t *mutex = &bucket_locks[bucket].mutex;
 
-  /* No more space to acquire lock to bucket -- should not happen */
-  if( bucket_locklist_count == OT_MAX_THREADS ) {
-    fprintf( stderr, "More lock requests than mutexes. Consult source code.\n" );
-    return -1;
+  /* Only account for a stall if someone else holds the bucket */
+  if( pthread_mutex_trylock( mutex ) ) {
+    stats_issue_event( EVENT_BUCKET_LOCKED, 0, 0 );
+    pthread_mutex_lock( mutex );
   }
+  return all_torrents + bucket;
+}
 
-  /* See, if bucket is already locked */
-  for( i=0; i<bucket_locklist_count; ++i )
-    if( bucket_locklist[ i ] == bucket ) {
-      stats_issue_event( EVENT_BUCKET_LOCKED, 0, 0 );
-      return -1;
-    }
+ot_vector *mutex_bucket_lock_by_hash( ot_hash hash ) {
+  return mutex_bucket_lock( OT_BUCKET_OF( hash ) );
+}
 
-  return 0;
+void mutex_bucket_unlock( int bucket, int delta_torrentcount ) {
+  if( delta_torrentcount )
+    __sync_add_and_fetch( &g_torrent_count, delta_torrentcount );
+  pthread_mutex_unlock( &bucket_locks[bucket].mutex );
 }
 
-static void bucket_push( int bucket ) {
-  bucket_locklist[ bucket_locklist_count++ ] = bucket;
+void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount ) {
+  mutex_bucket_unlock( OT_BUCKET_OF( hash ), delta_torrentcount );
 }
 
-static void bucket_remove( int bucket ) {
-  int i = 0;
+void mutex_bucket_changed( ot_torrent *torrent ) {
+  torrent->peer_list->changed = g_now_seconds;
+  bucket_changes[OT_BUCKET_OF( torrent->hash )].changed = g_now_seconds;
+}
 
-  while( ( i < bucket_locklist_count ) && ( bucket_locklist[ i ] != bucket ) )
-    ++i;
+void mutex_bucket_removed( ot_hash hash ) {
+  ot_bucket_changes *changes = bucket_changes + OT_BUCKET_OF( hash );
+  ot_removal        *removal;
 
-  if( i == bucket_locklist_count ) {
-    fprintf( stderr, "Request to unlock bucket that was never locked. Consult source code.\n" );
+  changes->changed = g_now_seconds;
+  if( !g_delta_window )
     return;
-  }
-
-  for( ; i < bucket_locklist_count - 1; ++i )
-    bucket_locklist[ i ] = bucket_locklist[ i + 1 ];
 
-  --bucket_locklist_count;
+  if( changes->removals.size == changes->removals.space ) {
+    size_t new_space = changes->removals.space ? 2 * changes->removals.space : OT_VECTOR_MIN_MEMBERS;
+    void  *new_data  = realloc( changes->removals.data, new_space * sizeof( ot_removal ) );
+    /* Without room, deltas miss this removal until the next full scrape */
+    if( !new_data ) return;
+    changes->removals.data  = new_data;
+    changes->removals.space = new_space;
+  }
+  removal = ((ot_removal*)changes->removals.data) + changes->removals.size++;
+  memcpy( removal->hash, hash, sizeof( ot_hash ) );
+  removal->removed = g_now_seconds;
 }
 
-/* Can block */
-ot_vector *mutex_bucket_lock( int bucket ) {
-  pthread_mutex_lock( &bucket_mutex );
-  while( bucket_check( bucket ) )
-    pthread_cond_wait( &bucket_being_unlocked, &bucket_mutex );
-  bucket_push( bucket );
-  pthread_mutex_unlock( &bucket_mutex );
-  return all_torrents + bucket;
-}
+void mutex_bucket_expire_removals( int bucket ) {
+  ot_vector  *removals = &bucket_changes[bucket].removals;
+  ot_removal *first = (ot_removal*)removals->data;
+  size_t      expired = 0;
 
-ot_vector *mutex_bucket_lock_by_hash( ot_hash hash ) {
-  return mutex_bucket_lock( uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT );
-}
+  /* Removals are appended in time order */
+  while( expired < removals->size && first[expired].removed + (ot_time)g_delta_window < g_now_seconds )
+    ++expired;
+  if( !expired )
+    return;
 
-void mutex_bucket_unlock( int bucket, int delta_torrentcount ) {
-  pthread_mutex_lock( &bucket_mutex );
-  bucket_remove( bucket );
-  g_torrent_count += delta_torrentcount;
-  pthread_cond_broadcast( &bucket_being_unlocked );
-  pthread_mutex_unlock( &bucket_mutex );
+  removals->size -= expired;
+  if( removals->size )
+    memmove( first, first + expired, removals->size * sizeof( ot_removal ) );
+  else {
+    free( removals->data );
+    removals->data  = NULL;
+    removals->space = 0;
+  }
 }
 
-void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount ) {
-  mutex_bucket_unlock( uint32_read_big( (char*)hash ) >> OT_BUCKET_COUNT_SHIFT, delta_torrentcount );
+ot_time mutex_bucket_changes( int bucket, ot_removal **removals, size_t *removal_count ) {
+  *removals      = (ot_removal*)bucket_changes[bucket].removals.data;
+  *removal_count = bucket_changes[bucket].removals.size;
+  return bucket_changes[bucket].changed;
 }
 
+/* Never blocks */
 size_t mutex_get_torrent_count( ) {
-  size_t torrent_count;
-  pthread_mutex_lock( &bucket_mutex );
-  torrent_count = g_torrent_count;
-  pthread_mutex_unlock( &bucket_mutex );
-  return torrent_count;
+  return __sync_add_and_fetch( &g_torrent_count, 0 );
 }
 
-/* TaskQueue Magic */
+/* TaskQueue Magic: tasks wait in a queue per task class for the workers
+   of that class. A running task hangs in a hash chain by its taskid until
+   its result is pushed, then it waits in the finished queue for the main
+   loop. A task is in one of these places at a time and needs one link */
 
 struct ot_task {
   ot_taskid       taskid;
   ot_tasktype     tasktype;
+  ot_time         since;    /* cursor of delta full scrapes */
+  ot_time         cursor;   /* and the one for the next poll, or -1 */
+  int             full;     /* delta full scrapes listing everything */
   int64           sock;
   int             iovec_entries;
   struct iovec   *iovec;
+  struct ot_fullscrape_snapshot *snapshot;
+  size_t          pending;  /* streamed bytes not yet sent */
+  int             partial;
+  unsigned long long queued_ms;
   struct ot_task *next;
 };
 
-static ot_taskid next_free_taskid = 1;
-static struct ot_task *tasklist;
+typedef struct {
+  struct ot_task *first;
+  struct ot_task *last;
+} ot_taskqueue;
+
+#define OT_TASK_CLASSES            ( ( TASK_CLASS_MASK >> 8 ) + 1 )
+#define OT_TASK_CLASS( tasktype )  ( ( (tasktype) & TASK_CLASS_MASK ) >> 8 )
+#define OT_RUNNING_TASKS_BUCKETS   64
+
+static ot_taskid       next_free_taskid = 1;
+static ot_taskqueue    pending_tasks[OT_TASK_CLASSES];
+static pthread_cond_t  tasks_pending[OT_TASK_CLASSES];
+static ot_taskqueue_stats pending_stats[OT_TASK_CLASSES];
+static struct ot_task *running_tasks[OT_RUNNING_TASKS_BUCKETS];
+static ot_taskqueue    finished_tasks;
+static int             finished_tasks_signalled;
 static pthread_mutex_t tasklist_mutex;
-static pthread_cond_t tasklist_being_filled;
+static pthread_cond_t  tasklist_drained;
+
+static void taskqueue_push( ot_taskqueue *queue, struct ot_task *task ) {
+  task->next = NULL;
+  if( queue->last )
+    queue->last->next = task;
+  else
+    queue->first = task;
+  queue->last = task;
+}
 
-int mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype ) {
-  struct ot_task ** tmptask, * task;
+static struct ot_task *taskqueue_pop( ot_taskqueue *queue ) {
+  struct ot_task *task = queue->first;
+  if( task && !( queue->first = task->next ) )
+    queue->last = NULL;
+  return task;
+}
 
-  /* Want exclusive access to tasklist */
-  MTX_DBG( "pushtask locks.\n" );
-  pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "pushtask locked.\n" );
+/* Expects tasklist_mutex to be held */
+static struct ot_task **mutex_workqueue_findtask( ot_taskid taskid ) {
+  struct ot_task **task = running_tasks + ( taskid & ( OT_RUNNING_TASKS_BUCKETS - 1 ) );
+  while( *task && (*task)->taskid != taskid )
+    task = &(*task)->next;
+  return task;
+}
 
-  task = malloc(sizeof( struct ot_task));
-  if( !task ) {
-    MTX_DBG( "pushtask fail unlocks.\n" );
-    pthread_mutex_unlock( &tasklist_mutex );
-    MTX_DBG( "pushtask fail unlocked.\n" );
-    return -1;
+static unsigned long long mutex_now_ms( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Tells the main loop that there are results, once until it took them all.
+   Expects tasklist_mutex to be held */
+static void mutex_workqueue_signal( void ) {
+  const char byte = 'o';
+  if( finished_tasks_signalled ) return;
+  finished_tasks_signalled = 1;
+  io_trywrite( g_self_pipe[1], &byte, 1 );
+}
+
+static void mutex_workqueue_freetask( struct ot_task *task ) {
+  int i;
+  if( task->snapshot )
+    fullscrape_release( task->snapshot );
+  else {
+    for( i=0; i<task->iovec_entries; ++i )
+      munmap( task->iovec[i].iov_base, task->iovec[i].iov_len );
+    free( task->iovec );
   }
+  free( task );
+}
 
-  /* Skip to end of list */
-  tmptask = &tasklist;
-  while( *tmptask )
-    tmptask = &(*tmptask)->next;
-  *tmptask = task;
+/* Frees the tasks for sock in a chain, returns the last one left. If
+   given, count is decreased by the tasks freed */
+static struct ot_task *mutex_workqueue_cancelchain( struct ot_task **task, int64 sock, size_t *count ) {
+  struct ot_task *last = NULL;
+  while( *task ) {
+    struct ot_task *ptask = *task;
+    if( ptask->sock == sock ) {
+      *task = ptask->next;
+      mutex_workqueue_freetask( ptask );
+      if( count )
+        --*count;
+    } else {
+      last = ptask;
+      task = &ptask->next;
+    }
+  }
+  return last;
+}
+
+int mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype ) {
+  return mutex_workqueue_pushdelta( sock, tasktype, 0 );
+}
+
+int mutex_workqueue_pushdelta( int64 sock, ot_tasktype tasktype, ot_time since ) {
+  struct ot_task *task = malloc( sizeof( struct ot_task ) );
+  int             taskclass = OT_TASK_CLASS( tasktype );
+
+  if( !task )
+    return -1;
 
   task->taskid        = 0;
   task->tasktype      = tasktype;
+  task->since         = since;
+  task->cursor        = -1;
+  task->full          = 0;
   task->sock          = sock;
   task->iovec_entries = 0;
   task->iovec         = NULL;
-  task->next          = 0;
+  task->snapshot      = NULL;
+  task->pending       = 0;
+  task->partial       = 0;
+  task->queued_ms     = mutex_now_ms( );
+
+  /* Want exclusive access to tasklist */
+  MTX_DBG( "pushtask locks.\n" );
+  pthread_mutex_lock( &tasklist_mutex );
+  MTX_DBG( "pushtask locked.\n" );
+
+  taskqueue_push( pending_tasks + taskclass, task );
+  if( ++pending_stats[taskclass].depth > pending_stats[taskclass].depth_max )
+    pending_stats[taskclass].depth_max = pending_stats[taskclass].depth;
 
-  /* Inform waiting workers and release lock */
-  MTX_DBG( "pushtask broadcasts.\n" );
-  pthread_cond_broadcast( &tasklist_being_filled );
-  MTX_DBG( "pushtask broadcasted, mutex unlocks.\n" );
+  /* Inform a waiting worker of this class and release lock */
+  MTX_DBG( "pushtask signals.\n" );
+  pthread_cond_signal( tasks_pending + taskclass );
+  MTX_DBG( "pushtask signalled, mutex unlocks.\n" );
   pthread_mutex_unlock( &tasklist_mutex );
   MTX_DBG( "pushtask end mutex unlocked.\n" );
   return 0;
 }
 
 void mutex_workqueue_canceltask( int64 sock ) {
-  struct ot_task ** task;
+  int i;
 
   /* Want exclusive access to tasklist */
   MTX_DBG( "canceltask locks.\n" );
   pthread_mutex_lock( &tasklist_mutex );
   MTX_DBG( "canceltask locked.\n" );
 
-  task = &tasklist;
-  while( *task && ( (*task)->sock != sock ) )
-    *task = (*task)->next;
-
-  if( *task && ( (*task)->sock == sock ) ) {
-    struct iovec *iovec = (*task)->iovec;
-    struct ot_task *ptask = *task;
-    int i;
-
-    /* Free task's iovec */
-    for( i=0; i<(*task)->iovec_entries; ++i )
-      munmap( iovec[i].iov_base, iovec[i].iov_len );
+  /* A streamed task may have left chunks in the finished queue. Workers
+     find their running task gone and throw away their results */
+  for( i=0; i<OT_TASK_CLASSES; ++i )
+    pending_tasks[i].last = mutex_workqueue_cancelchain( &pending_tasks[i].first, sock, &pending_stats[i].depth );
+  for( i=0; i<OT_RUNNING_TASKS_BUCKETS; ++i )
+    mutex_workqueue_cancelchain( running_tasks + i, sock, NULL );
+  finished_tasks.last = mutex_workqueue_cancelchain( &finished_tasks.first, sock, NULL );
 
-    *task = (*task)->next;
-    free( ptask );
-  }
+  /* A worker waiting for the stream to drain finds its task gone */
+  pthread_cond_broadcast( &tasklist_drained );
 
   /* Release lock */
   MTX_DBG( "canceltask unlocks.\n" );
@@ -197,33 +317,44 @@ void mutex_workqueue_canceltask( int64 sock ) {
 }
 
 ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype ) {
-  struct ot_task * task;
-  ot_taskid taskid = 0;
+  return mutex_workqueue_popdelta( tasktype, NULL );
+}
+
+ot_taskid mutex_workqueue_popdelta( ot_tasktype *tasktype, ot_time *since ) {
+  struct ot_task *task, **slot;
+  int             taskclass = OT_TASK_CLASS( *tasktype );
+  ot_taskqueue_stats *stats = pending_stats + taskclass;
+  ot_taskid       taskid;
+  unsigned long long waited;
 
   /* Want exclusive access to tasklist */
   MTX_DBG( "poptask mutex locks.\n" );
   pthread_mutex_lock( &tasklist_mutex );
   MTX_DBG( "poptask mutex locked.\n" );
 
-  while( !taskid ) {
-    /* Skip to the first unassigned task this worker wants to do */
-    task = tasklist;
-    while( task && ( ( ( TASK_CLASS_MASK & task->tasktype ) != *tasktype ) || task->taskid ) )
-      task = task->next;
-
-    /* If we found an outstanding task, assign a taskid to it
-       and leave the loop */
-    if( task ) {
-      task->taskid = taskid = ++next_free_taskid;
-      *tasktype = task->tasktype;
-    } else {
-      /* Wait until the next task is being fed */
-      MTX_DBG( "poptask cond waits.\n" );
-      pthread_cond_wait( &tasklist_being_filled, &tasklist_mutex );
-      MTX_DBG( "poptask cond waited.\n" );
-    }
+  /* Wait until the next task of our class is being fed */
+  while( !( task = taskqueue_pop( pending_tasks + taskclass ) ) ) {
+    MTX_DBG( "poptask cond waits.\n" );
+    pthread_cond_wait( tasks_pending + taskclass, &tasklist_mutex );
+    MTX_DBG( "poptask cond waited.\n" );
   }
 
+  waited = mutex_now_ms( ) - task->queued_ms;
+  --stats->depth;
+  ++stats->popped;
+  stats->wait_ms += waited;
+  if( waited > stats->wait_max_ms )
+    stats->wait_max_ms = waited;
+
+  /* Assign a taskid and file the task under it */
+  task->taskid = taskid = ++next_free_taskid;
+  *tasktype = task->tasktype;
+  if( since )
+    *since = task->since;
+  slot = mutex_workqueue_findtask( taskid );
+  task->next = NULL;
+  *slot = task;
+
   /* Release lock */
   MTX_DBG( "poptask end mutex unlocks.\n" );
   pthread_mutex_unlock( &tasklist_mutex );
@@ -233,20 +364,16 @@ ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype ) {
 }
 
 void mutex_workqueue_pushsuccess( ot_taskid taskid ) {
-  struct ot_task ** task;
+  struct ot_task **task;
 
   /* Want exclusive access to tasklist */
   MTX_DBG( "pushsuccess locks.\n" );
   pthread_mutex_lock( &tasklist_mutex );
   MTX_DBG( "pushsuccess locked.\n" );
 
-  task = &tasklist;
-  while( *task && ( (*task)->taskid != taskid ) )
-    *task = (*task)->next;
-
-  if( *task && ( (*task)->taskid == taskid ) ) {
+  if( *( task = mutex_workqueue_findtask( taskid ) ) ) {
     struct ot_task *ptask = *task;
-    *task = (*task)->next;
+    *task = ptask->next;
     free( ptask );
   }
 
@@ -256,23 +383,22 @@ void mutex_workqueue_pushsuccess( ot_taskid taskid ) {
   MTX_DBG( "pushsuccess unlocked.\n" );
 }
 
-int mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iovec *iovec ) {
-  struct ot_task * task;
-  const char byte = 'o';
+int mutex_workqueue_pushsnapshot( ot_taskid taskid, int iovec_entries, struct iovec *iovec, struct ot_fullscrape_snapshot *snapshot ) {
+  struct ot_task **slot, *task;
 
   /* Want exclusive access to tasklist */
   MTX_DBG( "pushresult locks.\n" );
   pthread_mutex_lock( &tasklist_mutex );
   MTX_DBG( "pushresult locked.\n" );
 
-  task = tasklist;
-  while( task && ( task->taskid != taskid ) )
-    task = task->next;
-
-  if( task ) {
+  if( ( task = *( slot = mutex_workqueue_findtask( taskid ) ) ) ) {
+    *slot = task->next;
     task->iovec_entries = iovec_entries;
     task->iovec         = iovec;
+    task->snapshot      = snapshot;
     task->tasktype      = TASK_DONE;
+    taskqueue_push( &finished_tasks, task );
+    mutex_workqueue_signal( );
   }
 
   /* Release lock */
@@ -280,36 +406,124 @@ int mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iove
   pthread_mutex_unlock( &tasklist_mutex );
   MTX_DBG( "pushresult unlocked.\n" );
 
-  io_trywrite( g_self_pipe[1], &byte, 1 );
-
   /* Indicate whether the worker has to throw away results */
   return task ? 0 : -1;
 }
 
-int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec ) {
-  struct ot_task ** task;
-  int64 sock = -1;
+int mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iovec *iovec ) {
+  return mutex_workqueue_pushsnapshot( taskid, iovec_entries, iovec, NULL );
+}
+
+void mutex_workqueue_pushcursor( ot_taskid taskid, ot_time cursor, int full ) {
+  struct ot_task *task;
 
   /* Want exclusive access to tasklist */
-  MTX_DBG( "popresult locks.\n" );
   pthread_mutex_lock( &tasklist_mutex );
-  MTX_DBG( "popresult locked.\n" );
+  if( ( task = *mutex_workqueue_findtask( taskid ) ) ) {
+    task->cursor = cursor;
+    task->full   = full;
+  }
+  pthread_mutex_unlock( &tasklist_mutex );
+}
 
-  task = &tasklist;
-  while( *task && ( (*task)->tasktype != TASK_DONE ) )
-    task = &(*task)->next;
+int mutex_workqueue_pushchunk( ot_taskid taskid, int iovec_entries, struct iovec *iovec ) {
+  struct ot_task * task, * chunk;
+  size_t i;
 
-  if( *task && ( (*task)->tasktype == TASK_DONE ) ) {
-    struct ot_task *ptask = *task;
+  if( !( chunk = malloc( sizeof( struct ot_task ) ) ) ) {
+    for( i=0; i<(size_t)iovec_entries; ++i )
+      munmap( iovec[i].iov_base, iovec[i].iov_len );
+    free( iovec );
+    return -1;
+  }
 
-    *iovec_entries = (*task)->iovec_entries;
-    *iovec         = (*task)->iovec;
-    sock           = (*task)->sock;
+  /* Want exclusive access to tasklist */
+  MTX_DBG( "pushchunk locks.\n" );
+  pthread_mutex_lock( &tasklist_mutex );
+  MTX_DBG( "pushchunk locked.\n" );
 
-    *task = (*task)->next;
-    free( ptask );
+  if( !( task = *mutex_workqueue_findtask( taskid ) ) ) {
+    MTX_DBG( "pushchunk fail unlocks.\n" );
+    pthread_mutex_unlock( &tasklist_mutex );
+    free( chunk );
+    for( i=0; i<(size_t)iovec_entries; ++i )
+      munmap( iovec[i].iov_base, iovec[i].iov_len );
+    free( iovec );
+    return -1;
   }
 
+  /* Chunks are finished before their task, the main loop takes them in
+     order and the final result last */
+  chunk->taskid        = 0;
+  chunk->tasktype      = TASK_DONE;
+  chunk->sock          = task->sock;
+  chunk->iovec_entries = iovec_entries;
+  chunk->iovec         = iovec;
+  chunk->snapshot      = NULL;
+  chunk->cursor        = task->cursor;
+  chunk->full          = task->full;
+  chunk->pending       = 0;
+  chunk->partial       = 1;
+  taskqueue_push( &finished_tasks, chunk );
+
+  for( i=0; i<(size_t)iovec_entries; ++i )
+    task->pending += iovec[i].iov_len;
+
+  mutex_workqueue_signal( );
+
+  /* Hold the worker back while the client is slow */
+  while( ( task = *mutex_workqueue_findtask( taskid ) ) && task->pending > OT_FULLSCRAPE_STREAM_BACKLOG )
+    pthread_cond_wait( &tasklist_drained, &tasklist_mutex );
+
+  /* Release lock */
+  MTX_DBG( "pushchunk unlocks.\n" );
+  pthread_mutex_unlock( &tasklist_mutex );
+  MTX_DBG( "pushchunk unlocked.\n" );
+
+  return task ? 0 : -1;
+}
+
+void mutex_workqueue_streamsent( int64 sock, size_t sent ) {
+  struct ot_task * task = NULL;
+  int i;
+
+  /* Want exclusive access to tasklist */
+  pthread_mutex_lock( &tasklist_mutex );
+
+  /* Only as many tasks run as there are workers */
+  for( i=0; i<OT_RUNNING_TASKS_BUCKETS && !task; ++i )
+    for( task = running_tasks[i]; task && task->sock != sock; task = task->next );
+
+  if( task ) {
+    task->pending = sent < task->pending ? task->pending - sent : 0;
+    pthread_cond_broadcast( &tasklist_drained );
+  }
+
+  pthread_mutex_unlock( &tasklist_mutex );
+}
+
+int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec, struct ot_fullscrape_snapshot **snapshot, int *partial, ot_time *cursor, int *full ) {
+  struct ot_task * task;
+  int64 sock = -1;
+
+  /* Want exclusive access to tasklist */
+  MTX_DBG( "popresult locks.\n" );
+  pthread_mutex_lock( &tasklist_mutex );
+  MTX_DBG( "popresult locked.\n" );
+
+  if( ( task = taskqueue_pop( &finished_tasks ) ) ) {
+    *iovec_entries = task->iovec_entries;
+    *iovec         = task->iovec;
+    *snapshot      = task->snapshot;
+    *partial       = task->partial;
+    *cursor        = task->cursor;
+    *full          = task->full;
+    sock           = task->sock;
+    free( task );
+  } else
+    /* Drained, the next result needs to wake up the main loop again */
+    finished_tasks_signalled = 0;
+
   /* Release lock */
   MTX_DBG( "popresult unlocks.\n" );
   pthread_mutex_unlock( &tasklist_mutex );
@@ -317,20 +531,63 @@ int64 mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovec ) {
   return sock;
 }
 
+void mutex_workqueue_stats( ot_tasktype taskclass, ot_taskqueue_stats *stats ) {
+  pthread_mutex_lock( &tasklist_mutex );
+  *stats = pending_stats[OT_TASK_CLASS( taskclass )];
+  pthread_mutex_unlock( &tasklist_mutex );
+}
+
+void mutex_set_bucket_count( size_t bucket_count ) {
+  int bits = OT_BUCKET_COUNT_BITS_MIN;
+  while( bits < OT_BUCKET_COUNT_BITS_MAX && ( (size_t)1 << bits ) < bucket_count )
+    ++bits;
+  g_bucket_count_bits = bits;
+}
+
 void mutex_init( ) {
+  pthread_mutexattr_t attr;
+  int bucket;
+
   pthread_mutex_init(&tasklist_mutex, NULL);
-  pthread_cond_init (&tasklist_being_filled, NULL);
-  pthread_mutex_init(&bucket_mutex, NULL);
-  pthread_cond_init (&bucket_being_unlocked, NULL);
-  byte_zero( all_torrents, sizeof( all_torrents ) );
+  for( bucket=0; bucket<OT_TASK_CLASSES; ++bucket )
+    pthread_cond_init (tasks_pending + bucket, NULL);
+  pthread_cond_init (&tasklist_drained, NULL);
+
+  /* Bucket locks are held for very short periods. Where available, let
+     waiters spin a bit before they go to sleep */
+  if( posix_memalign( (void**)&bucket_locks, OT_CACHELINE_SIZE, OT_BUCKET_COUNT * sizeof( ot_bucket_lock ) ) )
+    exerr( "Could not allocate bucket locks." );
+  all_torrents = calloc( OT_BUCKET_COUNT, sizeof( ot_vector ) );
+  bucket_changes = calloc( OT_BUCKET_COUNT, sizeof( ot_bucket_changes ) );
+  if( !all_torrents || !bucket_changes )
+    exerr( "Could not allocate torrent buckets." );
+
+  pthread_mutexattr_init( &attr );
+#ifdef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+  pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_ADAPTIVE_NP );
+#endif
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket )
+    pthread_mutex_init( &bucket_locks[bucket].mutex, &attr );
+  pthread_mutexattr_destroy( &attr );
 }
 
 void mutex_deinit( ) {
-  pthread_mutex_destroy(&bucket_mutex);
-  pthread_cond_destroy(&bucket_being_unlocked);
+  int bucket;
+
+  for( bucket=0; bucket<OT_BUCKET_COUNT; ++bucket ) {
+    pthread_mutex_destroy( &bucket_locks[bucket].mutex );
+    free( bucket_changes[bucket].removals.data );
+  }
   pthread_mutex_destroy(&tasklist_mutex);
-  pthread_cond_destroy(&tasklist_being_filled);
-  byte_zero( all_torrents, sizeof( all_torrents ) );
+  for( bucket=0; bucket<OT_TASK_CLASSES; ++bucket )
+    pthread_cond_destroy(tasks_pending + bucket);
+  pthread_cond_destroy(&tasklist_drained);
+  free( bucket_locks );
+  free( all_torrents );
+  free( bucket_changes );
+  bucket_locks = NULL;
+  all_torrents = NULL;
+  bucket_changes = NULL;
 }
 
 const char *g_version_mutex_c = "$Source$: $Revision$\n";
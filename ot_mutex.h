@@ -11,6 +11,9 @@
 void mutex_init( );
 void mutex_deinit( );
 
+/* Must be called before mutex_init, rounds up to the next power of two */
+void mutex_set_bucket_count( size_t bucket_count );
+
 ot_vector *mutex_bucket_lock( int bucket );
 ot_vector *mutex_bucket_lock_by_hash( ot_hash hash );
 
@@ -19,6 +22,27 @@ void mutex_bucket_unlock_by_hash( ot_hash hash, int delta_torrentcount );
 
 size_t mutex_get_torrent_count();
 
+/* Delta full scrapes keep removed torrents this many seconds, see
+   tracker.fullscrape_delta_window. Older cursors get everything */
+#define OT_DELTA_WINDOW 3600
+extern unsigned int g_delta_window;
+
+typedef struct {
+  ot_hash hash;
+  ot_time removed;
+} ot_removal;
+
+/* Change tracking for delta full scrapes, all with the bucket locked.
+   mutex_bucket_changed stamps a torrent whose counts changed and its
+   bucket, mutex_bucket_removed remembers a torrent leaving its bucket.
+   mutex_bucket_changes returns the bucket's stamp and its removals in
+   time order, mutex_bucket_expire_removals forgets the ones that fell
+   out of g_delta_window */
+void    mutex_bucket_changed( ot_torrent *torrent );
+void    mutex_bucket_removed( ot_hash hash );
+void    mutex_bucket_expire_removals( int bucket );
+ot_time mutex_bucket_changes( int bucket, ot_removal **removals, size_t *removal_count );
+
 typedef enum {
   TASK_STATS_CONNS                 = 0x0001,
   TASK_STATS_TCP                   = 0x0002,
@@ -33,6 +57,10 @@ typedef enum {
   TASK_STATS_SYNCS                 = 0x000b,
   TASK_STATS_COMPLETED             = 0x000c,
   TASK_STATS_NUMWANTS              = 0x000d,
+  TASK_STATS_SLAB                  = 0x000e,
+  TASK_STATS_PARTIAL_WRITES        = 0x000f,
+  TASK_STATS_FULLSCRAPE_SNAPSHOTS  = 0x0010,
+  TASK_STATS_WORKERS               = 0x0011,
 
   TASK_STATS                       = 0x0100, /* Mask */
   TASK_STATS_TORRENTS              = 0x0101,
@@ -56,7 +84,8 @@ typedef enum {
   TASK_DONE                        = 0x0f00,
 
   TASK_FLAG_GZIP                   = 0x1000,
-  TASK_FLAG_BZIP2                  = 0x2000,
+  TASK_FLAG_ZSTD                   = 0x2000,
+  TASK_FLAG_DELTA                  = 0x4000,
 
   TASK_TASK_MASK                   = 0x0fff,
   TASK_CLASS_MASK                  = 0x0f00,
@@ -69,7 +98,42 @@ int       mutex_workqueue_pushtask( int64 sock, ot_tasktype tasktype );
 void      mutex_workqueue_canceltask( int64 sock );
 void      mutex_workqueue_pushsuccess( ot_taskid taskid );
 ot_taskid mutex_workqueue_poptask( ot_tasktype *tasktype );
+
+/* Like pushtask and poptask, for tasks that carry the cursor of a delta
+   full scrape */
+int       mutex_workqueue_pushdelta( int64 sock, ot_tasktype tasktype, ot_time since );
+ot_taskid mutex_workqueue_popdelta( ot_tasktype *tasktype, ot_time *since );
 int       mutex_workqueue_pushresult( ot_taskid taskid, int iovec_entries, struct iovec *iovector );
-int64     mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovector );
+
+/* Like pushresult, but the iovector belongs to a full scrape snapshot and
+   is not freed by whoever takes it. Instead they release the snapshot */
+struct ot_fullscrape_snapshot;
+int       mutex_workqueue_pushsnapshot( ot_taskid taskid, int iovec_entries, struct iovec *iovector, struct ot_fullscrape_snapshot *snapshot );
+int64     mutex_workqueue_popresult( int *iovec_entries, struct iovec ** iovector, struct ot_fullscrape_snapshot **snapshot, int *partial, ot_time *cursor, int *full );
+
+/* Delta full scrapes record the cursor for the client's next poll and
+   whether they list all torrents before they push anything. popresult
+   hands both out with every result of the task, the cursor is -1 for
+   tasks that are no delta */
+void      mutex_workqueue_pushcursor( ot_taskid taskid, ot_time cursor, int full );
+
+/* Streamed results hand over their chunks before the final result, which
+   popresult tells by partial. pushchunk blocks while more than
+   OT_FULLSCRAPE_STREAM_BACKLOG bytes wait to be sent, the main loop reports
+   what went out with streamsent. The chunks always change hands, returns
+   -1 if the task was cancelled */
+int       mutex_workqueue_pushchunk( ot_taskid taskid, int iovec_entries, struct iovec *iovector );
+void      mutex_workqueue_streamsent( int64 sock, size_t sent );
+
+/* Queue metrics of a task class, to size its pool of workers */
+typedef struct {
+  size_t             depth;        /* tasks waiting now */
+  size_t             depth_max;    /* most tasks waiting at once */
+  unsigned long long popped;       /* tasks taken by a worker */
+  unsigned long long wait_ms;      /* time they waited, summed up */
+  unsigned long long wait_max_ms;  /* longest time one waited */
+} ot_taskqueue_stats;
+
+void      mutex_workqueue_stats( ot_tasktype taskclass, ot_taskqueue_stats *stats );
 
 #endif
@@ -0,0 +1,308 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* Opentracker */
+#include "ot_slab.h"
+
+#define OT_SLAB_CACHELINE_SIZE 64
+
+typedef struct ot_slab_object {
+  struct ot_slab_object *next;
+} ot_slab_object;
+
+/* Every chunk starts with a header linking it to the class' other chunks,
+   padded to keep the objects behind it aligned */
+typedef union ot_slab_chunk {
+  union ot_slab_chunk *next;
+  uint8_t              pad[OT_SLAB_GRANULARITY];
+} ot_slab_chunk;
+
+typedef struct {
+  pthread_mutex_t  lock;
+  ot_slab_object  *depot;        /* free objects no thread holds in its cache */
+  size_t           depot_count;
+  ot_slab_chunk   *chunks;
+  size_t           chunk_count;
+  uint8_t         *carve_ptr;    /* part of the newest chunk not yet handed out */
+  uint8_t         *carve_end;
+  size_t           carved;       /* objects ever handed out from chunks */
+} ot_slab_class;
+
+typedef struct {
+  ot_slab_object  *free;
+  size_t           count;
+} ot_slab_cache;
+
+/* Objects freed by another thread than the one that allocated them make
+   a thread's counts go negative, only the sum over all threads means anything */
+typedef struct {
+  ssize_t          in_use;
+  ssize_t          requested;    /* bytes asked for by users of in_use objects */
+} ot_slab_counts;
+
+typedef struct ot_slab_block {
+  ot_slab_counts        counts[OT_SLAB_CLASSES];
+  struct ot_slab_block *next;
+} __attribute__((aligned(OT_SLAB_CACHELINE_SIZE))) ot_slab_block;
+
+static ot_slab_class          g_slab_classes[OT_SLAB_CLASSES];
+static __thread ot_slab_cache g_slab_caches[OT_SLAB_CLASSES];
+
+/* Threads that could not get a block of their own share this one */
+static ot_slab_block           g_slab_shared_block;
+static ot_slab_block          *g_slab_blocks = &g_slab_shared_block;
+static pthread_mutex_t         g_slab_blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread ot_slab_block *g_slab_block;
+
+#define SLAB_CLASS(size)       ( ( (size) - 1 ) / OT_SLAB_GRANULARITY )
+#define SLAB_OBJECTSIZE(class) ( ( (class) + 1 ) * OT_SLAB_GRANULARITY )
+
+/* Hands out the calling thread's counters, making them on its first call.
+   Blocks are never freed, so objects handed between threads still add up */
+static ot_slab_block *slab_register( void ) {
+  ot_slab_block *block;
+
+  if( posix_memalign( (void**)&block, OT_SLAB_CACHELINE_SIZE, sizeof( ot_slab_block ) ) )
+    return g_slab_block = &g_slab_shared_block;
+  memset( block, 0, sizeof( ot_slab_block ) );
+
+  pthread_mutex_lock( &g_slab_blocks_mutex );
+  block->next   = g_slab_blocks;
+  g_slab_blocks = block;
+  pthread_mutex_unlock( &g_slab_blocks_mutex );
+
+  return g_slab_block = block;
+}
+
+static void slab_count( int class, ssize_t in_use, ssize_t requested ) {
+  ot_slab_block *block = g_slab_block ? g_slab_block : slab_register( );
+
+  if( block == &g_slab_shared_block ) {
+    __sync_fetch_and_add( &block->counts[class].in_use, in_use );
+    __sync_fetch_and_add( &block->counts[class].requested, requested );
+  } else {
+    block->counts[class].in_use    += in_use;
+    block->counts[class].requested += requested;
+  }
+}
+
+/* Moves up to a batch of objects from the depot, or fresh ones from the
+   chunks, into the calling thread's cache */
+static int slab_refill( int class, ot_slab_cache *cache ) {
+  ot_slab_class *sc = g_slab_classes + class;
+  size_t         object_size = SLAB_OBJECTSIZE( class ), moved = 0;
+
+  pthread_mutex_lock( &sc->lock );
+  while( sc->depot && moved < OT_SLAB_BATCH ) {
+    ot_slab_object *object = sc->depot;
+    sc->depot    = object->next;
+    object->next = cache->free;
+    cache->free  = object;
+    ++moved;
+  }
+  sc->depot_count -= moved;
+
+  while( moved < OT_SLAB_BATCH ) {
+    ot_slab_object *object;
+    if( sc->carve_ptr + object_size > sc->carve_end ) {
+      ot_slab_chunk *chunk;
+      if( moved ) break;
+      if( !( chunk = malloc( OT_SLAB_CHUNKSIZE ) ) ) break;
+      chunk->next   = sc->chunks;
+      sc->chunks    = chunk;
+      sc->carve_ptr = (uint8_t*)( chunk + 1 );
+      sc->carve_end = ((uint8_t*)chunk) + OT_SLAB_CHUNKSIZE;
+      sc->chunk_count++;
+    }
+    object        = (ot_slab_object*)sc->carve_ptr;
+    sc->carve_ptr += object_size;
+    object->next  = cache->free;
+    cache->free   = object;
+    sc->carved++;
+    ++moved;
+  }
+  pthread_mutex_unlock( &sc->lock );
+
+  cache->count += moved;
+  return moved ? 0 : -1;
+}
+
+/* Gives a batch of objects from the calling thread's cache back to the depot */
+static void slab_drain( int class, ot_slab_cache *cache, size_t amount ) {
+  ot_slab_class  *sc = g_slab_classes + class;
+  ot_slab_object *first = cache->free, *last = first;
+  size_t          moved = 1;
+
+  if( !first ) return;
+  while( moved < amount && last->next ) {
+    last = last->next;
+    ++moved;
+  }
+  cache->free   = last->next;
+  cache->count -= moved;
+
+  pthread_mutex_lock( &sc->lock );
+  last->next       = sc->depot;
+  sc->depot        = first;
+  sc->depot_count += moved;
+  pthread_mutex_unlock( &sc->lock );
+}
+
+void *slab_alloc( size_t size ) {
+  ot_slab_cache  *cache;
+  ot_slab_object *object;
+  int             class;
+
+  if( !size || size > OT_SLAB_MAXSIZE )
+    return malloc( size );
+
+  class = SLAB_CLASS( size );
+  cache = g_slab_caches + class;
+  if( !cache->free && slab_refill( class, cache ) )
+    return NULL;
+
+  object      = cache->free;
+  cache->free = object->next;
+  cache->count--;
+
+  slab_count( class, 1, size );
+  return object;
+}
+
+void slab_free( void *ptr, size_t size ) {
+  ot_slab_cache  *cache;
+  ot_slab_object *object = ptr;
+  int             class;
+
+  if( !ptr ) return;
+  if( !size || size > OT_SLAB_MAXSIZE ) {
+    free( ptr );
+    return;
+  }
+
+  class = SLAB_CLASS( size );
+  cache = g_slab_caches + class;
+  object->next = cache->free;
+  cache->free  = object;
+  if( ++cache->count > 2 * OT_SLAB_BATCH )
+    slab_drain( class, cache, OT_SLAB_BATCH );
+
+  slab_count( class, -1, -(ssize_t)size );
+}
+
+void *slab_realloc( void *ptr, size_t old_size, size_t new_size ) {
+  void *new_ptr;
+
+  if( !ptr )
+    return slab_alloc( new_size );
+
+  /* Both sizes beyond the slab's reach: let libc try to grow in place */
+  if( old_size > OT_SLAB_MAXSIZE && new_size > OT_SLAB_MAXSIZE )
+    return realloc( ptr, new_size );
+
+  /* Staying in the same size class only changes the accounting */
+  if( old_size && new_size && old_size <= OT_SLAB_MAXSIZE && new_size <= OT_SLAB_MAXSIZE &&
+      SLAB_CLASS( old_size ) == SLAB_CLASS( new_size ) ) {
+    slab_count( SLAB_CLASS( new_size ), 0, (ssize_t)new_size - (ssize_t)old_size );
+    return ptr;
+  }
+
+  if( !( new_ptr = slab_alloc( new_size ) ) )
+    return NULL;
+  memcpy( new_ptr, ptr, old_size < new_size ? old_size : new_size );
+  slab_free( ptr, old_size );
+  return new_ptr;
+}
+
+/* Sums up the counts of all threads. They are read while their threads
+   keep counting, so each value is as of some moment during the call */
+static void slab_sum( ot_slab_counts *sum ) {
+  ot_slab_block *block;
+  int            class;
+
+  memset( sum, 0, OT_SLAB_CLASSES * sizeof( ot_slab_counts ) );
+  pthread_mutex_lock( &g_slab_blocks_mutex );
+  for( block = g_slab_blocks; block; block = block->next )
+    for( class=0; class<OT_SLAB_CLASSES; ++class ) {
+      volatile ot_slab_counts *in = block->counts + class;
+      sum[class].in_use    += in->in_use;
+      sum[class].requested += in->requested;
+    }
+  pthread_mutex_unlock( &g_slab_blocks_mutex );
+}
+
+size_t slab_return_stats( char *reply ) {
+  char          *r = reply;
+  size_t         reserved_total = 0, used_total = 0, requested_total = 0;
+  ot_slab_counts counts[OT_SLAB_CLASSES];
+  int            class;
+
+  slab_sum( counts );
+
+  r += sprintf( r, "size chunks carved in_use depot reserved used requested\n" );
+  for( class=0; class<OT_SLAB_CLASSES; ++class ) {
+    ot_slab_class *sc = g_slab_classes + class;
+    size_t chunks, carved, depot, in_use, requested;
+
+    pthread_mutex_lock( &sc->lock );
+    chunks = sc->chunk_count; carved = sc->carved; depot = sc->depot_count;
+    pthread_mutex_unlock( &sc->lock );
+    /* Sums taken while threads move objects may briefly dip below zero */
+    in_use    = counts[class].in_use    > 0 ? (size_t)counts[class].in_use    : 0;
+    requested = counts[class].requested > 0 ? (size_t)counts[class].requested : 0;
+
+    if( !chunks ) continue;
+    r += sprintf( r, "%4d %6zu %10zu %10zu %10zu %12zu %12zu %12zu\n", SLAB_OBJECTSIZE( class ), chunks, carved, in_use, depot,
+                  chunks * OT_SLAB_CHUNKSIZE, in_use * SLAB_OBJECTSIZE( class ), requested );
+    reserved_total  += chunks * OT_SLAB_CHUNKSIZE;
+    used_total      += in_use * SLAB_OBJECTSIZE( class );
+    requested_total += requested;
+  }
+
+  /* Fragmentation is the share of reserved memory not holding requested bytes:
+     free objects in the depot and thread caches, uncarved chunk tails and
+     rounding up to the size class */
+  r += sprintf( r, "total reserved %zu used %zu requested %zu fragmentation %zu%%\n", reserved_total, used_total, requested_total,
+                reserved_total ? 100 - ( 100 * requested_total ) / reserved_total : 0 );
+  return r - reply;
+}
+
+void slab_init( void ) {
+  ot_slab_block *block;
+  int            class;
+  memset( g_slab_classes, 0, sizeof( g_slab_classes ) );
+  pthread_mutex_lock( &g_slab_blocks_mutex );
+  for( block = g_slab_blocks; block; block = block->next )
+    memset( block->counts, 0, sizeof( block->counts ) );
+  pthread_mutex_unlock( &g_slab_blocks_mutex );
+  for( class=0; class<OT_SLAB_CLASSES; ++class )
+    pthread_mutex_init( &g_slab_classes[class].lock, NULL );
+}
+
+/* Only call this when no thread allocates any more. Objects still cached
+   by threads go away with their chunks */
+void slab_deinit( void ) {
+  int class;
+  for( class=0; class<OT_SLAB_CLASSES; ++class ) {
+    ot_slab_class *sc = g_slab_classes + class;
+    while( sc->chunks ) {
+      ot_slab_chunk *chunk = sc->chunks;
+      sc->chunks = chunk->next;
+      free( chunk );
+    }
+    pthread_mutex_destroy( &sc->lock );
+  }
+  memset( g_slab_caches, 0, sizeof( g_slab_caches ) );
+}
+
+const char *g_version_slab_c = "$Source$: $Revision$\n";
@@ -0,0 +1,31 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef OT_SLAB_H__
+#define OT_SLAB_H__
+
+/* Small objects (peer lists, small peer vectors) are carved from big
+   chunks in size classes of OT_SLAB_GRANULARITY bytes. Larger requests
+   are passed on to malloc. Callers must hand back the size they asked for */
+#define OT_SLAB_GRANULARITY 16
+#define OT_SLAB_MAXSIZE     256
+#define OT_SLAB_CLASSES     ( OT_SLAB_MAXSIZE / OT_SLAB_GRANULARITY )
+
+/* Amount of memory requested from malloc at once for a size class */
+#define OT_SLAB_CHUNKSIZE   ( 256 * 1024 )
+
+/* Objects moved between a thread's private cache and the shared depot */
+#define OT_SLAB_BATCH       32
+
+void   slab_init( void );
+void   slab_deinit( void );
+
+void  *slab_alloc( size_t size );
+void   slab_free( void *ptr, size_t size );
+void  *slab_realloc( void *ptr, size_t old_size, size_t new_size );
+
+size_t slab_return_stats( char *reply );
+
+#endif
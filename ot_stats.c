@@ -14,6 +14,12 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <inttypes.h>
+#ifdef WANT_COMPRESSION_GZIP
+#include <zlib.h>
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
 #ifdef WANT_SYSLOGS
 #include <syslog.h>
 #endif
@@ -30,6 +36,8 @@
 #include "ot_iovec.h"
 #include "ot_stats.h"
 #include "ot_accesslist.h"
+#include "ot_slab.h"
+#include "ot_fullscrape.h"
 
 #ifndef NO_FULLSCRAPE_LOGGING
 #define LOG_TO_STDERR( ... ) fprintf( stderr, __VA_ARGS__ )
@@ -41,28 +49,52 @@
 static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype mode );
 #define OT_STATS_TMPSIZE 8192
 
-/* Clumsy counters... to be rethought */
-static unsigned long long ot_overall_tcp_connections = 0;
-static unsigned long long ot_overall_udp_connections = 0;
-static unsigned long long ot_overall_tcp_successfulannounces = 0;
-static unsigned long long ot_overall_udp_successfulannounces = 0;
-static unsigned long long ot_overall_tcp_successfulscrapes = 0;
-static unsigned long long ot_overall_udp_successfulscrapes = 0;
-static unsigned long long ot_overall_udp_connectionidmissmatches = 0;
-static unsigned long long ot_overall_tcp_connects = 0;
-static unsigned long long ot_overall_udp_connects = 0;
-static unsigned long long ot_overall_completed = 0;
-static unsigned long long ot_full_scrape_count = 0;
-static unsigned long long ot_full_scrape_request_count = 0;
-static unsigned long long ot_full_scrape_size = 0;
-static unsigned long long ot_failed_request_counts[CODE_HTTPERROR_COUNT];
+/* Counters live in a block per thread, so that no two threads write to
+   the same cache line and no increment gets lost. Readers sum up all
+   blocks, see stats_sum */
+#define OT_STATS_CACHELINE_SIZE 64
+
+typedef struct {
+  unsigned long long overall_tcp_connections;
+  unsigned long long overall_udp_connections;
+  unsigned long long overall_tcp_successfulannounces;
+  unsigned long long overall_udp_successfulannounces;
+  unsigned long long overall_tcp_successfulscrapes;
+  unsigned long long overall_udp_successfulscrapes;
+  unsigned long long overall_udp_connectionidmissmatches;
+  unsigned long long overall_tcp_connects;
+  unsigned long long overall_udp_connects;
+  unsigned long long overall_completed;
+  unsigned long long full_scrape_count;
+  unsigned long long full_scrape_request_count;
+  unsigned long long full_scrape_size;
+  unsigned long long full_scrape_snapshot_hits;
+  unsigned long long full_scrape_snapshot_misses;
+  unsigned long long failed_request_counts[CODE_HTTPERROR_COUNT];
+  unsigned long long renewed[OT_PEER_TIMEOUT];
+  unsigned long long overall_sync_count;
+  unsigned long long overall_stall_count;
+  unsigned long long partial_writes;
+  unsigned long long partial_writes_copied;
+} ot_stats_counters;
+
+typedef struct ot_stats_block {
+  ot_stats_counters      counters;
+  struct ot_stats_block *next;
+} __attribute__((aligned(OT_STATS_CACHELINE_SIZE))) ot_stats_block;
+
+/* Threads that could not get a block of their own share this one */
+static ot_stats_block             stats_shared_block;
+static ot_stats_block            *stats_blocks = &stats_shared_block;
+static pthread_mutex_t            stats_blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread ot_stats_counters *stats_counters;
+
 static char *             ot_failed_request_names[] = { "302 Redirect", "400 Parse Error", "400 Invalid Parameter", "400 Invalid Parameter (compact=0)", "400 Not Modest", "402 Payment Required", "403 Access Denied", "404 Not found", "500 Internal Server Error" };
-static unsigned long long ot_renewed[OT_PEER_TIMEOUT];
-static unsigned long long ot_overall_sync_count;
-static unsigned long long ot_overall_stall_count;
 
 static time_t ot_start_time;
 
+unsigned int g_stats_workers = OT_STATS_WORKERS;
+
 #define STATS_NETWORK_NODE_BITWIDTH       4
 #define STATS_NETWORK_NODE_COUNT         (1<<STATS_NETWORK_NODE_BITWIDTH)
 
@@ -225,22 +257,12 @@ static size_t stats_slash24s_txt( char *reply, size_t amount ) {
     ot_vector *torrents_list = mutex_bucket_lock( bucket );
     for( i=0; i<torrents_list->size; ++i ) {
       ot_peerlist *peer_list = ( ((ot_torrent*)(torrents_list->data))[i] ).peer_list;
-      ot_vector   *bucket_list = &peer_list->peers;
-      int          num_buckets = 1;
-
-      if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-        num_buckets = bucket_list->size;
-        bucket_list = (ot_vector *)bucket_list->data;
-      }
+      ot_peer     *peers = (ot_peer*)peer_list->peers.data;
+      size_t       numpeers = peer_list->peers.size;
 
-      while( num_buckets-- ) {
-        ot_peer *peers = (ot_peer*)bucket_list->data;
-        size_t   numpeers = bucket_list->size;
-        while( numpeers-- )
-          if( stat_increase_network_count( &slash24s_network_counters_root, 0, (uintptr_t)(peers++) ) )
-            goto bailout_unlock;
-        ++bucket_list;
-      }
+      while( numpeers-- )
+        if( stat_increase_network_count( &slash24s_network_counters_root, 0, (uintptr_t)(peers++) ) )
+          goto bailout_unlock;
     }
     mutex_bucket_unlock( bucket, 0 );
     if( !g_opentracker_running )
@@ -346,67 +368,132 @@ static unsigned long events_per_time( unsigned long long events, time_t t ) {
   return events / ( (unsigned int)t ? (unsigned int)t : 1 );
 }
 
+/* Hands out the calling thread's counters, making them on its first event.
+   Blocks are never freed, so counts of threads gone stay in the sums */
+static ot_stats_counters *stats_register( ) {
+  ot_stats_block *block;
+
+  if( posix_memalign( (void**)&block, OT_STATS_CACHELINE_SIZE, sizeof( ot_stats_block ) ) )
+    return stats_counters = &stats_shared_block.counters;
+  memset( block, 0, sizeof( ot_stats_block ) );
+
+  pthread_mutex_lock( &stats_blocks_mutex );
+  block->next  = stats_blocks;
+  stats_blocks = block;
+  pthread_mutex_unlock( &stats_blocks_mutex );
+
+  return stats_counters = &block->counters;
+}
+
+/* Sums up the counters of all threads. They are read while their threads
+   keep counting, so each value is as of some moment during the call */
+static void stats_sum( ot_stats_counters *sum ) {
+  unsigned long long *out = (unsigned long long *)sum;
+  ot_stats_block *block;
+  size_t i;
+
+  memset( sum, 0, sizeof( ot_stats_counters ) );
+  pthread_mutex_lock( &stats_blocks_mutex );
+  for( block = stats_blocks; block; block = block->next ) {
+    volatile unsigned long long *in = (volatile unsigned long long *)&block->counters;
+    for( i=0; i<sizeof( ot_stats_counters ) / sizeof( unsigned long long ); ++i )
+      out[i] += in[i];
+  }
+  pthread_mutex_unlock( &stats_blocks_mutex );
+}
+
 static size_t stats_connections_mrtg( char * reply ) {
   ot_time t = time( NULL ) - ot_start_time;
+  ot_stats_counters c;
+
+  stats_sum( &c );
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker connections, %lu conns/s :: %lu success/s.",
-                 ot_overall_tcp_connections+ot_overall_udp_connections,
-                 ot_overall_tcp_successfulannounces+ot_overall_udp_successfulannounces+ot_overall_udp_connects,
+                 c.overall_tcp_connections+c.overall_udp_connections,
+                 c.overall_tcp_successfulannounces+c.overall_udp_successfulannounces+c.overall_udp_connects,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_overall_tcp_connections+ot_overall_udp_connections, t ),
-                 events_per_time( ot_overall_tcp_successfulannounces+ot_overall_udp_successfulannounces+ot_overall_udp_connects, t )
+                 events_per_time( c.overall_tcp_connections+c.overall_udp_connections, t ),
+                 events_per_time( c.overall_tcp_successfulannounces+c.overall_udp_successfulannounces+c.overall_udp_connects, t )
                  );
 }
 
 static size_t stats_udpconnections_mrtg( char * reply ) {
   ot_time t = time( NULL ) - ot_start_time;
+  ot_stats_counters c;
+
+  stats_sum( &c );
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker udp4 stats, %lu conns/s :: %lu success/s.",
-                 ot_overall_udp_connections,
-                 ot_overall_udp_successfulannounces+ot_overall_udp_connects,
+                 c.overall_udp_connections,
+                 c.overall_udp_successfulannounces+c.overall_udp_connects,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_overall_udp_connections, t ),
-                 events_per_time( ot_overall_udp_successfulannounces+ot_overall_udp_connects, t )
+                 events_per_time( c.overall_udp_connections, t ),
+                 events_per_time( c.overall_udp_successfulannounces+c.overall_udp_connects, t )
                  );
 }
 
 static size_t stats_tcpconnections_mrtg( char * reply ) {
   time_t t = time( NULL ) - ot_start_time;
+  ot_stats_counters c;
+
+  stats_sum( &c );
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker tcp4 stats, %lu conns/s :: %lu success/s.",
-                 ot_overall_tcp_connections,
-                 ot_overall_tcp_successfulannounces,
+                 c.overall_tcp_connections,
+                 c.overall_tcp_successfulannounces,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_overall_tcp_connections, t ),
-                 events_per_time( ot_overall_tcp_successfulannounces, t )
+                 events_per_time( c.overall_tcp_connections, t ),
+                 events_per_time( c.overall_tcp_successfulannounces, t )
                  );
 }
 
 static size_t stats_scrape_mrtg( char * reply ) {
   time_t t = time( NULL ) - ot_start_time;
+  ot_stats_counters c;
+
+  stats_sum( &c );
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker scrape stats, %lu scrape/s (tcp and udp)",
-                 ot_overall_tcp_successfulscrapes,
-                 ot_overall_udp_successfulscrapes,
+                 c.overall_tcp_successfulscrapes,
+                 c.overall_udp_successfulscrapes,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( (ot_overall_tcp_successfulscrapes+ot_overall_udp_successfulscrapes), t )
+                 events_per_time( (c.overall_tcp_successfulscrapes+c.overall_udp_successfulscrapes), t )
                  );
 }
 
 static size_t stats_fullscrapes_mrtg( char * reply ) {
   ot_time t = time( NULL ) - ot_start_time;
+  ot_stats_counters c;
+
+  stats_sum( &c );
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker full scrape stats, %lu conns/s :: %lu bytes/s.",
-                 ot_full_scrape_count * 1000,
-                 ot_full_scrape_size,
+                 c.full_scrape_count * 1000,
+                 c.full_scrape_size,
+                 (int)t,
+                 (int)(t / 3600),
+                 events_per_time( c.full_scrape_count, t ),
+                 events_per_time( c.full_scrape_size, t )
+                 );
+}
+
+static size_t stats_fullscrape_snapshots_mrtg( char * reply ) {
+  ot_time t = time( NULL ) - ot_start_time;
+  ot_stats_counters c;
+
+  stats_sum( &c );
+  return sprintf( reply,
+                 "%llu\n%llu\n%i seconds (%i hours)\nopentracker full scrape snapshots, %lu hits/s :: %lu misses/s.",
+                 c.full_scrape_snapshot_hits,
+                 c.full_scrape_snapshot_misses,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_full_scrape_count, t ),
-                 events_per_time( ot_full_scrape_size, t )
+                 events_per_time( c.full_scrape_snapshot_hits, t ),
+                 events_per_time( c.full_scrape_snapshot_misses, t )
                  );
 }
 
@@ -434,44 +521,72 @@ static size_t stats_torrents_mrtg( char * reply )
 }
 
 static size_t stats_httperrors_txt ( char * reply ) {
+  ot_stats_counters c;
+
+  stats_sum( &c );
   return sprintf( reply, "302 RED %llu\n400 ... %llu\n400 PAR %llu\n400 COM %llu\n403 IP  %llu\n404 INV %llu\n500 SRV %llu\n",
-                 ot_failed_request_counts[0], ot_failed_request_counts[1], ot_failed_request_counts[2],
-                 ot_failed_request_counts[3], ot_failed_request_counts[4], ot_failed_request_counts[5],
-                 ot_failed_request_counts[6] );
+                 c.failed_request_counts[0], c.failed_request_counts[1], c.failed_request_counts[2],
+                 c.failed_request_counts[3], c.failed_request_counts[4], c.failed_request_counts[5],
+                 c.failed_request_counts[6] );
+}
+
+static size_t stats_return_partial_writes_mrtg( char * reply ) {
+  ot_time t = time( NULL ) - ot_start_time;
+  ot_stats_counters c;
+
+  stats_sum( &c );
+  return sprintf( reply,
+                 "%llu\n%llu\n%i seconds (%i hours)\nopentracker partial writes, %lu writes/s :: %llu copied.",
+                 c.partial_writes,
+                 c.partial_writes_copied,
+                 (int)t,
+                 (int)(t / 3600),
+                 events_per_time( c.partial_writes, t ),
+                 c.partial_writes_copied
+                 );
 }
 
 static size_t stats_return_renew_bucket( char * reply ) {
   char *r = reply;
   int i;
+  ot_stats_counters c;
+
+  stats_sum( &c );
 
   for( i=0; i<OT_PEER_TIMEOUT; ++i )
-    r+=sprintf(r,"%02i %llu\n", i, ot_renewed[i] );
+    r+=sprintf(r,"%02i %llu\n", i, c.renewed[i] );
   return r - reply;
 }
 
 static size_t stats_return_sync_mrtg( char * reply ) {
 	ot_time t = time( NULL ) - ot_start_time;
+	ot_stats_counters c;
+
+	stats_sum( &c );
 	return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker connections, %lu conns/s :: %lu success/s.",
-                 ot_overall_sync_count,
+                 c.overall_sync_count,
                  0LL,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_overall_tcp_connections+ot_overall_udp_connections, t ),
-                 events_per_time( ot_overall_tcp_successfulannounces+ot_overall_udp_successfulannounces+ot_overall_udp_connects, t )
+                 events_per_time( c.overall_tcp_connections+c.overall_udp_connections, t ),
+                 events_per_time( c.overall_tcp_successfulannounces+c.overall_udp_successfulannounces+c.overall_udp_connects, t )
                  );
 }
 
 static size_t stats_return_completed_mrtg( char * reply ) {
   ot_time t = time( NULL ) - ot_start_time;
+  ot_stats_counters c;
+
+  stats_sum( &c );
 
   return sprintf( reply,
                  "%llu\n%llu\n%i seconds (%i hours)\nopentracker, %lu completed/h.",
-                 ot_overall_completed,
+                 c.overall_completed,
                  0LL,
                  (int)t,
                  (int)(t / 3600),
-                 events_per_time( ot_overall_completed, t / 3600 )
+                 events_per_time( c.overall_completed, t / 3600 )
                  );
 }
 
@@ -488,11 +603,9 @@ static size_t stats_return_numwants( char * reply ) {
 
 #ifdef WANT_FULLLOG_NETWORKS
 static void stats_return_fulllog( int *iovec_entries, struct iovec **iovector, char *r ) {
-  ot_log *loglist = g_logchain_first, *llnext;
+  ot_log *loglist = loglist_take( ), *llnext;
   char * re = r + OT_STATS_TMPSIZE;
 
-  g_logchain_first = g_logchain_last = 0;
-  
   while( loglist ) {
     if( r + ( loglist->size + 64 ) >= re ) {
       r = iovec_fix_increase_or_free( iovec_entries, iovector, r, 32 * OT_STATS_TMPSIZE );
@@ -522,6 +635,9 @@ static size_t stats_return_everything( char * reply ) {
   torrent_stats stats = {0,0,0};
   int i;
   char * r = reply;
+  ot_stats_counters c;
+
+  stats_sum( &c );
 
   iterate_all_torrents( torrent_statter, (uintptr_t)&stats );
 
@@ -533,25 +649,27 @@ static size_t stats_return_everything( char * reply ) {
   r += sprintf( r, "  <torrents>\n" );
   r += sprintf( r, "    <count_mutex>%zd</count_mutex>\n", mutex_get_torrent_count() );
   r += sprintf( r, "    <count_iterator>%llu</count_iterator>\n", stats.torrent_count );
+  r += sprintf( r, "    <buckets>%d</buckets>\n", OT_BUCKET_COUNT );
   r += sprintf( r, "  </torrents>\n" );
   r += sprintf( r, "  <peers>\n    <count>%llu</count>\n  </peers>\n", stats.peer_count );
   r += sprintf( r, "  <seeds>\n    <count>%llu</count>\n  </seeds>\n", stats.seed_count );
-  r += sprintf( r, "  <completed>\n    <count>%llu</count>\n  </completed>\n", ot_overall_completed );
+  r += sprintf( r, "  <completed>\n    <count>%llu</count>\n  </completed>\n", c.overall_completed );
+  r += sprintf( r, "  <fullscrape_snapshots>\n    <hits>%llu</hits>\n    <misses>%llu</misses>\n  </fullscrape_snapshots>\n", c.full_scrape_snapshot_hits, c.full_scrape_snapshot_misses );
   r += sprintf( r, "  <connections>\n" );
-  r += sprintf( r, "    <tcp>\n      <accept>%llu</accept>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n    </tcp>\n", ot_overall_tcp_connections, ot_overall_tcp_successfulannounces, ot_overall_tcp_successfulscrapes );
-  r += sprintf( r, "    <udp>\n      <overall>%llu</overall>\n      <connect>%llu</connect>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n      <missmatch>%llu</missmatch>\n    </udp>\n", ot_overall_udp_connections, ot_overall_udp_connects, ot_overall_udp_successfulannounces, ot_overall_udp_successfulscrapes, ot_overall_udp_connectionidmissmatches );
-  r += sprintf( r, "    <livesync>\n      <count>%llu</count>\n    </livesync>\n", ot_overall_sync_count );
+  r += sprintf( r, "    <tcp>\n      <accept>%llu</accept>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n      <partial_writes>%llu</partial_writes>\n      <partial_writes_copied>%llu</partial_writes_copied>\n    </tcp>\n", c.overall_tcp_connections, c.overall_tcp_successfulannounces, c.overall_tcp_successfulscrapes, c.partial_writes, c.partial_writes_copied );
+  r += sprintf( r, "    <udp>\n      <overall>%llu</overall>\n      <connect>%llu</connect>\n      <announce>%llu</announce>\n      <scrape>%llu</scrape>\n      <missmatch>%llu</missmatch>\n    </udp>\n", c.overall_udp_connections, c.overall_udp_connects, c.overall_udp_successfulannounces, c.overall_udp_successfulscrapes, c.overall_udp_connectionidmissmatches );
+  r += sprintf( r, "    <livesync>\n      <count>%llu</count>\n    </livesync>\n", c.overall_sync_count );
   r += sprintf( r, "  </connections>\n" );
   r += sprintf( r, "  <debug>\n" );
   r += sprintf( r, "    <renew>\n" );
   for( i=0; i<OT_PEER_TIMEOUT; ++i )
-    r += sprintf( r, "      <count interval=\"%02i\">%llu</count>\n", i, ot_renewed[i] );
+    r += sprintf( r, "      <count interval=\"%02i\">%llu</count>\n", i, c.renewed[i] );
   r += sprintf( r, "    </renew>\n" );
   r += sprintf( r, "    <http_error>\n" );
   for( i=0; i<CODE_HTTPERROR_COUNT; ++i )
-    r += sprintf( r, "      <count code=\"%s\">%llu</count>\n", ot_failed_request_names[i], ot_failed_request_counts[i] );
+    r += sprintf( r, "      <count code=\"%s\">%llu</count>\n", ot_failed_request_names[i], c.failed_request_counts[i] );
   r += sprintf( r, "    </http_error>\n" );
-  r += sprintf( r, "    <mutex_stall>\n      <count>%llu</count>\n    </mutex_stall>\n", ot_overall_stall_count );
+  r += sprintf( r, "    <mutex_stall>\n      <count>%llu</count>\n    </mutex_stall>\n", c.overall_stall_count );
   r += sprintf( r, "  </debug>\n" );
   r += sprintf( r, "</stats>" );
   return r - reply;
@@ -560,13 +678,31 @@ static size_t stats_return_everything( char * reply ) {
 extern const char
 *g_version_opentracker_c, *g_version_accesslist_c, *g_version_clean_c, *g_version_fullscrape_c, *g_version_http_c,
 *g_version_iovec_c, *g_version_mutex_c, *g_version_stats_c, *g_version_udp_c, *g_version_vector_c,
-*g_version_scan_urlencoded_query_c, *g_version_trackerlogic_c, *g_version_livesync_c, *g_version_rijndael_c;
+*g_version_scan_urlencoded_query_c, *g_version_trackerlogic_c, *g_version_livesync_c, *g_version_rijndael_c, *g_version_slab_c,
+*g_version_bencode_c, *g_version_tcp_c;
+
+static size_t stats_return_pool_txt( char *reply, const char *name, ot_tasktype taskclass, unsigned int workers ) {
+  ot_taskqueue_stats queue;
+  mutex_workqueue_stats( taskclass, &queue );
+  return sprintf( reply, "%s: %u workers, %zu tasks queued (at most %zu), %llu tasks taken, %llu ms average wait, %llu ms longest wait\n",
+                  name, workers, queue.depth, queue.depth_max, queue.popped, queue.popped ? queue.wait_ms / queue.popped : 0, queue.wait_max_ms );
+}
+
+static size_t stats_return_workers_txt( char *reply ) {
+  char *r = reply;
+  r += stats_return_pool_txt( r, "stats", TASK_STATS, g_stats_workers );
+#ifdef WANT_FULLSCRAPE
+  r += stats_return_pool_txt( r, "fullscrape", TASK_FULLSCRAPE, g_fullscrape_workers );
+#endif
+  return r - reply;
+}
 
 size_t stats_return_tracker_version( char *reply ) {
-  return sprintf( reply, "%s%s%s%s%s%s%s%s%s%s%s%s%s%s",
+  return sprintf( reply, "%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s",
                  g_version_opentracker_c, g_version_accesslist_c, g_version_clean_c, g_version_fullscrape_c, g_version_http_c,
                  g_version_iovec_c, g_version_mutex_c, g_version_stats_c, g_version_udp_c, g_version_vector_c,
-                 g_version_scan_urlencoded_query_c, g_version_trackerlogic_c, g_version_livesync_c, g_version_rijndael_c );
+                 g_version_scan_urlencoded_query_c, g_version_trackerlogic_c, g_version_livesync_c, g_version_rijndael_c, g_version_slab_c,
+                 g_version_bencode_c, g_version_tcp_c );
 }
 
 size_t return_stats_for_tracker( char *reply, int mode, int format ) {
@@ -592,6 +728,14 @@ size_t return_stats_for_tracker( char *reply, int mode, int format ) {
       return stats_return_renew_bucket( reply );
     case TASK_STATS_SYNCS:
       return stats_return_sync_mrtg( reply );
+    case TASK_STATS_SLAB:
+      return slab_return_stats( reply );
+    case TASK_STATS_PARTIAL_WRITES:
+      return stats_return_partial_writes_mrtg( reply );
+    case TASK_STATS_FULLSCRAPE_SNAPSHOTS:
+      return stats_fullscrape_snapshots_mrtg( reply );
+    case TASK_STATS_WORKERS:
+      return stats_return_workers_txt( reply );
 #ifdef WANT_LOG_NUMWANT
     case TASK_STATS_NUMWANTS:
       return stats_return_numwants( reply );
@@ -633,19 +777,92 @@ static void stats_make( int *iovec_entries, struct iovec **iovector, ot_tasktype
   iovec_fixlast( iovec_entries, iovector, r );
 }
 
+#if defined( WANT_COMPRESSION_GZIP ) || defined( WANT_COMPRESSION_ZSTD )
+/* Compression level from ot_http.c */
+extern unsigned int g_zstd_level;
+
+/* Replaces what stats_make put together with one compressed buffer. If
+   that fails, the client gets nothing, as it would without memory */
+static void stats_compress( int *iovec_entries, struct iovec **iovector, ot_tasktype mode ) {
+  size_t        size = iovec_length( iovec_entries, iovector ), done = 0;
+  int           out_entries = 0, i;
+  struct iovec *out_vector = NULL;
+  char         *out = NULL;
+
+#ifdef WANT_COMPRESSION_GZIP
+  if( mode & TASK_FLAG_GZIP ) {
+    z_stream strm;
+    byte_zero( &strm, sizeof(strm) );
+    /* windowBits 31 makes deflate write the gzip header and trailer */
+    if( deflateInit2( &strm, 7, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY ) == Z_OK ) {
+      size_t bound = deflateBound( &strm, size );
+      if( ( out = iovec_increase( &out_entries, &out_vector, bound ) ) ) {
+        strm.next_out  = (uint8_t*)out;
+        strm.avail_out = bound;
+        for( i=0; i<*iovec_entries; ++i ) {
+          strm.next_in  = (*iovector)[i].iov_base;
+          strm.avail_in = (*iovector)[i].iov_len;
+          deflate( &strm, Z_NO_FLUSH );
+        }
+        if( deflate( &strm, Z_FINISH ) == Z_STREAM_END )
+          done = strm.total_out;
+      }
+      deflateEnd( &strm );
+    }
+  }
+#endif
+#ifdef WANT_COMPRESSION_ZSTD
+  if( mode & TASK_FLAG_ZSTD ) {
+    ZSTD_CCtx *zctx = ZSTD_createCCtx( );
+    size_t     bound = ZSTD_compressBound( size );
+    if( zctx && ( out = iovec_increase( &out_entries, &out_vector, bound ) ) ) {
+      ZSTD_outBuffer output = { out, bound, 0 };
+      size_t         remaining = 0;
+      ZSTD_CCtx_setParameter( zctx, ZSTD_c_compressionLevel, g_zstd_level );
+      ZSTD_CCtx_setPledgedSrcSize( zctx, size );
+      for( i=0; i<*iovec_entries && !ZSTD_isError( remaining ); ++i ) {
+        ZSTD_inBuffer input = { (*iovector)[i].iov_base, (*iovector)[i].iov_len, 0 };
+        remaining = ZSTD_compressStream2( zctx, &output, &input, ZSTD_e_continue );
+      }
+      if( !ZSTD_isError( remaining ) ) {
+        ZSTD_inBuffer input = { NULL, 0, 0 };
+        if( !ZSTD_compressStream2( zctx, &output, &input, ZSTD_e_end ) )
+          done = output.pos;
+      }
+    }
+    ZSTD_freeCCtx( zctx );
+  }
+#endif
+
+  iovec_free( iovec_entries, iovector );
+  free( *iovector );
+  *iovector = NULL;
+  if( done ) {
+    iovec_fixlast( &out_entries, &out_vector, out + done );
+    *iovec_entries = out_entries;
+    *iovector      = out_vector;
+  } else {
+    iovec_free( &out_entries, &out_vector );
+    free( out_vector );
+  }
+}
+#endif
+
 void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event_data ) {
+  ot_stats_counters *c = stats_counters ? stats_counters : stats_register( );
+
   switch( event ) {
     case EVENT_ACCEPT:
-      if( proto == FLAG_TCP ) ot_overall_tcp_connections++; else ot_overall_udp_connections++;
+      if( proto == FLAG_TCP ) c->overall_tcp_connections++; else c->overall_udp_connections++;
 #ifdef WANT_LOG_NETWORKS
       stat_increase_network_count( &stats_network_counters_root, 0, event_data );
 #endif
       break;
     case EVENT_ANNOUNCE:
-      if( proto == FLAG_TCP ) ot_overall_tcp_successfulannounces++; else ot_overall_udp_successfulannounces++;
+      if( proto == FLAG_TCP ) c->overall_tcp_successfulannounces++; else c->overall_udp_successfulannounces++;
       break;
     case EVENT_CONNECT:
-      if( proto == FLAG_TCP ) ot_overall_tcp_connects++; else ot_overall_udp_connects++;
+      if( proto == FLAG_TCP ) c->overall_tcp_connects++; else c->overall_udp_connects++;
       break;
     case EVENT_COMPLETED:
 #ifdef WANT_SYSLOGS
@@ -675,14 +892,17 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
         syslog( LOG_INFO, "time=%s event=completed info_hash=%s peer_id=%s ip=%s", timestring, hash_hex, peerid_hex, ip_readable );
       }
 #endif
-      ot_overall_completed++;
+      c->overall_completed++;
       break;
     case EVENT_SCRAPE:
-      if( proto == FLAG_TCP ) ot_overall_tcp_successfulscrapes++; else ot_overall_udp_successfulscrapes++;
+      if( proto == FLAG_TCP ) c->overall_tcp_successfulscrapes++; else c->overall_udp_successfulscrapes++;
       break;
     case EVENT_FULLSCRAPE:
-      ot_full_scrape_count++;
-      ot_full_scrape_size += event_data;
+      c->full_scrape_count++;
+      c->full_scrape_size += event_data;
+      break;
+    case EVENT_FULLSCRAPE_SNAPSHOT:
+      if( event_data ) c->full_scrape_snapshot_hits++; else c->full_scrape_snapshot_misses++;
       break;
     case EVENT_FULLSCRAPE_REQUEST:
     {
@@ -692,10 +912,11 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
       off += fmt_ip6c( _debug+off, *ip );
       off += snprintf( _debug+off, sizeof(_debug)-off, " - FULL SCRAPE\n" );
       write( 2, _debug, off );
-      ot_full_scrape_request_count++;
+      c->full_scrape_request_count++;
     }
       break;
     case EVENT_FULLSCRAPE_REQUEST_GZIP:
+    case EVENT_FULLSCRAPE_REQUEST_ZSTD:
     {
       ot_ip6 *ip = (ot_ip6*)event_data; /* ugly hack to transfer ip to stats */
       char _debug[512];
@@ -703,20 +924,20 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
       off += fmt_ip6c(_debug+off, *ip );
       off += snprintf( _debug+off, sizeof(_debug)-off, " - FULL SCRAPE\n" );
       write( 2, _debug, off );
-      ot_full_scrape_request_count++;
+      c->full_scrape_request_count++;
     }
       break;
     case EVENT_FAILED:
-      ot_failed_request_counts[event_data]++;
+      c->failed_request_counts[event_data]++;
       break;
     case EVENT_RENEW:
-      ot_renewed[event_data]++;
+      c->renewed[event_data]++;
       break;
     case EVENT_SYNC:
-      ot_overall_sync_count+=event_data;
+      c->overall_sync_count+=event_data;
 	    break;
     case EVENT_BUCKET_LOCKED:
-      ot_overall_stall_count++;
+      c->overall_stall_count++;
       break;
 #ifdef WANT_SPOT_WOODPECKER
     case EVENT_WOODPECKER:
@@ -726,7 +947,12 @@ void stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event
       break;
 #endif
     case EVENT_CONNID_MISSMATCH:
-      ++ot_overall_udp_connectionidmissmatches;
+      ++c->overall_udp_connectionidmissmatches;
+      break;
+    case EVENT_PARTIAL_WRITE:
+      c->partial_writes++;
+      if( event_data ) c->partial_writes_copied++;
+      break;
     default:
       break;
   }
@@ -750,6 +976,10 @@ static void * stats_worker( void * args ) {
     ot_tasktype tasktype = TASK_STATS;
     ot_taskid   taskid   = mutex_workqueue_poptask( &tasktype );
     stats_make( &iovec_entries, &iovector, tasktype );
+#if defined( WANT_COMPRESSION_GZIP ) || defined( WANT_COMPRESSION_ZSTD )
+    if( tasktype & ( TASK_FLAG_GZIP | TASK_FLAG_ZSTD ) )
+      stats_compress( &iovec_entries, &iovector, tasktype );
+#endif
     if( mutex_workqueue_pushresult( taskid, iovec_entries, iovector ) )
       iovec_free( &iovec_entries, &iovector );
   }
@@ -760,14 +990,23 @@ void stats_deliver( int64 sock, int tasktype ) {
   mutex_workqueue_pushtask( sock, tasktype );
 }
 
-static pthread_t thread_id;
+static pthread_t thread_ids[OT_STATS_WORKERS_MAX];
 void stats_init( ) {
+  unsigned int i;
+
   ot_start_time = g_now_seconds;
-  pthread_create( &thread_id, NULL, stats_worker, NULL );
+  if( !g_stats_workers )
+    g_stats_workers = 1;
+  if( g_stats_workers > OT_STATS_WORKERS_MAX )
+    g_stats_workers = OT_STATS_WORKERS_MAX;
+  for( i=0; i<g_stats_workers; ++i )
+    pthread_create( thread_ids + i, NULL, stats_worker, NULL );
 }
 
 void stats_deinit( ) {
-  pthread_cancel( thread_id );
+  unsigned int i;
+  for( i=0; i<g_stats_workers; ++i )
+    pthread_cancel( thread_ids[i] );
 }
 
 const char *g_version_stats_c = "$Source$: $Revision$\n";
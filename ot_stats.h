@@ -17,11 +17,14 @@ typedef enum {
   EVENT_SCRAPE,
   EVENT_FULLSCRAPE_REQUEST,
   EVENT_FULLSCRAPE_REQUEST_GZIP,
+  EVENT_FULLSCRAPE_REQUEST_ZSTD,
   EVENT_FULLSCRAPE,   /* TCP only */
+  EVENT_FULLSCRAPE_SNAPSHOT, /* event_data is 1 if a cached snapshot was served */
   EVENT_FAILED,
   EVENT_BUCKET_LOCKED,
   EVENT_WOODPECKER,
-  EVENT_CONNID_MISSMATCH
+  EVENT_CONNID_MISSMATCH,
+  EVENT_PARTIAL_WRITE /* TCP only, event_data is 1 if the rest was copied */
 } ot_status_event;
 
 enum {
@@ -38,6 +41,11 @@ enum {
   CODE_HTTPERROR_COUNT
 };
 
+/* Stats workers making the expensive stats, so that one slow request does
+   not hold up all others, see tracker.stats_workers */
+#define OT_STATS_WORKERS     1
+#define OT_STATS_WORKERS_MAX 16
+
 void   stats_issue_event( ot_status_event event, PROTO_FLAG proto, uintptr_t event_data );
 void   stats_deliver( int64 sock, int tasktype );
 void   stats_cleanup();
@@ -46,6 +54,8 @@ size_t stats_return_tracker_version( char *reply );
 void   stats_init( );
 void   stats_deinit( );
 
+extern unsigned int g_stats_workers;
+
 extern const char *g_version_rijndael_c;
 extern const char *g_version_livesync_c;
 
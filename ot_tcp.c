@@ -0,0 +1,348 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+/* System */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+
+/* Libowfat */
+#include "socket.h"
+#include "io.h"
+#include "iob.h"
+#include "array.h"
+#include "ndelay.h"
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_http.h"
+#include "ot_tcp.h"
+#include "ot_stats.h"
+
+/* Self pipe from opentracker.c */
+extern int g_self_pipe[2];
+
+typedef struct ot_handover {
+  int64               sock;
+  struct http_data   *cookie;
+  struct ot_handover *next;
+} ot_handover;
+
+static pthread_mutex_t g_handover_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ot_handover    *g_handover_first, *g_handover_last;
+
+/* A connection a tcp worker serves itself, until it is done or handed over */
+typedef struct {
+  int64             sock;
+  struct http_data *cookie;
+  time_t            timeout;
+} ot_tcp_connection;
+
+/* Each tcp worker polls its listening socket and its connections, the
+   first pollfd belongs to the listening socket */
+typedef struct {
+  int64                sock;
+  struct ot_workstruct ws;
+  ot_tcp_connection   *connections;
+  struct pollfd       *pollfds;
+  size_t               count, space;
+  time_t               accept_paused_until;
+} ot_tcp_worker;
+
+static void tcp_handover( int64 sock, struct http_data *cookie ) {
+  ot_handover *handover = malloc( sizeof( ot_handover ) );
+  const char   byte = 'h';
+
+  if( !handover ) {
+    array_reset( &cookie->request );
+    http_release_output( cookie );
+    free( cookie );
+    close( sock );
+    return;
+  }
+  handover->sock   = sock;
+  handover->cookie = cookie;
+  handover->next   = NULL;
+
+  pthread_mutex_lock( &g_handover_mutex );
+  if( g_handover_last )
+    g_handover_last->next = handover;
+  else
+    g_handover_first = handover;
+  g_handover_last = handover;
+  pthread_mutex_unlock( &g_handover_mutex );
+
+  io_trywrite( g_self_pipe[1], &byte, 1 );
+}
+
+int64 tcp_pop_handover( struct http_data **cookie ) {
+  ot_handover *handover;
+  int64        sock;
+
+  pthread_mutex_lock( &g_handover_mutex );
+  if( ( handover = g_handover_first ) && !( g_handover_first = handover->next ) )
+    g_handover_last = NULL;
+  pthread_mutex_unlock( &g_handover_mutex );
+
+  if( !handover ) return -1;
+  sock    = handover->sock;
+  *cookie = handover->cookie;
+  free( handover );
+  return sock;
+}
+
+/* Takes the connection out of the worker, swapping the last one into its
+   place. Handed over connections keep their socket and cookie */
+static void tcp_remove( ot_tcp_worker *w, size_t i, int handover ) {
+  ot_tcp_connection *c = w->connections + i;
+
+  if( handover )
+    tcp_handover( c->sock, c->cookie );
+  else {
+    array_reset( &c->cookie->request );
+    http_release_output( c->cookie );
+    free( c->cookie );
+    close( c->sock );
+  }
+  *c = w->connections[--w->count];
+}
+
+/* Tells whether the connection is to be kept after the last request:
+   it may wait for the main loop, for its reply to go out or, being kept
+   alive, for its next request */
+static int tcp_keep( ot_tcp_connection *c, struct ot_workstruct *ws ) {
+  if( c->cookie->flag & STRUCT_HTTP_FLAG_HANDOVER ) return 1;
+  if( c->cookie->pending_size ) {
+    c->timeout = g_now_seconds + OT_CLIENT_TIMEOUT_SEND;
+    return 1;
+  }
+  if( !ws->keep_alive ) return 0;
+  c->timeout = g_now_seconds + g_keepalive_timeout;
+  return 1;
+}
+
+/* Answers the complete requests in the cookie's buffer, like handle_buffered
+   in opentracker.c. Returns 0 when the connection is done with */
+static int tcp_handle_buffered( ot_tcp_connection *c, struct ot_workstruct *ws ) {
+  struct http_data *cookie = ws->cookie = c->cookie;
+
+  for( ; ; ) {
+    if( !( ws->header_size = http_header_complete( array_start( &cookie->request ), array_bytes( &cookie->request ) ) ) ) {
+      if( array_bytes( &cookie->request ) <= 8192 )
+        return 1;
+      http_issue_error( c->sock, ws, CODE_HTTPERROR_500 );
+    } else {
+      ws->request      = array_start( &cookie->request );
+      ws->request_size = array_bytes( &cookie->request );
+      http_handle_request( c->sock, ws );
+    }
+    if( !tcp_keep( c, ws ) )
+      return 0;
+    if( ( cookie->flag & STRUCT_HTTP_FLAG_HANDOVER ) || cookie->pending_size || !array_start( &cookie->request ) )
+      return 1;
+  }
+}
+
+/* Like handle_read in opentracker.c */
+static int tcp_handle_read( ot_tcp_connection *c, struct ot_workstruct *ws ) {
+  struct http_data *cookie = ws->cookie = c->cookie;
+  ssize_t byte_count = read( c->sock, ws->inbuf, G_INBUF_SIZE );
+
+  if( byte_count < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+    return 1;
+  if( byte_count <= 0 )
+    return 0;
+
+  /* If we get the whole request in one packet, handle it without copying */
+  if( !array_start( &cookie->request ) && ( ws->header_size = http_header_complete( ws->inbuf, byte_count ) ) ) {
+    ws->request      = ws->inbuf;
+    ws->request_size = byte_count;
+    http_handle_request( c->sock, ws );
+    if( !tcp_keep( c, ws ) )
+      return 0;
+    if( ( cookie->flag & STRUCT_HTTP_FLAG_HANDOVER ) || cookie->pending_size )
+      return 1;
+    /* Requests pipelined behind it went to the cookie's buffer */
+    return tcp_handle_buffered( c, ws );
+  }
+
+  array_catb( &cookie->request, ws->inbuf, byte_count );
+  if( array_failed( &cookie->request ) ) {
+    http_issue_error( c->sock, ws, CODE_HTTPERROR_500 );
+    return tcp_keep( c, ws );
+  }
+  return tcp_handle_buffered( c, ws );
+}
+
+/* Like handle_write in opentracker.c, for the rest of a reply the socket
+   could not take at once */
+static int tcp_handle_write( ot_tcp_connection *c, struct ot_workstruct *ws ) {
+  struct http_data *cookie = c->cookie;
+  ssize_t written_size = write( c->sock, cookie->pending, cookie->pending_size );
+
+  if( written_size < 0 )
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+  cookie->pending      += written_size;
+  cookie->pending_size -= written_size;
+  if( cookie->pending_size )
+    return 1;
+
+  /* The reply is out, a kept alive connection goes on with its next request */
+  http_release_output( cookie );
+  if( !( cookie->flag & STRUCT_HTTP_FLAG_KEEPALIVE ) )
+    return 0;
+  cookie->flag &= ~STRUCT_HTTP_FLAG_KEEPALIVE;
+  c->timeout = g_now_seconds + g_keepalive_timeout;
+  return tcp_handle_buffered( c, ws );
+}
+
+/* Like handle_accept in opentracker.c. When we run out of descriptors or
+   buffers, the connections waiting would wake us over and over, so we
+   stop accepting for a while */
+static void tcp_handle_accept( ot_tcp_worker *w ) {
+  ot_ip6 ip;
+  uint16 port;
+  int64  sock;
+
+  while( ( sock = socket_accept6( w->sock, ip, &port, NULL ) ) != -1 ) {
+    ot_tcp_connection *c;
+
+    if( w->count == w->space ) {
+      size_t             space       = w->space ? 2 * w->space : 64;
+      ot_tcp_connection *connections = realloc( w->connections, space * sizeof( ot_tcp_connection ) );
+      struct pollfd     *pollfds     = connections ? realloc( w->pollfds, ( space + 1 ) * sizeof( struct pollfd ) ) : NULL;
+      if( connections ) w->connections = connections;
+      if( pollfds ) { w->pollfds = pollfds; w->space = space; }
+      if( !pollfds ) { close( sock ); continue; }
+    }
+
+    c = w->connections + w->count;
+    if( !( c->cookie = malloc( sizeof( struct http_data ) ) ) ) {
+      close( sock );
+      continue;
+    }
+    memset( c->cookie, 0, sizeof( struct http_data ) );
+    memcpy( c->cookie->ip, ip, sizeof( ot_ip6 ) );
+    c->cookie->flag = STRUCT_HTTP_FLAG_WORKER;
+    c->sock         = sock;
+    c->timeout      = g_now_seconds + OT_CLIENT_TIMEOUT;
+    ++w->count;
+
+    ndelay_on( sock );
+    stats_issue_event( EVENT_ACCEPT, FLAG_TCP, (uintptr_t)ip );
+
+    /* With TCP_DEFER_ACCEPT the request usually is there already */
+    if( !tcp_handle_read( c, &w->ws ) )
+      tcp_remove( w, w->count - 1, 0 );
+    else if( c->cookie->flag & STRUCT_HTTP_FLAG_HANDOVER )
+      tcp_remove( w, w->count - 1, 1 );
+  }
+
+  if( errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM )
+    w->accept_paused_until = g_now_seconds + OT_TCP_ACCEPT_PAUSE;
+}
+
+static void *tcp_worker( void *args ) {
+  ot_tcp_worker w;
+  time_t        last_timeout_check = g_now_seconds;
+
+  memset( &w, 0, sizeof(w) );
+  w.sock = (int64)args;
+  w.ws.inbuf=malloc(G_INBUF_SIZE);
+  w.ws.outbuf=malloc(G_OUTBUF_SIZE);
+#ifdef    _DEBUG_HTTPERROR
+  w.ws.debugbuf=malloc(G_DEBUGBUF_SIZE);
+#endif
+  w.pollfds=malloc(sizeof(struct pollfd));
+  if( !w.ws.inbuf || !w.ws.outbuf || !w.pollfds )
+    exerr( "Initializing tcp worker failed." );
+  workstruct_seed_random( &w.ws );
+
+  while( g_opentracker_running ) {
+    size_t i, polled = w.count;
+
+    w.pollfds[0].fd     = w.accept_paused_until > g_now_seconds ? -1 : w.sock;
+    w.pollfds[0].events = POLLIN;
+    for( i=0; i<polled; ++i ) {
+      w.pollfds[i+1].fd     = w.connections[i].sock;
+      w.pollfds[i+1].events = w.connections[i].cookie->pending_size ? POLLOUT : POLLIN;
+    }
+
+    if( poll( w.pollfds, polled + 1, OT_TCP_POLL_TIMEOUT ) < 0 ) {
+      if( errno != EINTR ) sleep( 1 );
+      continue;
+    }
+
+    /* Walk backwards, so that connections swapped into removed ones' places
+       have been looked at already */
+    for( i=polled; i-- > 0; ) {
+      ot_tcp_connection *c = w.connections + i;
+      short revents = w.pollfds[i+1].revents;
+      int   keep;
+
+      if( !revents ) continue;
+      if( revents & POLLNVAL )
+        keep = 0;
+      else if( c->cookie->pending_size )
+        keep = tcp_handle_write( c, &w.ws );
+      else
+        keep = tcp_handle_read( c, &w.ws );
+
+      if( !keep )
+        tcp_remove( &w, i, 0 );
+      else if( c->cookie->flag & STRUCT_HTTP_FLAG_HANDOVER )
+        tcp_remove( &w, i, 1 );
+    }
+
+    if( w.pollfds[0].revents & POLLIN )
+      tcp_handle_accept( &w );
+
+    if( g_now_seconds != last_timeout_check ) {
+      for( i=w.count; i-- > 0; )
+        if( w.connections[i].timeout < g_now_seconds )
+          tcp_remove( &w, i, 0 );
+      last_timeout_check = g_now_seconds;
+    }
+  }
+
+  while( w.count )
+    tcp_remove( &w, w.count - 1, 0 );
+  free( w.connections );
+  free( w.pollfds );
+  free( w.ws.inbuf );
+  free( w.ws.outbuf );
+#ifdef    _DEBUG_HTTPERROR
+  free( w.ws.debugbuf );
+#endif
+
+  return NULL;
+}
+
+void tcp_init( int64 sock, unsigned int worker_count ) {
+  pthread_t thread_id;
+#ifdef TCP_DEFER_ACCEPT
+  int defer = OT_TCP_DEFER_ACCEPT;
+  setsockopt( sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof( defer ) );
+#endif
+#ifdef _DEBUG
+  fprintf( stderr, " installing %d workers on tcp socket %ld", worker_count, (unsigned long)sock );
+#endif
+  /* The main loop does not accept on the socket, a worker missing is fatal */
+  while( worker_count-- )
+    if( pthread_create( &thread_id, NULL, tcp_worker, (void *)sock ) )
+      exerr( "Could not start tcp worker." );
+}
+
+const char *g_version_tcp_c = "$Source$: $Revision$\n";
@@ -0,0 +1,37 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   $id$ */
+
+#ifndef OT_TCP_H__
+#define OT_TCP_H__
+
+/* libowfat's io layer belongs to the main loop alone. Each tcp worker
+   runs an event loop of its own with poll and plain syscalls: it accepts
+   on its listening socket, answers announces and scrapes, keeps
+   connections alive, answers pipelined requests and sends what the
+   socket buffer could not take at once. Requests for stats and full
+   scrapes are answered by tasks whose results go to the main loop, so
+   these, and paths with escapes, are handed over to it together with
+   their connection */
+
+/* Seconds the kernel may hold back a connection until its request has
+   arrived, where TCP_DEFER_ACCEPT is supported */
+#define OT_TCP_DEFER_ACCEPT 5
+
+/* Milliseconds a tcp worker waits in poll, so that it notices timeouts */
+#define OT_TCP_POLL_TIMEOUT 1000
+
+/* Seconds a tcp worker stops accepting after running out of descriptors
+   or buffers */
+#define OT_TCP_ACCEPT_PAUSE 1
+
+void  tcp_init( int64 sock, unsigned int worker_count );
+
+/* Connections handed over by the workers, with the request still in the
+   cookie's buffer. The main loop must io_fd them and clear
+   STRUCT_HTTP_FLAG_WORKER from their cookie. Returns -1 when there are
+   none left */
+int64 tcp_pop_handover( struct http_data **cookie );
+
+#endif
@@ -3,16 +3,28 @@
 
    $id$ */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
+#endif
+
 /* System */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdio.h>
+#ifdef WANT_IO_URING
+#include <liburing.h>
+#endif
 
 /* Libowfat */
 #include "socket.h"
 #include "io.h"
+#include "ip6.h"
 
 /* Opentracker */
 #include "trackerlogic.h"
@@ -20,9 +32,20 @@
 #include "ot_stats.h"
 #include "ot_rijndael.h"
 
+#if defined( __linux__ ) && defined( MSG_WAITFORONE )
+#define OT_UDP_BATCHED
+#endif
+
 #if 0
 static const uint8_t g_static_connid[8] = { 0x23, 0x42, 0x05, 0x17, 0xde, 0x41, 0x50, 0xff };
 #endif
+#ifdef WANT_IO_URING
+static int          g_udp_io_uring;
+#endif
+static unsigned int g_udp_worker_cpus[OT_UDP_WORKER_CPUS_MAX];
+static unsigned int g_udp_worker_cpu_count;
+static unsigned int g_udp_workers_started;
+
 static uint32_t g_rijndael_round_key[44] = {0};
 static uint32_t g_key_of_the_hour[2] = {0};
 static ot_time  g_hour_of_the_key;
@@ -43,7 +66,7 @@ static void udp_generate_rijndael_round_key() {
 static void udp_make_connectionid( uint32_t connid[2], const ot_ip6 remoteip, int age ) {
   uint32_t plain[4], crypt[4];
   int i;
-  if( g_now_minutes + 60 > g_hour_of_the_key ) {
+  if( g_now_minutes > g_hour_of_the_key + 60 ) {
     g_hour_of_the_key = g_now_minutes;
     g_key_of_the_hour[1] = g_key_of_the_hour[0];
     g_key_of_the_hour[0] = random();
@@ -56,31 +79,29 @@ static void udp_make_connectionid( uint32_t connid[2], const ot_ip6 remoteip, in
   connid[1] = crypt[2] ^ crypt[3];
 }
 
-/* UDP implementation according to http://xbtt.sourceforge.net/udp_tracker_protocol.html */
-int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
-  ot_ip6      remoteip;
-  uint32_t   *inpacket = (uint32_t*)ws->inbuf;
-  uint32_t   *outpacket = (uint32_t*)ws->outbuf;
-  uint32_t    numwant, left, event, scopeid;
+/* UDP implementation according to http://xbtt.sourceforge.net/udp_tracker_protocol.html
+   Handles the datagram in inbuf and returns the size of the reply it
+   wrote to outbuf, 0 if there is nothing to answer */
+static size_t udp_handle_packet( struct ot_workstruct *ws, char *inbuf, size_t byte_count, const ot_ip6 remoteip, char *outbuf ) {
+  uint32_t   *inpacket = (uint32_t*)inbuf;
+  uint32_t   *outpacket = (uint32_t*)outbuf;
+  uint32_t    numwant, left, event;
   uint32_t    connid[2];
   uint32_t    action;
-  uint16_t    port, remoteport;
-  size_t      byte_count, scrape_count;
-
-  byte_count = socket_recv6( serversocket, ws->inbuf, G_INBUF_SIZE, remoteip, &remoteport, &scopeid );
-  if( !byte_count ) return 0;
+  uint16_t    port;
+  size_t      scrape_count;
 
   stats_issue_event( EVENT_ACCEPT, FLAG_UDP, (uintptr_t)remoteip );
   stats_issue_event( EVENT_READ, FLAG_UDP, byte_count );
 
-  /* Minimum udp tracker packet size, also catches error */
+  /* Minimum udp tracker packet size */
   if( byte_count < 16 )
-    return 1;
+    return 0;
 
   /* Get action to take. Ignore error messages and broken packets */
   action = ntohl( inpacket[2] );
   if( action > 2 )
-    return 1;
+    return 0;
 
   /* Generate the connection id we give out and expect to and from
      the requesting ip address, this prevents udp spoofing */
@@ -101,9 +122,8 @@ int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
       const size_t s = sizeof( "Connection ID missmatch." );
       outpacket[0] = htonl( 3 ); outpacket[1] = inpacket[3];
       memcpy( &outpacket[2], "Connection ID missmatch.", s );
-      socket_send6( serversocket, ws->outbuf, 8 + s, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_CONNID_MISSMATCH, FLAG_UDP, 8 + s );
-      return 1;
+      return 8 + s;
     }
   }
 
@@ -111,20 +131,19 @@ int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
     case 0: /* This is a connect action */
       /* look for udp bittorrent magic id */
       if( (ntohl(inpacket[0]) != 0x00000417) || (ntohl(inpacket[1]) != 0x27101980) )
-        return 1;
+        return 0;
 
       outpacket[0] = 0;
       outpacket[1] = inpacket[3];
       outpacket[2] = connid[0];
       outpacket[3] = connid[1];
 
-      socket_send6( serversocket, ws->outbuf, 16, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_CONNECT, FLAG_UDP, 16 );
-      break;
+      return 16;
     case 1: /* This is an announce action */
       /* Minimum udp announce packet size */
       if( byte_count < 98 )
-        return 1;
+        return 0;
 
       /* We do only want to know, if it is zero */
       left  = inpacket[64/4] | inpacket[68/4];
@@ -154,16 +173,15 @@ int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
       outpacket[1] = inpacket[12/4];
 
       if( OT_PEERFLAG( &ws->peer ) & PEER_FLAG_STOPPED ) { /* Peer is gone. */
-        ws->reply      = ws->outbuf;
+        ws->reply      = outbuf;
         ws->reply_size = remove_peer_from_torrent( FLAG_UDP, ws );
       } else {
-        ws->reply      = ws->outbuf + 8;
+        ws->reply      = outbuf + 8;
         ws->reply_size = 8 + add_peer_to_torrent_and_return_peers( FLAG_UDP, ws, numwant );
       }
 
-      socket_send6( serversocket, ws->outbuf, ws->reply_size, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_ANNOUNCE, FLAG_UDP, ws->reply_size );
-      break;
+      return ws->reply_size;
 
     case 2: /* This is a scrape action */
       outpacket[0] = htonl( 2 );    /* scrape action */
@@ -172,13 +190,269 @@ int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
       for( scrape_count = 0; ( scrape_count * 20 < byte_count - 16) && ( scrape_count <= 74 ); scrape_count++ )
         return_udp_scrape_for_torrent( *(ot_hash*)( ((char*)inpacket) + 16 + 20 * scrape_count ), ((char*)outpacket) + 8 + 12 * scrape_count );
 
-      socket_send6( serversocket, ws->outbuf, 8 + 12 * scrape_count, remoteip, remoteport, 0 );
       stats_issue_event( EVENT_SCRAPE, FLAG_UDP, scrape_count );
-      break;
+      return 8 + 12 * scrape_count;
   }
+  return 0;
+}
+
+/* Handles one datagram waiting on serversocket. Returns 0 if there was none */
+int handle_udp6( int64 serversocket, struct ot_workstruct *ws ) {
+  ot_ip6      remoteip;
+  uint32_t    scopeid;
+  uint16_t    remoteport;
+  ssize_t     byte_count;
+  size_t      reply_size;
+
+  byte_count = socket_recv6( serversocket, ws->inbuf, G_INBUF_SIZE, remoteip, &remoteport, &scopeid );
+  if( byte_count < 0 ) return 0;
+
+  reply_size = udp_handle_packet( ws, ws->inbuf, byte_count, remoteip, ws->outbuf );
+  if( reply_size )
+    socket_send6( serversocket, ws->outbuf, reply_size, remoteip, remoteport, 0 );
   return 1;
 }
 
+#if defined( OT_UDP_BATCHED ) || defined( WANT_IO_URING )
+/* Our address format is ipv6, ipv4 peers get the v4 mapped prefix */
+static int udp_remoteip( const struct sockaddr_storage *addr, ot_ip6 remoteip ) {
+  if( addr->ss_family == AF_INET6 )
+    memcpy( remoteip, &((const struct sockaddr_in6*)addr)->sin6_addr, sizeof( ot_ip6 ) );
+  else if( addr->ss_family == AF_INET ) {
+    memcpy( remoteip, V4mappedprefix, sizeof( V4mappedprefix ) );
+    memcpy( remoteip + sizeof( V4mappedprefix ), &((const struct sockaddr_in*)addr)->sin_addr, 4 );
+  } else
+    return 0;
+  return 1;
+}
+#endif
+
+#ifdef OT_UDP_BATCHED
+/* Receives up to OT_UDP_BATCH datagrams with one syscall, blocking until
+   there is at least one, and sends all replies with another */
+static void udp_handle_batch( int64 serversocket, struct ot_workstruct *ws ) {
+  struct mmsghdr          requests[OT_UDP_BATCH], replies[OT_UDP_BATCH];
+  struct iovec            request_iov[OT_UDP_BATCH], reply_iov[OT_UDP_BATCH];
+  struct sockaddr_storage remoteaddr[OT_UDP_BATCH];
+  int                     i, count, reply_count = 0, sent = 0;
+
+  memset( requests, 0, sizeof( requests ) );
+  for( i=0; i<OT_UDP_BATCH; ++i ) {
+    request_iov[i].iov_base             = ws->udp_inbufs + i * G_UDP_INBUF_SIZE;
+    request_iov[i].iov_len              = G_UDP_INBUF_SIZE;
+    requests[i].msg_hdr.msg_name        = remoteaddr + i;
+    requests[i].msg_hdr.msg_namelen     = sizeof( remoteaddr[i] );
+    requests[i].msg_hdr.msg_iov         = request_iov + i;
+    requests[i].msg_hdr.msg_iovlen      = 1;
+  }
+
+  count = recvmmsg( serversocket, requests, OT_UDP_BATCH, MSG_WAITFORONE, NULL );
+  if( count <= 0 )
+    return;
+
+  for( i=0; i<count; ++i ) {
+    char  *outbuf = ws->udp_outbufs + i * G_UDP_OUTBUF_SIZE;
+    size_t reply_size;
+    ot_ip6 remoteip;
+
+    if( !udp_remoteip( remoteaddr + i, remoteip ) )
+      continue;
+
+    reply_size = udp_handle_packet( ws, request_iov[i].iov_base, requests[i].msg_len, remoteip, outbuf );
+    if( !reply_size )
+      continue;
+
+    /* Reply to where the request came from */
+    memset( &replies[reply_count], 0, sizeof( replies[reply_count] ) );
+    reply_iov[reply_count].iov_base              = outbuf;
+    reply_iov[reply_count].iov_len               = reply_size;
+    replies[reply_count].msg_hdr.msg_name        = remoteaddr + i;
+    replies[reply_count].msg_hdr.msg_namelen     = requests[i].msg_hdr.msg_namelen;
+    replies[reply_count].msg_hdr.msg_iov         = reply_iov + reply_count;
+    replies[reply_count].msg_hdr.msg_iovlen      = 1;
+    ++reply_count;
+  }
+
+  while( sent < reply_count ) {
+    int result = sendmmsg( serversocket, replies + sent, reply_count - sent, 0 );
+    if( result > 0 )
+      sent += result;
+    else if( errno != EINTR )
+      /* The first reply left could not be sent, drop it */
+      ++sent;
+  }
+}
+#endif
+
+#ifdef WANT_IO_URING
+/* user_data of the multishot receive, sends carry their out slot + 1 */
+#define OT_UDP_URING_RECV 0
+
+typedef struct {
+  struct msghdr           msg;
+  struct iovec            iov;
+  struct sockaddr_storage addr;
+} ot_udp_send;
+
+static struct io_uring_sqe *udp_uring_get_sqe( struct io_uring *ring ) {
+  struct io_uring_sqe *sqe;
+  /* Submission queue is full: hand what we have to the kernel */
+  while( !( sqe = io_uring_get_sqe( ring ) ) )
+    io_uring_submit( ring );
+  return sqe;
+}
+
+/* Receives with a multishot recvmsg into a ring of provided buffers and
+   sends the replies from the worker's out slots asynchronously, so that a
+   whole batch of completions costs one trip into the kernel. If all out
+   slots are in flight, replies are sent synchronously from outbuf.
+   Returns -1 if io_uring can not be set up or fails for good, so that the
+   worker goes on with blocking reads */
+static int udp_worker_uring( int64 sock, struct ot_workstruct *ws ) {
+  struct io_uring           ring;
+  struct io_uring_buf_ring *buf_ring;
+  struct io_uring_sqe      *sqe;
+  struct io_uring_cqe      *cqe;
+  struct msghdr             recv_msg;
+  ot_udp_send               sends[OT_UDP_BATCH];
+  int                       free_sends[OT_UDP_BATCH], free_count = 0, rearm = 1, failed = 0, buf_mask, err, i;
+  char                     *buffers;
+
+  if( io_uring_queue_init( OT_UDP_URING_ENTRIES, &ring, 0 ) < 0 )
+    return -1;
+  if( !( buffers = malloc( OT_UDP_URING_BUFFERS * G_UDP_INBUF_SIZE ) ) ) {
+    io_uring_queue_exit( &ring );
+    return -1;
+  }
+  if( !( buf_ring = io_uring_setup_buf_ring( &ring, OT_UDP_URING_BUFFERS, 0, 0, &err ) ) ) {
+    free( buffers );
+    io_uring_queue_exit( &ring );
+    return -1;
+  }
+
+  buf_mask = io_uring_buf_ring_mask( OT_UDP_URING_BUFFERS );
+  for( i=0; i<OT_UDP_URING_BUFFERS; ++i )
+    io_uring_buf_ring_add( buf_ring, buffers + i * G_UDP_INBUF_SIZE, G_UDP_INBUF_SIZE, i, buf_mask, i );
+  io_uring_buf_ring_advance( buf_ring, OT_UDP_URING_BUFFERS );
+
+  for( i=0; i<OT_UDP_BATCH; ++i )
+    free_sends[free_count++] = i;
+
+  /* The kernel puts name and payload of each datagram into the buffer,
+     behind an io_uring_recvmsg_out header, as laid out by this template */
+  memset( &recv_msg, 0, sizeof( recv_msg ) );
+  recv_msg.msg_namelen = sizeof( struct sockaddr_storage );
+
+  while( g_opentracker_running ) {
+    unsigned int head, seen = 0;
+
+    if( rearm ) {
+      sqe = udp_uring_get_sqe( &ring );
+      io_uring_prep_recvmsg_multishot( sqe, sock, &recv_msg, 0 );
+      sqe->flags    |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group = 0;
+      io_uring_sqe_set_data64( sqe, OT_UDP_URING_RECV );
+      rearm = 0;
+    }
+
+    /* Signals just interrupt the wait. The kernel refuses to submit with
+       -EBUSY while completions wait to be reaped, which we do below. Any
+       other error would come back on every try */
+    if( ( err = io_uring_submit_and_wait( &ring, 1 ) ) < 0 ) {
+      if( err == -EINTR )
+        continue;
+      if( !io_uring_cq_ready( &ring ) ) {
+        failed = 1;
+        break;
+      }
+    }
+
+    io_uring_for_each_cqe( &ring, head, cqe ) {
+      struct io_uring_recvmsg_out *out;
+      char                        *buffer;
+      int                          buffer_id;
+
+      ++seen;
+      if( cqe->user_data != OT_UDP_URING_RECV ) {
+        free_sends[free_count++] = cqe->user_data - 1;
+        continue;
+      }
+
+      /* The kernel ends a multishot receive on errors or when it ran out
+         of buffers. Only the latter is worth another try, other errors,
+         like -EINVAL from kernels without multishot recvmsg, would come
+         back at once */
+      if( !( cqe->flags & IORING_CQE_F_BUFFER ) ) {
+        if( !( cqe->flags & IORING_CQE_F_MORE ) ) {
+          if( cqe->res == -ENOBUFS )
+            rearm = 1;
+          else
+            failed = 1;
+        }
+        continue;
+      }
+      if( !( cqe->flags & IORING_CQE_F_MORE ) )
+        rearm = 1;
+
+      buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      buffer    = buffers + buffer_id * G_UDP_INBUF_SIZE;
+
+      if( cqe->res > 0 && ( out = io_uring_recvmsg_validate( buffer, cqe->res, &recv_msg ) ) ) {
+        struct sockaddr_storage *addr = io_uring_recvmsg_name( out );
+        int     slot = free_count ? free_sends[--free_count] : -1;
+        char   *outbuf = slot < 0 ? ws->outbuf : ws->udp_outbufs + slot * G_UDP_OUTBUF_SIZE;
+        size_t  reply_size = 0;
+        ot_ip6  remoteip;
+
+        if( out->namelen <= sizeof( struct sockaddr_storage ) && udp_remoteip( addr, remoteip ) )
+          reply_size = udp_handle_packet( ws, io_uring_recvmsg_payload( out, &recv_msg ),
+                                          io_uring_recvmsg_payload_length( out, cqe->res, &recv_msg ), remoteip, outbuf );
+
+        if( !reply_size ) {
+          if( slot >= 0 ) free_sends[free_count++] = slot;
+        } else if( slot < 0 )
+          sendto( sock, outbuf, reply_size, 0, (struct sockaddr*)addr, out->namelen );
+        else {
+          ot_udp_send *send = sends + slot;
+          memcpy( &send->addr, addr, out->namelen );
+          memset( &send->msg, 0, sizeof( send->msg ) );
+          send->iov.iov_base   = outbuf;
+          send->iov.iov_len    = reply_size;
+          send->msg.msg_name    = &send->addr;
+          send->msg.msg_namelen = out->namelen;
+          send->msg.msg_iov     = &send->iov;
+          send->msg.msg_iovlen  = 1;
+          sqe = udp_uring_get_sqe( &ring );
+          io_uring_prep_sendmsg( sqe, sock, &send->msg, 0 );
+          io_uring_sqe_set_data64( sqe, slot + 1 );
+        }
+      }
+
+      /* Hand the buffer back to the kernel */
+      io_uring_buf_ring_add( buf_ring, buffer, G_UDP_INBUF_SIZE, buffer_id, buf_mask, 0 );
+      io_uring_buf_ring_advance( buf_ring, 1 );
+    }
+    io_uring_cq_advance( &ring, seen );
+    if( failed )
+      break;
+  }
+
+  io_uring_free_buf_ring( &ring, buf_ring, OT_UDP_URING_BUFFERS, 0 );
+  io_uring_queue_exit( &ring );
+  free( buffers );
+  return failed ? -1 : 0;
+}
+#endif
+
+void udp_set_io_uring( int enable ) {
+#ifdef WANT_IO_URING
+  g_udp_io_uring = !!enable;
+#else
+  if( enable )
+    fprintf( stderr, "Warning: opentracker was built without WANT_IO_URING, udp workers use blocking reads.\n" );
+#endif
+}
+
 static void* udp_worker( void * args ) {
   int64 sock = (int64)args;
   struct ot_workstruct ws;
@@ -186,21 +460,44 @@ static void* udp_worker( void * args ) {
 
   ws.inbuf=malloc(G_INBUF_SIZE);
   ws.outbuf=malloc(G_OUTBUF_SIZE);
+#if defined( OT_UDP_BATCHED ) || defined( WANT_IO_URING )
+  ws.udp_inbufs=malloc(OT_UDP_BATCH*G_UDP_INBUF_SIZE);
+  ws.udp_outbufs=malloc(OT_UDP_BATCH*G_UDP_OUTBUF_SIZE);
+#endif
 #ifdef    _DEBUG_HTTPERROR
   ws.debugbuf=malloc(G_DEBUGBUF_SIZE);
 #endif
+  workstruct_seed_random( &ws );
+
+#ifdef WANT_IO_URING
+  /* udp_worker_uring returns 0 only when opentracker shuts down. If it
+     fails, the first worker to notice tells and the others skip trying */
+  if( g_udp_io_uring && udp_worker_uring( sock, &ws ) && __sync_bool_compare_and_swap( &g_udp_io_uring, 1, 0 ) )
+    fprintf( stderr, "Warning: io_uring is not available, udp workers use blocking reads.\n" );
+#endif
 
   while( g_opentracker_running )
+#ifdef OT_UDP_BATCHED
+    udp_handle_batch( sock, &ws );
+#else
     handle_udp6( sock, &ws );
+#endif
 
   free( ws.inbuf );
   free( ws.outbuf );
+  free( ws.udp_inbufs );
+  free( ws.udp_outbufs );
 #ifdef    _DEBUG_HTTPERROR
   free( ws.debugbuf );
 #endif
   return NULL;
 }
 
+void udp_add_worker_cpu( unsigned int cpu ) {
+  if( g_udp_worker_cpu_count < OT_UDP_WORKER_CPUS_MAX )
+    g_udp_worker_cpus[g_udp_worker_cpu_count++] = cpu;
+}
+
 void udp_init( int64 sock, unsigned int worker_count ) {
   pthread_t thread_id;
   if( !g_rijndael_round_key[0] )
@@ -208,8 +505,33 @@ void udp_init( int64 sock, unsigned int worker_count ) {
 #ifdef _DEBUG
   fprintf( stderr, " installing %d workers on udp socket %ld", worker_count, (unsigned long)sock );
 #endif
-  while( worker_count-- )
-    pthread_create( &thread_id, NULL, udp_worker, (void *)sock );
+  while( worker_count-- ) {
+    /* Nobody else reads from the socket, a worker missing is fatal */
+    if( pthread_create( &thread_id, NULL, udp_worker, (void *)sock ) )
+      exerr( "Could not start udp worker." );
+
+    /* Pin the running worker, so that a cpu that does not exist only costs
+       its pinning */
+    if( g_udp_worker_cpu_count ) {
+#ifdef __linux__
+      cpu_set_t    cpus;
+      unsigned int cpu = g_udp_worker_cpus[g_udp_workers_started % g_udp_worker_cpu_count];
+      CPU_ZERO( &cpus );
+      if( cpu >= CPU_SETSIZE )
+        fprintf( stderr, "Warning: Could not pin udp worker to cpu %u.\n", cpu );
+      else {
+        int err;
+        CPU_SET( cpu, &cpus );
+        if( ( err = pthread_setaffinity_np( thread_id, sizeof( cpus ), &cpus ) ) )
+          fprintf( stderr, "Warning: Could not pin udp worker to cpu %u: %s\n", cpu, strerror( err ) );
+      }
+#else
+      if( !g_udp_workers_started )
+        fprintf( stderr, "Warning: Pinning udp workers to cpus is not supported on this platform.\n" );
+#endif
+    }
+    ++g_udp_workers_started;
+  }
 }
 
 const char *g_version_udp_c = "$Source$: $Revision$\n";
@@ -6,6 +6,24 @@
 #ifndef OT_UDP_H__
 #define OT_UDP_H__
 
+/* Datagrams a udp worker receives with one recvmmsg and answers with one
+   sendmmsg. The main loop reads at most OT_UDP_DRAIN_MAX datagrams from
+   a socket before it looks after its other sockets again */
+#define OT_UDP_BATCH     32
+#define OT_UDP_DRAIN_MAX 256
+
+/* With WANT_IO_URING, udp workers can receive through io_uring instead
+   (listen.udp.workers.io_uring). Its submission queue size and the amount
+   of receive buffers handed to the kernel, both powers of two */
+#define OT_UDP_URING_ENTRIES 256
+#define OT_UDP_URING_BUFFERS 256
+void udp_set_io_uring( int enable );
+
+/* Workers are pinned to the cpus added here, round robin in the order
+   they are started. Up to OT_UDP_WORKER_CPUS_MAX cpus may be given */
+#define OT_UDP_WORKER_CPUS_MAX 256
+void udp_add_worker_cpu( unsigned int cpu );
+
 void udp_init( int64 sock, unsigned int worker_count );
 int  handle_udp6( int64 serversocket, struct ot_workstruct *ws );
 
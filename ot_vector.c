@@ -4,21 +4,24 @@
    $id$ */
 
 /* System */
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
 #include <stdint.h>
 
 /* Opentracker */
 #include "trackerlogic.h"
 #include "ot_vector.h"
-
-/* Libowfat */
-#include "uint32.h"
-#include "uint16.h"
-
-static int vector_compare_peer(const void *peer1, const void *peer2 ) {
-  return memcmp( peer1, peer2, OT_PEER_COMPARE_SIZE );
+#include "ot_slab.h"
+
+/* memcmp for the sorted vectors, a word at a time */
+static int vector_compare( const uint8_t *a, const uint8_t *b, size_t size ) {
+  for( ; size >= 8; a += 8, b += 8, size -= 8 ) {
+    uint64_t wa = vector_read_big64( a ), wb = vector_read_big64( b );
+    if( wa != wb )
+      return wa < wb ? -1 : 1;
+  }
+  return size ? memcmp( a, b, size ) : 0;
 }
 
 /* This function gives us a binary search that returns a pointer, even if
@@ -31,7 +34,7 @@ void *binary_search( const void * const key, const void * base, const size_t mem
 
   while( interval ) {
     uint8_t *lookat = ((uint8_t*)base) + member_size * ( interval / 2 );
-    int cmp = memcmp( lookat, key, compare_size );
+    int cmp = vector_compare( lookat, key, compare_size );
     if(cmp == 0 ) {
       base = lookat;
       break;
@@ -47,13 +50,6 @@ void *binary_search( const void * const key, const void * base, const size_t mem
   return (void*)base;
 }
 
-static uint8_t vector_hash_peer( ot_peer *peer, int bucket_count ) {
-  unsigned int hash = 5381, i = OT_PEER_COMPARE_SIZE;
-  uint8_t *p = (uint8_t*)peer;
-  while( i-- ) hash += (hash<<5) + *(p++);
-  return hash % bucket_count;
-}
-
 /* This is the generic insert operation for our vector type.
    It tries to locate the object at "key" with size "member_size" by comparing its first "compare_size" bytes with
    those of objects in vector. Our special "binary_search" function does that and either returns the match or a
@@ -82,185 +78,345 @@ void *vector_find_or_insert( ot_vector *vector, void *key, size_t member_size, s
   return match;
 }
 
-ot_peer *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exactmatch ) {
-  ot_peer *match;
-
-  /* If space is zero but size is set, we're dealing with a list of vector->size buckets */
-  if( vector->space < vector->size )
-    vector = ((ot_vector*)vector->data) + vector_hash_peer(peer, vector->size );
-  match = (ot_peer*)binary_search( peer, vector->data, vector->size, sizeof(ot_peer), OT_PEER_COMPARE_SIZE, exactmatch );
+static size_t vector_eytzinger_fill( ot_hash *tree, const ot_hash *sorted, size_t offset, size_t k, size_t count ) {
+  if( k <= count ) {
+    offset = vector_eytzinger_fill( tree, sorted, offset, 2 * k, count );
+    memcpy( tree[k], sorted[offset++], sizeof(ot_hash) );
+    offset = vector_eytzinger_fill( tree, sorted, offset, 2 * k + 1, count );
+  }
+  return offset;
+}
 
-  if( *exactmatch ) return match;
+void vector_eytzinger_hashes( ot_hash *tree, const ot_hash *sorted, size_t count ) {
+  vector_eytzinger_fill( tree, sorted, 0, 1, count );
+}
 
-  if( vector->size + 1 > vector->space ) {
-    size_t   new_space = vector->space ? OT_VECTOR_GROW_RATIO * vector->space : OT_VECTOR_MIN_MEMBERS;
-    ot_peer *new_data = realloc( vector->data, new_space * sizeof(ot_peer) );
-    if( !new_data ) return NULL;
-    /* Adjust pointer if it moved by realloc */
-    match = new_data + (match - (ot_peer*)vector->data);
+ot_hash *vector_eytzinger_find_hash( const ot_hash *tree, size_t count, const ot_hash hash ) {
+  size_t k = 1;
 
-    vector->data = new_data;
-    vector->space = new_space;
-  }
-  memmove( match + 1, match, sizeof(ot_peer) * ( ((ot_peer*)vector->data) + vector->size - match ) );
+  /* Descend without branching on the result, then climb back up to the
+     last node where we went left: that is the lower bound */
+  while( k <= count )
+    k = 2 * k + ( vector_compare_hash( tree[k], hash ) < 0 );
+  while( k & 1 )
+    k >>= 1;
+  k >>= 1;
 
-  vector->size++;
-  return match;
+  if( k && vector_equal_hash( tree[k], hash ) )
+    return (ot_hash*)tree[k];
+  return NULL;
 }
 
-/* This is the non-generic delete from vector-operation specialized for peers in pools.
-   It returns 0 if no peer was found (and thus not removed)
-              1 if a non-seeding peer was removed
-              2 if a seeding peer was removed
-*/
-int vector_remove_peer( ot_vector *vector, ot_peer *peer ) {
-  int      exactmatch;
-  ot_peer *match, *end;
+/* Hashed vectors: members are kept unsorted, lookups go through the index
+   behind the members (see ot_vector.h) or, for small vectors, a linear scan.
+   Removal moves the last member into the gap, so offsets are not stable. */
+typedef struct {
+  size_t   member_size;
+  size_t   compare_size;
+  uint32_t (*hash)( const void *key );
+  int      use_slab;     /* small vectors are carved from the slab allocator */
+  size_t   inline_space; /* vectors this small live in storage found by inline_data */
+  void    *(*inline_data)( ot_vector *vector );
+} ot_vector_kind;
+
+#define OT_VECTOR_INDEX_TAGMASK    0xff000000
+#define OT_VECTOR_INDEX_OFFSETMASK 0x00ffffff
+
+static uint32_t vector_hash_torrent( const void *key ) {
+  /* All hashes in a bucket share their leading bits. Use the bits below. */
+  return vector_read_big32( ((const uint8_t*)key) + 4 );
+}
 
-  if( !vector->size ) return 0;
+static uint32_t vector_hash_peer( const void *key ) {
+  /* FNV-1a over ip and port, then spread the bits so that the tag in the
+     top byte and the slot in the low bits both depend on all of them */
+  const uint8_t *p = key;
+  uint32_t hash = 2166136261U;
+  size_t   i;
+  for( i=0; i<OT_PEER_COMPARE_SIZE; ++i )
+    hash = ( hash ^ p[i] ) * 16777619U;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bU;
+  return hash ^ ( hash >> 13 );
+}
 
-  /* If space is zero but size is set, we're dealing with a list of vector->size buckets */
-  if( vector->space < vector->size )
-    vector = ((ot_vector*)vector->data) + vector_hash_peer(peer, vector->size );
+static void *vector_inline_peers( ot_vector *vector ) {
+  /* Peer vectors only ever live in an ot_peerlist */
+  return ((ot_peerlist*)( ((uint8_t*)vector) - offsetof( ot_peerlist, peers ) ))->peers_inline;
+}
 
-  end = ((ot_peer*)vector->data) + vector->size;
-  match = (ot_peer*)binary_search( peer, vector->data, vector->size, sizeof(ot_peer), OT_PEER_COMPARE_SIZE, &exactmatch );
-  if( !exactmatch ) return 0;
+static const ot_vector_kind vector_kind_torrent = { sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, vector_hash_torrent, 0, 0, NULL };
+static const ot_vector_kind vector_kind_peer    = { sizeof( ot_peer ),    OT_PEER_COMPARE_SIZE, vector_hash_peer,    1,
+                                                    OT_PEERLIST_INLINE_PEERS, vector_inline_peers };
 
-  exactmatch = ( OT_PEERFLAG( match ) & PEER_FLAG_SEEDING ) ? 2 : 1;
-  memmove( match, match + 1, sizeof(ot_peer) * ( end - match - 1 ) );
+#define MEMBER(kind,vector,offset) ( ((uint8_t*)(vector)->data) + (kind)->member_size * (offset) )
 
-  vector->size--;
-  vector_fixup_peers( vector );
-  return exactmatch;
+static inline int vector_equal( const ot_vector_kind *kind, const void *member, const void *key ) {
+  switch( kind->compare_size ) {
+    case OT_HASH_COMPARE_SIZE: return vector_equal_hash( member, key );
+    case OT_PEER_COMPARE_SIZE: return vector_equal_peer( member, key );
+    default:                   return !memcmp( member, key, kind->compare_size );
+  }
 }
 
-void vector_remove_torrent( ot_vector *vector, ot_torrent *match ) {
-  ot_torrent *end = ((ot_torrent*)vector->data) + vector->size;
+static uint32_t *vector_index( const ot_vector_kind *kind, const ot_vector *vector ) {
+  if( vector->space < OT_VECTOR_INDEX_MINSPACE )
+    return NULL;
+  return (uint32_t*)MEMBER( kind, vector, vector->space );
+}
 
-  if( !vector->size ) return;
+static size_t vector_index_bytes( size_t space ) {
+  return space < OT_VECTOR_INDEX_MINSPACE ? 0 : 2 * space * sizeof(uint32_t);
+}
 
-  /* If this is being called after a unsuccessful malloc() for peer_list
-     in add_peer_to_torrent, match->peer_list actually might be NULL */
-  if( match->peer_list) free_peerlist( match->peer_list );
+static size_t vector_bytes( const ot_vector_kind *kind, size_t space ) {
+  return kind->member_size * space + vector_index_bytes( space );
+}
 
-  memmove( match, match + 1, sizeof(ot_torrent) * ( end - match - 1 ) );
-  if( ( --vector->size * OT_VECTOR_SHRINK_THRESH < vector->space ) && ( vector->space >= OT_VECTOR_SHRINK_RATIO * OT_VECTOR_MIN_MEMBERS ) ) {
-    vector->space /= OT_VECTOR_SHRINK_RATIO;
-    vector->data = realloc( vector->data, vector->space * sizeof( ot_torrent ) );
+/* Returns the index slot pointing to the member matching key or, if there
+   is none, the empty slot where that member would be put */
+static uint32_t *vector_index_probe( const ot_vector_kind *kind, const ot_vector *vector, uint32_t *index, const void *key,
+                                     uint32_t hash, int *exactmatch ) {
+  size_t   mask = 2 * vector->space - 1, slot = hash & mask;
+  uint32_t tag  = hash & OT_VECTOR_INDEX_TAGMASK;
+
+  while( index[slot] ) {
+    if( ( index[slot] & OT_VECTOR_INDEX_TAGMASK ) == tag &&
+        vector_equal( kind, MEMBER( kind, vector, ( index[slot] & OT_VECTOR_INDEX_OFFSETMASK ) - 1 ), key ) ) {
+      *exactmatch = 1;
+      return index + slot;
+    }
+    slot = ( slot + 1 ) & mask;
   }
+  *exactmatch = 0;
+  return index + slot;
 }
 
-void vector_clean_list( ot_vector * vector, int num_buckets ) {
-  while( num_buckets-- )
-    free( vector[num_buckets].data );
-  free( vector );
-  return;
+static void vector_index_rebuild( const ot_vector_kind *kind, ot_vector *vector ) {
+  uint32_t *index = vector_index( kind, vector );
+  size_t    mask = 2 * vector->space - 1, offset;
+
+  if( !index ) return;
+  memset( index, 0, vector_index_bytes( vector->space ) );
+
+  for( offset=0; offset<vector->size; ++offset ) {
+    uint32_t hash = kind->hash( MEMBER( kind, vector, offset ) );
+    size_t   slot = hash & mask;
+    while( index[slot] )
+      slot = ( slot + 1 ) & mask;
+    index[slot] = ( hash & OT_VECTOR_INDEX_TAGMASK ) | ( offset + 1 );
+  }
 }
 
-void vector_redistribute_buckets( ot_peerlist * peer_list ) {
-  int tmp, bucket, bucket_size_new, num_buckets_new, num_buckets_old = 1;
-  ot_vector * bucket_list_new, * bucket_list_old = &peer_list->peers;
+/* Empties an index slot. Linear probing does not allow holes in a probe
+   sequence, so move back all following entries that may live here. */
+static void vector_index_delete( const ot_vector_kind *kind, const ot_vector *vector, uint32_t *index, uint32_t *slot_ptr ) {
+  size_t mask = 2 * vector->space - 1, hole = slot_ptr - index, slot = hole;
 
-  if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-    num_buckets_old = peer_list->peers.size;
-    bucket_list_old = peer_list->peers.data;
+  while( 1 ) {
+    size_t home;
+    slot = ( slot + 1 ) & mask;
+    if( !index[slot] )
+      break;
+    home = kind->hash( MEMBER( kind, vector, ( index[slot] & OT_VECTOR_INDEX_OFFSETMASK ) - 1 ) ) & mask;
+    /* Entry may only move back, if its home slot is not in ( hole, slot ] */
+    if( ( slot > hole ) ? ( home <= hole || home > slot ) : ( home <= hole && home > slot ) ) {
+      index[hole] = index[slot];
+      hole = slot;
+    }
   }
+  index[hole] = 0;
+}
 
-  if( peer_list->peer_count < 255 )
-    num_buckets_new = 1;
-  else if( peer_list->peer_count > 8192 )
-    num_buckets_new = 64;
-  else if( peer_list->peer_count >= 512 && peer_list->peer_count < 4096 )
-    num_buckets_new = 16;
-  else if( peer_list->peer_count < 512 && num_buckets_old <= 16 )
-    num_buckets_new = num_buckets_old;
-  else if( peer_list->peer_count < 512 )
-    num_buckets_new = 1;
-  else if( peer_list->peer_count < 8192 && num_buckets_old > 1 )
-    num_buckets_new = num_buckets_old;
+static void vector_free_data( const ot_vector_kind *kind, ot_vector *vector, void *inline_data ) {
+  if( vector->data == inline_data )
+    return;
+  if( kind->use_slab )
+    slab_free( vector->data, vector_bytes( kind, vector->space ) );
   else
-    num_buckets_new = 16;
+    free( vector->data );
+}
 
-  if( num_buckets_new == num_buckets_old )
-    return;
+/* Changes space of a hashed vector, the index is rebuilt for the new size */
+static int vector_resize_hashed( const ot_vector_kind *kind, ot_vector *vector, size_t new_space ) {
+  size_t new_bytes = vector_bytes( kind, new_space );
+  void  *inline_data = kind->inline_data ? kind->inline_data( vector ) : NULL;
+  void  *new_data;
 
-  /* Assume near perfect distribution */
-  bucket_list_new = malloc( num_buckets_new * sizeof( ot_vector ) );
-  if( !bucket_list_new) return;
-  bzero( bucket_list_new, num_buckets_new * sizeof( ot_vector ) );
-
-  tmp = peer_list->peer_count / num_buckets_new;
-  bucket_size_new = OT_VECTOR_MIN_MEMBERS;
-  while( bucket_size_new < tmp)
-    bucket_size_new *= OT_VECTOR_GROW_RATIO;
-
-  /* preallocate vectors to hold all peers */
-  for( bucket=0; bucket<num_buckets_new; ++bucket ) {
-    bucket_list_new[bucket].space = bucket_size_new;
-    bucket_list_new[bucket].data  = malloc( bucket_size_new * sizeof(ot_peer) );
-    if( !bucket_list_new[bucket].data )
-      return vector_clean_list( bucket_list_new, num_buckets_new );
+  if( new_space > OT_VECTOR_INDEX_MAXSPACE )
+    return -1;
+
+  if( !new_space ) {
+    vector_free_data( kind, vector, inline_data );
+    vector->data  = NULL;
+    vector->space = 0;
+    return 0;
   }
 
-  /* Now sort them into the correct bucket */
-  for( bucket=0; bucket<num_buckets_old; ++bucket ) {
-    ot_peer * peers_old = bucket_list_old[bucket].data, * peers_new;
-    int peer_count_old = bucket_list_old[bucket].size;
-    while( peer_count_old-- ) {
-      ot_vector * bucket_dest = bucket_list_new;
-      if( num_buckets_new > 1 )
-        bucket_dest += vector_hash_peer(peers_old, num_buckets_new);
-      if( bucket_dest->size + 1 > bucket_dest->space ) {
-        void * tmp = realloc( bucket_dest->data, sizeof(ot_peer) * OT_VECTOR_GROW_RATIO * bucket_dest->space );
-        if( !tmp ) return vector_clean_list( bucket_list_new, num_buckets_new );
-        bucket_dest->data   = tmp;
-        bucket_dest->space *= OT_VECTOR_GROW_RATIO;
-      }
-      peers_new = (ot_peer*)bucket_dest->data;
-      memcpy(peers_new + bucket_dest->size++, peers_old++, sizeof(ot_peer));
+  if( new_space <= kind->inline_space ) {
+    /* Move into the inline storage, there is no index to rebuild there */
+    if( vector->data != inline_data ) {
+      if( vector->size )
+        memcpy( inline_data, vector->data, kind->member_size * vector->size );
+      vector_free_data( kind, vector, inline_data );
+      vector->data = inline_data;
     }
+    vector->space = kind->inline_space;
+    return 0;
   }
 
-  /* Now sort each bucket to later allow bsearch */
-  for( bucket=0; bucket<num_buckets_new; ++bucket )
-    qsort( bucket_list_new[bucket].data, bucket_list_new[bucket].size, sizeof( ot_peer ), vector_compare_peer );
-
-  /* Everything worked fine. Now link new bucket_list to peer_list */
-  if( OT_PEERLIST_HASBUCKETS( peer_list) )
-    vector_clean_list( (ot_vector*)peer_list->peers.data, peer_list->peers.size );
+  if( vector->data && vector->data == inline_data ) {
+    /* Moving out of the inline storage */
+    if( !( new_data = kind->use_slab ? slab_alloc( new_bytes ) : malloc( new_bytes ) ) )
+      return -1;
+    memcpy( new_data, vector->data, kind->member_size * vector->size );
+  } else if( kind->use_slab )
+    new_data = slab_realloc( vector->data, vector_bytes( kind, vector->space ), new_bytes );
   else
-    free( peer_list->peers.data );
-
-  if( num_buckets_new > 1 ) {
-    peer_list->peers.data  = bucket_list_new;
-    peer_list->peers.size  = num_buckets_new;
-    peer_list->peers.space = 0; /* Magic marker for "is list of buckets" */
-  } else {
-    peer_list->peers.data  = bucket_list_new->data;
-    peer_list->peers.size  = bucket_list_new->size;
-    peer_list->peers.space = bucket_list_new->space;
-    free( bucket_list_new );
+    new_data = realloc( vector->data, new_bytes );
+  if( !new_data )
+    return -1;
+
+  vector->data  = new_data;
+  vector->space = new_space;
+  vector_index_rebuild( kind, vector );
+  return 0;
+}
+
+static void *vector_find_hashed( const ot_vector_kind *kind, ot_vector *vector, const void *key, uint32_t **slot ) {
+  uint32_t *index = vector_index( kind, vector );
+  uint8_t  *member = vector->data, *end = MEMBER( kind, vector, vector->size );
+  int       exactmatch;
+
+  if( index ) {
+    *slot = vector_index_probe( kind, vector, index, key, kind->hash( key ), &exactmatch );
+    return exactmatch ? MEMBER( kind, vector, ( **slot & OT_VECTOR_INDEX_OFFSETMASK ) - 1 ) : NULL;
+  }
+
+  for( ; member < end; member += kind->member_size )
+    if( vector_equal( kind, member, key ) )
+      return member;
+  return NULL;
+}
+
+static void *vector_find_or_insert_hashed( const ot_vector_kind *kind, ot_vector *vector, const void *key, int *exactmatch ) {
+  uint32_t *slot = NULL;
+  uint8_t  *match = vector_find_hashed( kind, vector, key, &slot );
+
+  if( ( *exactmatch = ( match != NULL ) ) )
+    return match;
+
+  if( vector->size + 1 > vector->space ) {
+    if( vector_resize_hashed( kind, vector, vector->space ? OT_VECTOR_GROW_RATIO * vector->space : OT_VECTOR_MIN_MEMBERS ) )
+      return NULL;
+    /* Index has moved or appeared, find the empty slot again */
+    if( vector_index( kind, vector ) )
+      slot = vector_index_probe( kind, vector, vector_index( kind, vector ), key, kind->hash( key ), exactmatch );
+  }
+
+  match = MEMBER( kind, vector, vector->size );
+  memcpy( match, key, kind->compare_size );
+  if( vector_index( kind, vector ) )
+    *slot = ( kind->hash( key ) & OT_VECTOR_INDEX_TAGMASK ) | ( vector->size + 1 );
+
+  vector->size++;
+  return match;
+}
+
+static void vector_remove_hashed( const ot_vector_kind *kind, ot_vector *vector, void *match ) {
+  uint32_t *index = vector_index( kind, vector );
+  uint8_t  *last = MEMBER( kind, vector, vector->size - 1 );
+  int       exactmatch;
+
+  if( index ) {
+    vector_index_delete( kind, vector, index, vector_index_probe( kind, vector, index, match, kind->hash( match ), &exactmatch ) );
+    /* Tell the last member's index slot that it is going to fill the gap */
+    if( (uint8_t*)match != last ) {
+      uint32_t *slot = vector_index_probe( kind, vector, index, last, kind->hash( last ), &exactmatch );
+      *slot = ( *slot & OT_VECTOR_INDEX_TAGMASK ) | ( ( ((uint8_t*)match) - ((uint8_t*)vector->data) ) / kind->member_size + 1 );
+    }
   }
+
+  if( (uint8_t*)match != last )
+    memcpy( match, last, kind->member_size );
+  vector->size--;
 }
 
-void vector_fixup_peers( ot_vector * vector ) {
-  int need_fix = 0;
+/* Gives back memory when a hashed vector has become sparse, frees it when empty */
+static void vector_shrink_hashed( const ot_vector_kind *kind, ot_vector *vector ) {
+  size_t new_space = vector->space;
 
   if( !vector->size ) {
-    free( vector->data );
-    vector->data = NULL;
-    vector->space = 0;
+    vector_resize_hashed( kind, vector, 0 );
     return;
   }
 
-  while( ( vector->size * OT_VECTOR_SHRINK_THRESH < vector->space ) &&
-         ( vector->space >= OT_VECTOR_SHRINK_RATIO * OT_VECTOR_MIN_MEMBERS ) ) {
-    vector->space /= OT_VECTOR_SHRINK_RATIO;
-    need_fix++;
-  }
-  if( need_fix )
-    vector->data = realloc( vector->data, vector->space * sizeof( ot_peer ) );
+  while( ( vector->size * OT_VECTOR_SHRINK_THRESH < new_space ) &&
+         ( new_space >= OT_VECTOR_SHRINK_RATIO * OT_VECTOR_MIN_MEMBERS ) )
+    new_space /= OT_VECTOR_SHRINK_RATIO;
+
+  if( new_space != vector->space )
+    vector_resize_hashed( kind, vector, new_space );
+}
+
+ot_torrent *vector_find_torrent( ot_vector *vector, ot_hash hash ) {
+  uint32_t *slot;
+  return vector_find_hashed( &vector_kind_torrent, vector, hash, &slot );
+}
+
+ot_torrent *vector_find_or_insert_torrent( ot_vector *vector, ot_hash hash, int *exactmatch ) {
+  return vector_find_or_insert_hashed( &vector_kind_torrent, vector, hash, exactmatch );
+}
+
+void vector_remove_torrent( ot_vector *vector, ot_torrent *match ) {
+  if( !vector->size ) return;
+
+  /* If this is being called after a unsuccessful malloc() for peer_list
+     in add_peer_to_torrent, match->peer_list actually might be NULL */
+  if( match->peer_list) free_peerlist( match->peer_list );
+
+  vector_remove_hashed( &vector_kind_torrent, vector, match );
+  vector_shrink_hashed( &vector_kind_torrent, vector );
+}
+
+ot_peer *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exactmatch ) {
+  return vector_find_or_insert_hashed( &vector_kind_peer, vector, peer, exactmatch );
+}
+
+/* This is the non-generic delete from vector-operation specialized for peers in pools.
+   It returns 0 if no peer was found (and thus not removed)
+              1 if a non-seeding peer was removed
+              2 if a seeding peer was removed
+*/
+int vector_remove_peer( ot_vector *vector, ot_peer *peer ) {
+  uint32_t *slot;
+  ot_peer  *match;
+  int       removed;
+
+  if( !vector->size ) return 0;
+
+  match = vector_find_hashed( &vector_kind_peer, vector, peer, &slot );
+  if( !match ) return 0;
+
+  removed = ( OT_PEERFLAG( match ) & PEER_FLAG_SEEDING ) ? 2 : 1;
+  vector_remove_hashed( &vector_kind_peer, vector, match );
+  vector_shrink_hashed( &vector_kind_peer, vector );
+  return removed;
+}
+
+/* The clean sweep compacts peers in place behind the index' back. Shrink
+   the vector if that made it sparse, or else rebuild its index. */
+void vector_fixup_peers( ot_vector *vector ) {
+  size_t space = vector->space;
+
+  vector_shrink_hashed( &vector_kind_peer, vector );
+  if( vector->space == space )
+    vector_index_rebuild( &vector_kind_peer, vector );
+}
+
+void vector_free_peers( ot_vector *vector ) {
+  vector_resize_hashed( &vector_kind_peer, vector, 0 );
+  vector->size = 0;
 }
 
 const char *g_version_vector_c = "$Source$: $Revision$\n";
@@ -6,14 +6,23 @@
 #ifndef OT_VECTOR_H__
 #define OT_VECTOR_H__
 
+#include <stdint.h>
+#include <string.h>
+
 /* These defines control vectors behaviour */
 #define OT_VECTOR_MIN_MEMBERS   2
 #define OT_VECTOR_GROW_RATIO    2
 #define OT_VECTOR_SHRINK_THRESH 4
 #define OT_VECTOR_SHRINK_RATIO  2
 
-#define OT_PEER_BUCKET_MINCOUNT 512
-#define OT_PEER_BUCKET_MAXCOUNT 256
+/* Hashed vectors (torrent buckets and peer lists) are not sorted. Once they have space for
+   OT_VECTOR_INDEX_MINSPACE members, an open addressing index lives behind
+   the members in the same allocation. It has 2 * space slots, each one
+   holding an 8 bit tag from the member's hash in its upper bits and the
+   member's offset + 1 in its lower 24 bits. 0 marks an empty slot. Smaller
+   vectors are scanned linearly. */
+#define OT_VECTOR_INDEX_MINSPACE 16
+#define OT_VECTOR_INDEX_MAXSPACE (1<<23)
 
 typedef struct {
   void   *data;
@@ -21,14 +30,74 @@ typedef struct {
   size_t  space;
 } ot_vector;
 
-void    *binary_search( const void * const key, const void * base, const size_t member_count, const size_t member_size,
-                        size_t compare_size, int *exactmatch );
-void    *vector_find_or_insert( ot_vector *vector, void *key, size_t member_size, size_t compare_size, int *exactmatch );
-ot_peer *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exactmatch );
+/* Compare kernels for the fixed size keys. Words are read big endian, so
+   vector_compare_hash orders like memcmp does */
+static inline uint64_t vector_read_big64( const uint8_t *p ) {
+  return ( (uint64_t)p[0] << 56 ) | ( (uint64_t)p[1] << 48 ) | ( (uint64_t)p[2] << 40 ) | ( (uint64_t)p[3] << 32 ) |
+         ( (uint64_t)p[4] << 24 ) | ( (uint64_t)p[5] << 16 ) | ( (uint64_t)p[6] <<  8 ) |   (uint64_t)p[7];
+}
+
+static inline uint32_t vector_read_big32( const uint8_t *p ) {
+  return ( (uint32_t)p[0] << 24 ) | ( (uint32_t)p[1] << 16 ) | ( (uint32_t)p[2] << 8 ) | (uint32_t)p[3];
+}
+
+static inline int vector_compare_hash( const void *hash1, const void *hash2 ) {
+  const uint8_t *a = hash1, *b = hash2;
+  uint64_t wa, wb;
+  int      i;
+
+  /* Hashes in a bucket or in the accesslist rarely differ in the first word only */
+  for( i=0; i<16; i+=8 )
+    if( ( wa = vector_read_big64( a + i ) ) != ( wb = vector_read_big64( b + i ) ) )
+      return wa < wb ? -1 : 1;
+  wa = vector_read_big32( a + 16 );
+  wb = vector_read_big32( b + 16 );
+  return wa < wb ? -1 : wa > wb;
+}
+
+static inline int vector_equal_hash( const void *hash1, const void *hash2 ) {
+  uint64_t a[2], b[2];
+  uint32_t a2, b2;
+  memcpy( a, hash1, 16 ); memcpy( &a2, ((const uint8_t*)hash1) + 16, 4 );
+  memcpy( b, hash2, 16 ); memcpy( &b2, ((const uint8_t*)hash2) + 16, 4 );
+  return !( ( a[0] ^ b[0] ) | ( a[1] ^ b[1] ) | ( a2 ^ b2 ) );
+}
+
+/* Compares ip and port of two peers */
+static inline int vector_equal_peer( const void *peer1, const void *peer2 ) {
+#if OT_IP_SIZE == 4
+  uint32_t a, b;
+  uint16_t a2, b2;
+  memcpy( &a, peer1, 4 ); memcpy( &a2, ((const uint8_t*)peer1) + 4, 2 );
+  memcpy( &b, peer2, 4 ); memcpy( &b2, ((const uint8_t*)peer2) + 4, 2 );
+  return !( ( a ^ b ) | ( a2 ^ b2 ) );
+#else
+  uint64_t a[2], b[2];
+  uint16_t a2, b2;
+  memcpy( a, peer1, 16 ); memcpy( &a2, ((const uint8_t*)peer1) + 16, 2 );
+  memcpy( b, peer2, 16 ); memcpy( &b2, ((const uint8_t*)peer2) + 16, 2 );
+  return !( ( a[0] ^ b[0] ) | ( a[1] ^ b[1] ) | ( a2 ^ b2 ) );
+#endif
+}
+
+void       *binary_search( const void * const key, const void * base, const size_t member_count, const size_t member_size,
+                           size_t compare_size, int *exactmatch );
+void       *vector_find_or_insert( ot_vector *vector, void *key, size_t member_size, size_t compare_size, int *exactmatch );
+
+/* Big, read mostly sets of hashes (the accesslist) are searched in Eytzinger
+   order: the sorted hashes laid out like a breadth first walk of the search
+   tree, the children of slot k in slots 2k and 2k+1. The top levels of the
+   tree share a few cache lines. tree needs room for count + 1 hashes,
+   slot 0 stays unused */
+void        vector_eytzinger_hashes( ot_hash *tree, const ot_hash *sorted, size_t count );
+ot_hash    *vector_eytzinger_find_hash( const ot_hash *tree, size_t count, const ot_hash hash );
+ot_peer    *vector_find_or_insert_peer( ot_vector *vector, ot_peer *peer, int *exactmatch );
+ot_torrent *vector_find_torrent( ot_vector *vector, ot_hash hash );
+ot_torrent *vector_find_or_insert_torrent( ot_vector *vector, ot_hash hash, int *exactmatch );
 
-int      vector_remove_peer( ot_vector *vector, ot_peer *peer );
-void     vector_remove_torrent( ot_vector *vector, ot_torrent *match );
-void     vector_redistribute_buckets( ot_peerlist * peer_list );
-void     vector_fixup_peers( ot_vector * vector );
+int         vector_remove_peer( ot_vector *vector, ot_peer *peer );
+void        vector_remove_torrent( ot_vector *vector, ot_torrent *match );
+void        vector_fixup_peers( ot_vector * vector );
+void        vector_free_peers( ot_vector * vector );
 
 #endif
@@ -31,6 +31,7 @@
 #include "ot_vector.h"
 #include "ot_mutex.h"
 #include "ot_stats.h"
+#include "ot_slab.h"
 
 #ifndef WANT_SYNC_LIVE
 #define WANT_SYNC_LIVE
@@ -126,7 +127,7 @@ size_t add_peer_to_torrent_proxy( ot_hash hash, ot_peer *peer ) {
   ot_peer    *peer_dest;
   ot_vector  *torrents_list = mutex_bucket_lock_by_hash( hash );
 
-  torrent = vector_find_or_insert( torrents_list, (void*)hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  torrent = vector_find_or_insert_torrent( torrents_list, hash, &exactmatch );
   if( !torrent )
     return -1;
 
@@ -134,7 +135,7 @@ size_t add_peer_to_torrent_proxy( ot_hash hash, ot_peer *peer ) {
     /* Create a new torrent entry, then */
     memcpy( torrent->hash, hash, sizeof(ot_hash) );
 
-    if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
+    if( !( torrent->peer_list = slab_alloc( sizeof (ot_peerlist) ) ) ) {
       vector_remove_torrent( torrents_list, torrent );
       mutex_bucket_unlock_by_hash( hash, 0 );
       return -1;
@@ -164,11 +165,10 @@ size_t add_peer_to_torrent_proxy( ot_hash hash, ot_peer *peer ) {
 }
 
 size_t remove_peer_from_torrent_proxy( ot_hash hash, ot_peer *peer ) {
-  int          exactmatch;
   ot_vector   *torrents_list = mutex_bucket_lock_by_hash( hash );
-  ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  ot_torrent  *torrent = vector_find_torrent( torrents_list, hash );
 
-  if( exactmatch ) {
+  if( torrent ) {
     ot_peerlist *peer_list = torrent->peer_list;
     switch( vector_remove_peer( &peer_list->peers, peer ) ) {
       case 2:  peer_list->seed_count--; /* Fall throughs intended */
@@ -182,16 +182,8 @@ size_t remove_peer_from_torrent_proxy( ot_hash hash, ot_peer *peer ) {
 }
 
 void free_peerlist( ot_peerlist *peer_list ) {
-  if( peer_list->peers.data ) {
-    if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-      ot_vector *bucket_list = (ot_vector*)(peer_list->peers.data);
-
-      while( peer_list->peers.size-- )
-        free( bucket_list++->data );
-    }
-    free( peer_list->peers.data );
-  }
-  free( peer_list );
+  vector_free_peers( &peer_list->peers );
+  slab_free( peer_list, sizeof( ot_peerlist ) );
 }
 
 static void livesync_handle_peersync( ssize_t datalen ) {
@@ -585,6 +577,8 @@ int main( int argc, char **argv ) {
 
   if( !lbound ) exerr( "No livesync port bound." );
   if( !g_connection_count && !sbound ) exerr( "No streamsync port bound." );
+  slab_init( );
+  mutex_init( );
   pthread_create( &sync_in_thread_id, NULL, livesync_worker, NULL );
   pthread_create( &sync_out_thread_id, NULL, streamsync_worker, NULL );
 
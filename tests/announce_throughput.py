@@ -0,0 +1,35 @@
+#!/usr/bin/env python3
+#
+# Measures udp announce throughput for a number of udp worker threads.
+#
+# Pass several opentracker binaries (e.g. one built before and one after a
+# change) to compare them. Each binary is started once per worker count and
+# flooded with udp announces for a few popular torrents, so that every reply
+# carries a random selection of peers. The rate is taken from the tracker's
+# own udp announce counter.
+#
+# usage: tests/announce_throughput.py [-s seconds] [-w 1,2,4,8] binary...
+
+import argparse, time
+import ot_load
+
+PORT     = 16970
+TORRENTS = 64
+
+def run( binary, workers, seconds ):
+  with ot_load.tracker( binary, PORT, 'listen.udp.workers %d\n' % workers ):
+    with ot_load.flood( PORT, torrents = TORRENTS ):
+      time.sleep( 1 ) # warm up, fill the swarms
+      return ot_load.rate( PORT, ot_load.UDP_ANNOUNCES, seconds )
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument( '-s', '--seconds', type = float, default = 10 )
+  parser.add_argument( '-w', '--workers', default = '1,2,4,8' )
+  parser.add_argument( 'binaries', nargs = '+' )
+  args = parser.parse_args()
+  workers = [ int( w ) for w in args.workers.split( ',' ) ]
+
+  print( '%-40s' % 'binary' + ''.join( '%12s' % ( '%d workers' % w ) for w in workers ) )
+  for binary in args.binaries:
+    print( '%-40s' % binary[-40:] + ''.join( '%12.0f' % run( binary, w, args.seconds ) for w in workers ), flush = True )
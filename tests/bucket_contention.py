@@ -0,0 +1,39 @@
+#!/usr/bin/env python3
+#
+# Measures bucket lock contention for different tracker.buckets settings.
+#
+# Starts the opentracker binary once per bucket count with a number of udp
+# workers, floods it with udp announces from several processes while
+# hammering the stats and fullscrape pages (which walk all buckets), and
+# reports the mutex_stall counter from the stats page.
+#
+# usage: tests/bucket_contention.py [path/to/opentracker] [seconds]
+
+import os, sys, time, urllib.request
+import ot_load
+
+TRACKER  = sys.argv[1] if len(sys.argv) > 1 else './opentracker'
+SECONDS  = float(sys.argv[2]) if len(sys.argv) > 2 else 10
+BUCKETS  = [ 256, 1024, 4096, 16384, 65536 ]
+WORKERS  = max( 2, os.cpu_count() // 2 )
+TORRENTS = 200000
+PORT     = 16969
+
+def scraper( stop ):
+  while not stop.is_set():
+    for path in ( '/stats?mode=everything', '/scrape' ):
+      try: urllib.request.urlopen( 'http://127.0.0.1:%d%s' % ( PORT, path ), timeout = 5 ).read()
+      except Exception: pass
+
+def run( buckets ):
+  with ot_load.tracker( TRACKER, PORT, 'tracker.buckets %d\nlisten.udp.workers %d\n' % ( buckets, WORKERS ) ):
+    with ot_load.flood( PORT, extra = ( scraper, ), torrents = TORRENTS ):
+      time.sleep( SECONDS )
+    grab = lambda pattern: ot_load.counter( PORT, pattern )
+    print( '%8d %8d %12d %12d' % ( buckets, grab( '<buckets>(\\d+)' ), grab( ot_load.UDP_ANNOUNCES ),
+                                   grab( '<mutex_stall>\\s*<count>(\\d+)' ) ) )
+
+if __name__ == '__main__':
+  print( '%8s %8s %12s %12s' % ( 'asked', 'buckets', 'announces', 'stalls' ) )
+  for b in BUCKETS:
+    run( b )
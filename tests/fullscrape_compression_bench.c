@@ -0,0 +1,157 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   Compares gzip and zstd for full scrapes in the TASK_FULLSCRAPE format.
+   Entries are fed to the compressor one by one or, like ot_fullscrape.c
+   does, collected in a 64k staging buffer first. The cpu seconds and
+   output bytes for each encoding are reported.
+
+   cc -O2 -I.. -o fullscrape_compression_bench fullscrape_compression_bench.c ../ot_bencode.c -lz -lzstd
+   ./fullscrape_compression_bench [torrents] [zstd level]
+
+   $id$ */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <zlib.h>
+#include <zstd.h>
+
+/* Opentracker */
+#include "ot_bencode.h"
+
+#define CHUNK_SIZE   (512*1024)
+#define STAGING_SIZE (64*1024)
+#define MAXENTRYLEN  256
+
+typedef struct {
+  uint8_t hash[20];
+  size_t  seed_count;
+  size_t  peer_count;
+  size_t  down_count;
+} record;
+
+static int compare_record( const void *a, const void *b ) {
+  return memcmp( ((record*)a)->hash, ((record*)b)->hash, 20 );
+}
+
+static size_t format_entry( char *r, record *rec ) {
+  char *s = r;
+  r += bencode_string( r, rec->hash, 20 );
+  r += bencode_literal( r, "d8:complete" );    r += bencode_int( r, rec->seed_count );
+  r += bencode_literal( r, "10:downloaded" );  r += bencode_int( r, rec->down_count );
+  r += bencode_literal( r, "10:incomplete" );  r += bencode_int( r, rec->peer_count-rec->seed_count );
+  *r++ = 'e';
+  return r - s;
+}
+
+static void report( const char *name, size_t plain, size_t packed, clock_t start ) {
+  double elapsed = (double)( clock() - start ) / CLOCKS_PER_SEC;
+  printf( "%-12s %12zu bytes %6.1f%% %8.3f cpu s %8.1f MB/s\n", name, packed, 100.0 * packed / plain, elapsed, plain / elapsed / 1e6 );
+}
+
+/* Formats entries from *next on until less than an entry fits into the
+   staging buffer, returns the bytes staged */
+static size_t stage( char *staging, size_t staging_size, record *records, size_t count, size_t *next ) {
+  size_t len = 0;
+  while( *next < count && len + MAXENTRYLEN <= staging_size )
+    len += format_entry( staging + len, records + (*next)++ );
+  return len;
+}
+
+/* Level and window like fullscrape_encoder_init */
+static size_t run_gzip( record *records, size_t count, char *out, char *staging, size_t staging_size ) {
+  z_stream strm;
+  size_t   packed = 0, next = 0;
+
+  memset( &strm, 0, sizeof(strm) );
+  if( deflateInit2( &strm, 7, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) != Z_OK ) return 0;
+  strm.next_out  = (uint8_t*)out;
+  strm.avail_out = CHUNK_SIZE;
+  while( 1 ) {
+    int zaction;
+    strm.next_in  = (uint8_t*)staging;
+    strm.avail_in = stage( staging, staging_size, records, count, &next );
+    zaction = strm.avail_in ? Z_NO_FLUSH : Z_FINISH;
+    while( 1 ) {
+      deflate( &strm, zaction );
+      if( strm.avail_out ) break;
+      packed += CHUNK_SIZE;
+      strm.next_out  = (uint8_t*)out;
+      strm.avail_out = CHUNK_SIZE;
+    }
+    if( zaction == Z_FINISH ) break;
+  }
+  packed += CHUNK_SIZE - strm.avail_out;
+  deflateEnd( &strm );
+  return packed;
+}
+
+static size_t run_zstd( record *records, size_t count, char *out, char *staging, size_t staging_size, int level ) {
+  ZSTD_CCtx     *zctx = ZSTD_createCCtx( );
+  ZSTD_outBuffer output = { out, CHUNK_SIZE, 0 };
+  size_t         packed = 0, next = 0;
+
+  if( !zctx ) return 0;
+  ZSTD_CCtx_setParameter( zctx, ZSTD_c_compressionLevel, level );
+  while( 1 ) {
+    ZSTD_inBuffer     input = { staging, stage( staging, staging_size, records, count, &next ), 0 };
+    ZSTD_EndDirective end   = input.size ? ZSTD_e_continue : ZSTD_e_end;
+    size_t            remaining;
+    while( 1 ) {
+      remaining = ZSTD_compressStream2( zctx, &output, &input, end );
+      if( ZSTD_isError( remaining ) ) { ZSTD_freeCCtx( zctx ); return 0; }
+      if( input.pos == input.size && ( end == ZSTD_e_continue || !remaining ) ) break;
+      if( output.pos == output.size ) {
+        packed += output.pos;
+        output.pos = 0;
+      }
+    }
+    if( end == ZSTD_e_end ) break;
+  }
+  packed += output.pos;
+  ZSTD_freeCCtx( zctx );
+  return packed;
+}
+
+int main( int argc, char **argv ) {
+  size_t  count = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 10000000, plain = 0, i;
+  int     level = argc > 2 ? atoi( argv[2] ) : 3;
+  record *records = malloc( count * sizeof( record ) );
+  char   *out = malloc( CHUNK_SIZE ), *staging = malloc( STAGING_SIZE ), entry[MAXENTRYLEN], name[32];
+  clock_t start;
+
+  if( !records || !out || !staging ) return 1;
+
+  /* Most torrents are tiny, a few are huge, like on a real tracker */
+  srandom( 42 );
+  for( i=0; i<count; ++i ) {
+    int k;
+    for( k=0; k<20; ++k ) records[i].hash[k] = random();
+    records[i].peer_count = random() % 8 ? random() % 16 : random() % 100000;
+    records[i].seed_count = records[i].peer_count ? random() % ( records[i].peer_count + 1 ) : 0;
+    records[i].down_count = random() % 4 ? random() % 1000 : random();
+  }
+  qsort( records, count, sizeof( record ), compare_record );
+
+  start = clock();
+  for( i=0; i<count; ++i )
+    plain += format_entry( entry, records + i );
+  report( "plain", plain, plain, start );
+
+  start = clock();
+  report( "gzip-7", plain, run_gzip( records, count, out, staging, MAXENTRYLEN ), start );
+  start = clock();
+  report( "gzip-7/64k", plain, run_gzip( records, count, out, staging, STAGING_SIZE ), start );
+
+  snprintf( name, sizeof(name), "zstd-%d", level );
+  start = clock();
+  report( name, plain, run_zstd( records, count, out, staging, MAXENTRYLEN, level ), start );
+  snprintf( name, sizeof(name), "zstd-%d/64k", level );
+  start = clock();
+  report( name, plain, run_zstd( records, count, out, staging, STAGING_SIZE, level ), start );
+  return 0;
+}
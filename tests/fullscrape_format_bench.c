@@ -0,0 +1,93 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   Compares how fast sprintf and the ot_bencode.c writers produce full
+   scrape entries in the TASK_FULLSCRAPE format, in bytes per second.
+
+   cc -O2 -I.. -o fullscrape_format_bench fullscrape_format_bench.c ../ot_bencode.c
+   ./fullscrape_format_bench [torrents] [rounds]
+
+   $id$ */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Opentracker */
+#include "ot_bencode.h"
+
+typedef struct {
+  uint8_t hash[20];
+  size_t  seed_count;
+  size_t  peer_count;
+  size_t  down_count;
+} record;
+
+static size_t format_sprintf( char *r, record *rec ) {
+  char *s = r;
+  *r++='2'; *r++='0'; *r++=':';
+  memcpy( r, rec->hash, 20 ); r += 20;
+  r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee", rec->seed_count, rec->down_count, rec->peer_count-rec->seed_count );
+  return r - s;
+}
+
+static size_t format_bencode( char *r, record *rec ) {
+  char *s = r;
+  r += bencode_string( r, rec->hash, 20 );
+  r += bencode_literal( r, "d8:complete" );    r += bencode_int( r, rec->seed_count );
+  r += bencode_literal( r, "10:downloaded" );  r += bencode_int( r, rec->down_count );
+  r += bencode_literal( r, "10:incomplete" );  r += bencode_int( r, rec->peer_count-rec->seed_count );
+  *r++ = 'e';
+  return r - s;
+}
+
+static double now( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run( const char *name, size_t (*format)( char*, record* ), record *records, size_t count, int rounds, char *out ) {
+  double start = now(), elapsed;
+  size_t bytes = 0, i;
+  int    round;
+
+  for( round=0; round<rounds; ++round )
+    for( i=0; i<count; ++i )
+      bytes += format( out + ( i & 1023 ) * 256, records + i );
+  elapsed = now() - start;
+  printf( "%-8s %12zu bytes %8.3f s %10.1f MB/s\n", name, bytes, elapsed, bytes / elapsed / 1e6 );
+}
+
+int main( int argc, char **argv ) {
+  size_t  count  = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 1000000, i;
+  int     rounds = argc > 2 ? atoi( argv[2] ) : 5;
+  record *records = malloc( count * sizeof( record ) );
+  char   *out = malloc( 1024 * 256 ), a[256], b[256];
+
+  if( !records || !out ) return 1;
+
+  /* Most torrents are tiny, a few are huge, like on a real tracker */
+  srandom( 42 );
+  for( i=0; i<count; ++i ) {
+    int k;
+    for( k=0; k<20; ++k ) records[i].hash[k] = random();
+    records[i].peer_count = random() % 8 ? random() % 16 : random() % 100000;
+    records[i].seed_count = records[i].peer_count ? random() % ( records[i].peer_count + 1 ) : 0;
+    records[i].down_count = random() % 4 ? random() % 1000 : random();
+  }
+
+  /* Both must produce the very same output */
+  for( i=0; i<count; ++i )
+    if( format_sprintf( a, records + i ) != format_bencode( b, records + i ) || memcmp( a, b, format_bencode( b, records + i ) ) ) {
+      fprintf( stderr, "output differs for record %zu\n", i );
+      return 1;
+    }
+
+  run( "sprintf", format_sprintf, records, count, rounds, out );
+  run( "bencode", format_bencode, records, count, rounds, out );
+  return 0;
+}
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+#
+# Checks persistent connections and pipelining of an opentracker built with
+# WANT_KEEPALIVE: pipelined announces on one connection are answered in
+# order, HTTP/1.0 and "Connection: close" requests end the connection, the
+# request limit and the idle timeout close it.
+#
+# The tracker is started with listen.tcp.keepalive_requests 8 and
+# listen.tcp.keepalive_timeout 2. Timeouts are only checked every
+# OT_CLIENT_TIMEOUT_CHECKINTERVAL seconds, so the last check takes a while.
+#
+# usage: tests/http_keepalive.py [-w tcp workers] binary
+
+import argparse, socket, time
+import ot_load
+
+PORT = 16972
+
+def announce( n, version = '1.1', headers = '' ):
+  return ( 'GET /announce?info_hash=%020d&port=%d&left=1&compact=1 HTTP/%s\r\n%s\r\n' % ( 7, 1000 + n, version, headers ) ).encode()
+
+def replies( s, count ):
+  data, result = b'', []
+  while len( result ) < count:
+    head, sep, rest = data.partition( b'\r\n\r\n' )
+    if sep:
+      length = int( head.split( b'Content-Length: ' )[1].split( b'\r\n' )[0] )
+      if len( rest ) >= length:
+        result.append( ( head.decode(), rest[:length] ) )
+        data = rest[length:]
+        continue
+    chunk = s.recv( 65536 )
+    if not chunk:
+      break
+    data += chunk
+  return result
+
+def closed( s, timeout ):
+  s.settimeout( timeout )
+  try:
+    return s.recv( 1 ) == b''
+  except socket.timeout:
+    return False
+
+def connect():
+  return socket.create_connection( ( '127.0.0.1', PORT ), timeout = 5 )
+
+def run( binary, workers ):
+  config = 'listen.tcp.workers %d\nlisten.tcp.keepalive_requests 8\nlisten.tcp.keepalive_timeout 2\n' % workers
+  with ot_load.tracker( binary, PORT, config, listen = 'listen.tcp' ):
+    s = connect()
+    s.sendall( b''.join( announce( i ) for i in range( 5 ) ) )
+    got = replies( s, 5 )
+    assert len( got ) == 5, 'pipelined replies missing'
+    for i, ( head, body ) in enumerate( got ):
+      assert 'Connection: keep-alive' in head, head
+      assert b'10:incompletei%de' % ( i + 1 ) in body, body
+    s.sendall( announce( 5 ) + announce( 6 ) )
+    assert len( replies( s, 2 ) ) == 2
+    s.sendall( announce( 7 ) + announce( 8 ) )
+    got = replies( s, 2 )
+    assert len( got ) == 1 and 'Connection: close' in got[0][0], 'request limit not enforced'
+    assert closed( s, 5 )
+    print( 'pipelining and request limit ok' )
+
+    for version, headers in ( ( '1.0', '' ), ( '1.1', 'Connection: close\r\n' ) ):
+      s = connect()
+      s.sendall( announce( 0, version, headers ) )
+      got = replies( s, 1 )
+      assert 'Connection: close' in got[0][0] and closed( s, 5 )
+    s = connect()
+    s.sendall( announce( 0, '1.0', 'Connection: Keep-Alive\r\n' ) )
+    assert 'Connection: keep-alive' in replies( s, 1 )[0][0] and not closed( s, 0.5 )
+    print( 'connection headers ok' )
+
+    started = time.time()
+    assert closed( s, 30 ), 'idle connection was not closed'
+    print( 'idle connection closed after %.0f seconds' % ( time.time() - started ) )
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument( '-w', '--workers', type = int, default = 0 )
+  parser.add_argument( 'binary' )
+  args = parser.parse_args()
+  run( args.binary, args.workers )
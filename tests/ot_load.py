@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+#
+# Shared parts of the load and throughput scripts in this directory:
+# starting an opentracker binary from a temporary config, flooding it with
+# udp packets from several processes and reading counters off its stats.
+
+import contextlib, multiprocessing, os, random, re, socket, struct, subprocess, tempfile, time, urllib.request
+
+UDP_PROTOCOL_ID = 0x41727101980
+
+@contextlib.contextmanager
+def tracker( binary, port, config = '', listen = 'listen.tcp_udp' ):
+  """Runs binary with the config lines given plus a listen statement for
+     127.0.0.1:port, until the with block is left"""
+  conf = tempfile.NamedTemporaryFile( 'w', suffix = '.conf', delete = False )
+  conf.write( config )
+  conf.write( '%s 127.0.0.1:%d\n' % ( listen, port ) )
+  conf.close()
+  proc = subprocess.Popen( [ binary, '-f', conf.name ], stderr = subprocess.DEVNULL )
+  time.sleep( 1 )
+  try:
+    yield proc
+  finally:
+    proc.terminate()
+    proc.wait()
+    os.unlink( conf.name )
+
+def stats( port, mode = 'everything' ):
+  return urllib.request.urlopen( 'http://127.0.0.1:%d/stats?mode=%s' % ( port, mode ), timeout = 5 ).read().decode()
+
+def counter( port, pattern ):
+  """First number matched by pattern's group in /stats?mode=everything"""
+  return int( re.search( pattern, stats( port ), re.S ).group( 1 ) )
+
+UDP_ANNOUNCES = '<udp>.*?<announce>(\\d+)'
+UDP_PACKETS   = '<udp>.*?<overall>(\\d+)'
+
+def udp_client( port, seed, stop, torrents = 0, sockets = 1, burst = 64 ):
+  """Floods the tracker from several sockets, so that the kernel sees
+     different source ports, burst packets per socket in a row. With
+     torrents set, each socket connects and announces to one of that many
+     torrents at random, else it sends connect requests only"""
+  rnd = random.Random( seed )
+  socks = []
+  for _ in range( sockets ):
+    s = socket.socket( socket.AF_INET, socket.SOCK_DGRAM )
+    s.settimeout( 1 )
+    s.connect( ( '127.0.0.1', port ) )
+    connid = None
+    if torrents:
+      s.send( struct.pack( '!QII', UDP_PROTOCOL_ID, 0, 1 ) )
+      connid = struct.unpack( '!IIQ', s.recv( 16 ) )[2]
+    s.setblocking( False )
+    socks.append( ( s, connid ) )
+  sent = 0
+  while not stop.is_set():
+    for s, connid in socks:
+      for _ in range( burst ):
+        if torrents:
+          infohash = struct.pack( '!I', rnd.randrange( torrents ) ) * 5
+          packet = struct.pack( '!QII20s20sQQQIIIiH', connid, 1, sent, infohash, os.urandom( 20 ), 0, rnd.choice( (0,1) ), 0, 0,
+                                rnd.getrandbits( 32 ), 0, 50, rnd.randrange( 1, 65535 ) )
+        else:
+          packet = struct.pack( '!QII', UDP_PROTOCOL_ID, 0, rnd.getrandbits( 32 ) )
+        try:
+          s.send( packet )
+          sent += 1
+        except BlockingIOError:
+          pass
+      try:
+        while True: s.recv( 2048 )
+      except BlockingIOError:
+        pass
+
+@contextlib.contextmanager
+def flood( port, clients = None, extra = (), **kwargs ):
+  """Runs udp_client in clients processes (half the cpus by default) and
+     the extra targets, which get the stop event, until the with block is
+     left"""
+  stop = multiprocessing.Event()
+  procs = [ multiprocessing.Process( target = udp_client, args = ( port, i, stop ), kwargs = kwargs )
+            for i in range( clients or max( 2, os.cpu_count() // 2 ) ) ]
+  procs += [ multiprocessing.Process( target = target, args = ( stop, ) ) for target in extra ]
+  for p in procs: p.start()
+  try:
+    yield stop
+  finally:
+    stop.set()
+    for p in procs: p.join()
+
+def rate( port, pattern, seconds ):
+  """Increase of a stats counter per second over the next seconds"""
+  start, t0 = counter( port, pattern ), time.time()
+  time.sleep( seconds )
+  return ( counter( port, pattern ) - start ) / ( time.time() - t0 )
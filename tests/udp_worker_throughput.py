@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+#
+# Measures udp packets/s on loopback for a number of udp worker threads in
+# several modes: all workers sharing one socket, a SO_REUSEPORT socket per
+# worker (listen.udp.workers.reuseport) and workers driving their sockets
+# through io_uring (listen.udp.workers.io_uring, needs a WANT_IO_URING build).
+#
+# Each client process floods the tracker from several sockets, so that the
+# kernel has different source ports to spread over the reuseport sockets.
+# The rate is taken from the tracker's own udp packet counter.
+#
+# usage: tests/udp_worker_throughput.py [-s seconds] [-w 1,2,4,8] [-c 0,1,2,3]
+#                                      [-m shared,reuseport,io_uring] binary
+
+import argparse, time
+import ot_load
+
+PORT    = 16971
+SOCKETS = 8
+
+MODES = {
+  'shared':             ( 0, 0 ),
+  'reuseport':          ( 1, 0 ),
+  'io_uring':           ( 0, 1 ),
+  'io_uring+reuseport': ( 1, 1 ),
+}
+
+def run( binary, workers, mode, cpus, seconds ):
+  reuseport, io_uring = MODES[mode]
+  config = 'listen.udp.workers %d\nlisten.udp.workers.reuseport %d\n' % ( workers, reuseport )
+  config += 'listen.udp.workers.io_uring %d\n' % io_uring
+  if cpus:
+    config += 'listen.udp.workers.cpus %s\n' % cpus
+  with ot_load.tracker( binary, PORT, config ):
+    with ot_load.flood( PORT, sockets = SOCKETS, burst = 16 ):
+      time.sleep( 1 )
+      return ot_load.rate( PORT, ot_load.UDP_PACKETS, seconds )
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument( '-s', '--seconds', type = float, default = 10 )
+  parser.add_argument( '-w', '--workers', default = '1,2,4,8' )
+  parser.add_argument( '-c', '--cpus', default = '', help = 'value for listen.udp.workers.cpus' )
+  parser.add_argument( '-m', '--modes', default = 'shared,reuseport,io_uring', help = ','.join( MODES ) )
+  parser.add_argument( 'binary' )
+  args = parser.parse_args()
+  workers = [ int( w ) for w in args.workers.split( ',' ) ]
+
+  print( '%-20s' % 'mode' + ''.join( '%12s' % ( '%d workers' % w ) for w in workers ) )
+  for mode in args.modes.split( ',' ):
+    print( '%-20s' % mode + ''.join( '%12.0f' % run( args.binary, w, mode, args.cpus, args.seconds ) for w in workers ), flush = True )
@@ -0,0 +1,199 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   Randomized test for the hashed vectors in ot_vector.c. Torrents and
+   peers are inserted and removed at random against a reference set, so
+   that vectors grow and shrink through the inline storage, the linear
+   scan and the index. Many keys share their hash bits, which gives long
+   probe sequences and tag collisions. After every step the vector must
+   hold exactly the keys of the reference set at valid offsets, which
+   checks the swap remove, its offset fix up and the backward shift delete.
+
+   cc -O1 -g -fsanitize=address,undefined -I.. -o vector_hashed_test vector_hashed_test.c ../ot_vector.c ../ot_slab.c -lpthread
+   ./vector_hashed_test [operations] [seed]
+
+   $id$ */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_vector.h"
+#include "ot_slab.h"
+
+#define KEY_COUNT     4096
+#define CHECK_EVERY   9973
+
+/* ot_vector.c frees peer lists of removed torrents, ours have none */
+void free_peerlist( ot_peerlist *peer_list ) { (void)peer_list; }
+
+static ot_hash  torrent_keys[KEY_COUNT];
+static ot_peer  peer_keys[KEY_COUNT];
+static uint8_t  present[KEY_COUNT];
+static size_t   present_count;
+
+#define FAIL( ... ) do { fprintf( stderr, __VA_ARGS__ ); exit( 1 ); } while( 0 )
+
+/* The fill level wanders between empty and full in long waves, so that
+   vectors pass all sizes in both directions */
+static int want_insert( size_t step ) {
+  size_t wave = ( step / 20000 ) % 8, target = wave < 4 ? wave * KEY_COUNT / 3 : ( 7 - wave ) * KEY_COUNT / 3;
+  if( wave == 7 ) target = 0;
+  return present_count < target ? random() % 8 != 0 : random() % 8 == 0;
+}
+
+static void make_keys( void ) {
+  size_t i, k;
+  for( i=0; i<KEY_COUNT; ++i ) {
+    for( k=0; k<sizeof(ot_hash); ++k ) torrent_keys[i][k] = random();
+    for( k=0; k<sizeof(ot_peer); ++k ) peer_keys[i].data[k] = random();
+    /* All hashes in a bucket share their leading bits */
+    torrent_keys[i][0] = 0x42;
+    /* Half of the torrents fall on only 64 hash values, tag included */
+    if( i & 1 ) {
+      uint32_t h = random() % 64;
+      torrent_keys[i][4] = 0x17; torrent_keys[i][5] = 0; torrent_keys[i][6] = 0; torrent_keys[i][7] = h;
+    }
+    /* Some peers only differ in their port */
+    if( i % 4 == 1 )
+      memcpy( peer_keys[i].data, peer_keys[i-1].data, OT_IP_SIZE );
+  }
+}
+
+static void check_torrents( ot_vector *vector, size_t step ) {
+  size_t i;
+  if( vector->size != present_count )
+    FAIL( "step %zu: torrent vector holds %zu members, expected %zu\n", step, vector->size, present_count );
+  if( vector->size > vector->space )
+    FAIL( "step %zu: torrent vector size %zu exceeds space %zu\n", step, vector->size, vector->space );
+  for( i=0; i<KEY_COUNT; ++i ) {
+    ot_torrent *match = vector_find_torrent( vector, torrent_keys[i] );
+    if( !present[i] != !match )
+      FAIL( "step %zu: torrent %zu %s\n", step, i, match ? "found after removal" : "lost" );
+    if( match && ( (size_t)( match - (ot_torrent*)vector->data ) >= vector->size || memcmp( match->hash, torrent_keys[i], sizeof(ot_hash) ) ) )
+      FAIL( "step %zu: torrent %zu found at a wrong offset\n", step, i );
+  }
+}
+
+static void run_torrents( size_t operations ) {
+  ot_vector vector = { NULL, 0, 0 };
+  size_t    step;
+
+  memset( present, 0, sizeof(present) ); present_count = 0;
+  for( step=0; step<operations; ++step ) {
+    size_t i = random() % KEY_COUNT;
+    int    exactmatch;
+
+    if( want_insert( step ) ) {
+      ot_torrent *torrent = vector_find_or_insert_torrent( &vector, torrent_keys[i], &exactmatch );
+      if( !torrent ) FAIL( "step %zu: out of memory\n", step );
+      if( exactmatch != present[i] ) FAIL( "step %zu: torrent %zu exactmatch %d\n", step, i, exactmatch );
+      if( !exactmatch ) {
+        torrent->peer_list = NULL;
+        present[i] = 1; ++present_count;
+      }
+    } else if( present[i] ) {
+      ot_torrent *torrent = vector_find_torrent( &vector, torrent_keys[i] );
+      if( !torrent ) FAIL( "step %zu: torrent %zu lost before removal\n", step, i );
+      vector_remove_torrent( &vector, torrent );
+      present[i] = 0; --present_count;
+    }
+
+    if( step % CHECK_EVERY == 0 )
+      check_torrents( &vector, step );
+  }
+  check_torrents( &vector, step );
+  free( vector.data );
+}
+
+static void check_peers( ot_peerlist *peer_list, size_t step ) {
+  ot_vector *vector = &peer_list->peers;
+  size_t     i;
+  if( vector->size != present_count )
+    FAIL( "step %zu: peer vector holds %zu members, expected %zu\n", step, vector->size, present_count );
+  if( vector->size > vector->space )
+    FAIL( "step %zu: peer vector size %zu exceeds space %zu\n", step, vector->size, vector->space );
+  if( vector->space && vector->space <= OT_PEERLIST_INLINE_PEERS && vector->data != peer_list->peers_inline )
+    FAIL( "step %zu: small peer vector not inline\n", step );
+  for( i=0; i<KEY_COUNT; ++i ) {
+    int      exactmatch;
+    size_t   size = vector->size;
+    ot_peer *match;
+    if( !present[i] ) continue;
+    /* Peers have no lookup of their own, finding does not insert here */
+    match = vector_find_or_insert_peer( vector, &peer_keys[i], &exactmatch );
+    if( !exactmatch || vector->size != size )
+      FAIL( "step %zu: peer %zu lost\n", step, i );
+    if( (size_t)( match - (ot_peer*)vector->data ) >= vector->size || memcmp( match, peer_keys + i, OT_PEER_COMPARE_SIZE ) )
+      FAIL( "step %zu: peer %zu found at a wrong offset\n", step, i );
+  }
+}
+
+/* Like the clean sweep: drop every third peer by compacting in place,
+   then let vector_fixup_peers mend the index */
+static void sweep_peers( ot_vector *vector ) {
+  ot_peer *peers = vector->data;
+  size_t   i, kept = 0;
+  for( i=0; i<vector->size; ++i ) {
+    size_t key = ( ( OT_PEERFLAG( peers + i ) & 0x7f ) << 8 ) | OT_PEERTIME( peers + i );
+    if( key % 3 ) {
+      memmove( peers + kept++, peers + i, sizeof(ot_peer) );
+      continue;
+    }
+    present[key] = 0; --present_count;
+  }
+  vector->size = kept;
+  vector_fixup_peers( vector );
+}
+
+static void run_peers( size_t operations ) {
+  ot_peerlist peer_list;
+  size_t      step;
+
+  memset( &peer_list, 0, sizeof(peer_list) );
+  memset( present, 0, sizeof(present) ); present_count = 0;
+  for( step=0; step<operations; ++step ) {
+    size_t i = random() % KEY_COUNT;
+    int    exactmatch;
+
+    if( want_insert( step ) ) {
+      ot_peer *peer = vector_find_or_insert_peer( &peer_list.peers, &peer_keys[i], &exactmatch );
+      if( !peer ) FAIL( "step %zu: out of memory\n", step );
+      if( exactmatch != present[i] ) FAIL( "step %zu: peer %zu exactmatch %d\n", step, i, exactmatch );
+      if( !exactmatch ) {
+        /* Remember the key in flag and time, behind the compared bytes */
+        OT_PEERFLAG( peer ) = ( i >> 8 ) | ( i & 1 ? PEER_FLAG_SEEDING : 0 );
+        OT_PEERTIME( peer ) = i & 0xff;
+        present[i] = 1; ++present_count;
+      }
+    } else if( random() % 1000 == 0 ) {
+      sweep_peers( &peer_list.peers );
+    } else {
+      int removed = vector_remove_peer( &peer_list.peers, &peer_keys[i] );
+      if( removed != ( present[i] ? 1 + (int)( i & 1 ) : 0 ) )
+        FAIL( "step %zu: removing peer %zu returned %d\n", step, i, removed );
+      if( present[i] ) { present[i] = 0; --present_count; }
+    }
+
+    if( step % CHECK_EVERY == 0 )
+      check_peers( &peer_list, step );
+  }
+  check_peers( &peer_list, step );
+  vector_free_peers( &peer_list.peers );
+}
+
+int main( int argc, char **argv ) {
+  size_t operations = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 1000000;
+
+  srandom( argc > 2 ? strtoul( argv[2], NULL, 10 ) : 42 );
+  slab_init();
+  make_keys();
+  run_torrents( operations );
+  run_peers( operations );
+  puts( "ok" );
+  return 0;
+}
@@ -0,0 +1,109 @@
+/* This software was written by Dirk Engling <erdgeist@erdgeist.org>
+   It is considered beerware. Prost. Skol. Cheers or whatever.
+
+   Microbenchmarks for the compare kernels and search layouts in
+   ot_vector.c: memcmp against the word compares, bsearch on sorted hashes
+   against the Eytzinger layout used for the accesslist, and hashed torrent
+   bucket lookups.
+
+   cc -O2 -I.. -o vector_search_bench vector_search_bench.c ../ot_vector.c ../ot_slab.c -lpthread
+   ./vector_search_bench [lookups]
+
+   $id$ */
+
+/* System */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Opentracker */
+#include "trackerlogic.h"
+#include "ot_vector.h"
+#include "ot_slab.h"
+
+/* ot_vector.c frees peer lists of removed torrents, we never remove any */
+void free_peerlist( ot_peerlist *peer_list ) { (void)peer_list; }
+
+static double now( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_memcmp( const void *a, const void *b ) {
+  return memcmp( a, b, sizeof(ot_hash) );
+}
+
+static void report( const char *name, size_t count, size_t lookups, size_t found, double elapsed ) {
+  printf( "%-24s %8zu hashes %8.1f ns/lookup (%zu found)\n", name, count, elapsed * 1e9 / lookups, found );
+}
+
+static void bench_sorted( size_t count, size_t lookups ) {
+  ot_hash *sorted = malloc( count * sizeof(ot_hash) ), *tree = malloc( ( count + 1 ) * sizeof(ot_hash) ), *keys = malloc( 1024 * sizeof(ot_hash) );
+  size_t   i, found;
+  double   start;
+
+  for( i=0; i<count * sizeof(ot_hash); ++i ) ((uint8_t*)sorted)[i] = random();
+  qsort( sorted, count, sizeof(ot_hash), compare_memcmp );
+  vector_eytzinger_hashes( tree, sorted, count );
+
+  /* Half of the keys are in the set */
+  for( i=0; i<1024; ++i ) {
+    if( i & 1 ) memcpy( keys[i], sorted[random() % count], sizeof(ot_hash) );
+    else { size_t k; for( k=0; k<sizeof(ot_hash); ++k ) keys[i][k] = random(); }
+  }
+
+  start = now(); found = 0;
+  for( i=0; i<lookups; ++i )
+    found += bsearch( keys[i & 1023], sorted, count, sizeof(ot_hash), compare_memcmp ) != NULL;
+  report( "bsearch/memcmp", count, lookups, found, now() - start );
+
+  start = now(); found = 0;
+  for( i=0; i<lookups; ++i )
+    found += bsearch( keys[i & 1023], sorted, count, sizeof(ot_hash), vector_compare_hash ) != NULL;
+  report( "bsearch/words", count, lookups, found, now() - start );
+
+  start = now(); found = 0;
+  for( i=0; i<lookups; ++i )
+    found += vector_eytzinger_find_hash( tree, count, keys[i & 1023] ) != NULL;
+  report( "eytzinger/words", count, lookups, found, now() - start );
+
+  free( sorted ); free( tree ); free( keys );
+}
+
+static void bench_bucket( size_t count, size_t lookups ) {
+  ot_vector bucket = { NULL, 0, 0 };
+  ot_hash  *keys = malloc( count * sizeof(ot_hash) );
+  size_t    i, found;
+  double    start;
+  int       exactmatch;
+
+  /* All hashes in a bucket share their leading bits */
+  for( i=0; i<count; ++i ) {
+    size_t k;
+    for( k=0; k<sizeof(ot_hash); ++k ) keys[i][k] = random();
+    keys[i][0] = 0x42;
+    vector_find_or_insert_torrent( &bucket, keys[i], &exactmatch );
+  }
+
+  start = now(); found = 0;
+  for( i=0; i<lookups; ++i )
+    found += vector_find_torrent( &bucket, keys[( i * 7919 ) % count] ) != NULL;
+  report( "bucket/hashed", count, lookups, found, now() - start );
+
+  free( bucket.data ); free( keys );
+}
+
+int main( int argc, char **argv ) {
+  size_t lookups = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 10000000, count;
+
+  srandom( 42 );
+  slab_init();
+  for( count=1024; count<=4*1024*1024; count*=16 )
+    bench_sorted( count, lookups );
+  for( count=16; count<=16384; count*=8 )
+    bench_bucket( count, lookups );
+  return 0;
+}
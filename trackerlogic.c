@@ -27,21 +27,32 @@
 #include "ot_accesslist.h"
 #include "ot_fullscrape.h"
 #include "ot_livesync.h"
+#include "ot_slab.h"
+#include "ot_bencode.h"
 
 /* Forward declaration */
-size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto );
+size_t return_peers_for_torrent( struct ot_workstruct *ws, ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto );
+
+size_t g_peer_cache_threshold = OT_PEER_CACHE_THRESHOLD_DEFAULT;
+
+/* Compact peers of a hot torrent in random order. Leechers come first,
+   the seed_count seeders follow them */
+struct ot_peercache {
+  ot_time base;
+  size_t  peer_count;
+  size_t  seed_count;
+  uint8_t peers[];
+};
+
+void free_peercache( ot_peerlist *peer_list ) {
+  free( peer_list->cache );
+  peer_list->cache = NULL;
+}
 
 void free_peerlist( ot_peerlist *peer_list ) {
-  if( peer_list->peers.data ) {
-    if( OT_PEERLIST_HASBUCKETS( peer_list ) ) {
-      ot_vector *bucket_list = (ot_vector*)(peer_list->peers.data);
-
-      while( peer_list->peers.size-- )
-        free( bucket_list++->data );
-    }
-    free( peer_list->peers.data );
-  }
-  free( peer_list );
+  free_peercache( peer_list );
+  vector_free_peers( &peer_list->peers );
+  slab_free( peer_list, sizeof( ot_peerlist ) );
 }
 
 void add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count ) {
@@ -52,14 +63,14 @@ void add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count
   if( !accesslist_hashisvalid( hash ) )
     return mutex_bucket_unlock_by_hash( hash, 0 );
   
-  torrent = vector_find_or_insert( torrents_list, (void*)hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  torrent = vector_find_or_insert_torrent( torrents_list, hash, &exactmatch );
   if( !torrent || exactmatch )
     return mutex_bucket_unlock_by_hash( hash, 0 );
 
   /* Create a new torrent entry, then */
   memcpy( torrent->hash, hash, sizeof(ot_hash) );
     
-  if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
+  if( !( torrent->peer_list = slab_alloc( sizeof (ot_peerlist) ) ) ) {
     vector_remove_torrent( torrents_list, torrent );
     return mutex_bucket_unlock_by_hash( hash, 0 );
   }
@@ -67,6 +78,7 @@ void add_torrent_from_saved_state( ot_hash hash, ot_time base, size_t down_count
   byte_zero( torrent->peer_list, sizeof( ot_peerlist ) );
   torrent->peer_list->base = base;
   torrent->peer_list->down_count = down_count;
+  mutex_bucket_changed( torrent );
 
   return mutex_bucket_unlock_by_hash( hash, 1 );
 }
@@ -87,7 +99,7 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
     return 0;
   }
 
-  torrent = vector_find_or_insert( torrents_list, (void*)ws->hash, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  torrent = vector_find_or_insert_torrent( torrents_list, *ws->hash, &exactmatch );
   if( !torrent ) {
     mutex_bucket_unlock_by_hash( *ws->hash, 0 );
     return 0;
@@ -97,7 +109,7 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
     /* Create a new torrent entry, then */
     memcpy( torrent->hash, *ws->hash, sizeof(ot_hash) );
 
-    if( !( torrent->peer_list = malloc( sizeof (ot_peerlist) ) ) ) {
+    if( !( torrent->peer_list = slab_alloc( sizeof (ot_peerlist) ) ) ) {
       vector_remove_torrent( torrents_list, torrent );
       mutex_bucket_unlock_by_hash( *ws->hash, 0 );
       return 0;
@@ -135,6 +147,7 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
 #endif
 
     torrent->peer_list->peer_count++;
+    mutex_bucket_changed( torrent );
     if( OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) {
       torrent->peer_list->down_count++;
       stats_issue_event( EVENT_COMPLETED, 0, (uintptr_t)ws );
@@ -158,6 +171,11 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
     }
 #endif
 
+    /* Renewals only count as a change if they change the scrape counts */
+    if( ( ( OT_PEERFLAG(peer_dest) ^ OT_PEERFLAG(&ws->peer) ) & PEER_FLAG_SEEDING ) ||
+        ( ~OT_PEERFLAG(peer_dest) & OT_PEERFLAG(&ws->peer) & PEER_FLAG_COMPLETED ) )
+      mutex_bucket_changed( torrent );
+
     if(  (OT_PEERFLAG(peer_dest) & PEER_FLAG_SEEDING )   && !(OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) )
       torrent->peer_list->seed_count--;
     if( !(OT_PEERFLAG(peer_dest) & PEER_FLAG_SEEDING )   &&  (OT_PEERFLAG(&ws->peer) & PEER_FLAG_SEEDING ) )
@@ -178,51 +196,39 @@ size_t add_peer_to_torrent_and_return_peers( PROTO_FLAG proto, struct ot_workstr
   }
 #endif
 
-  ws->reply_size = return_peers_for_torrent( torrent, amount, ws->reply, proto );
+  ws->reply_size = return_peers_for_torrent( ws, torrent, amount, ws->reply, proto );
   mutex_bucket_unlock_by_hash( *ws->hash, delta_torrentcount );
   return ws->reply_size;
 }
 
 static size_t return_peers_all( ot_peerlist *peer_list, char *reply ) {
-  unsigned int bucket, num_buckets = 1;
-  ot_vector  * bucket_list = &peer_list->peers;
+  ot_peer    * peers = (ot_peer*)peer_list->peers.data;
+  size_t       peer_count = peer_list->peers.size;
   size_t       result = OT_PEER_COMPARE_SIZE * peer_list->peer_count;
   char       * r_end = reply + result;
 
-  if( OT_PEERLIST_HASBUCKETS(peer_list) ) {
-    num_buckets = bucket_list->size;
-    bucket_list = (ot_vector *)bucket_list->data;
-  }
-
-  for( bucket = 0; bucket<num_buckets; ++bucket ) {
-    ot_peer * peers = (ot_peer*)bucket_list[bucket].data;
-    size_t    peer_count = bucket_list[bucket].size;
-    while( peer_count-- ) {
-      if( OT_PEERFLAG(peers) & PEER_FLAG_SEEDING ) {
-        r_end-=OT_PEER_COMPARE_SIZE;
-        memcpy(r_end,peers++,OT_PEER_COMPARE_SIZE);      
-      } else {
-        memcpy(reply,peers++,OT_PEER_COMPARE_SIZE);
-        reply+=OT_PEER_COMPARE_SIZE;
-      }
+  while( peer_count-- ) {
+    if( OT_PEERFLAG(peers) & PEER_FLAG_SEEDING ) {
+      r_end-=OT_PEER_COMPARE_SIZE;
+      memcpy(r_end,peers++,OT_PEER_COMPARE_SIZE);
+    } else {
+      memcpy(reply,peers++,OT_PEER_COMPARE_SIZE);
+      reply+=OT_PEER_COMPARE_SIZE;
     }
   }
   return result;
 }
 
-static size_t return_peers_selection( ot_peerlist *peer_list, size_t amount, char *reply ) {
-  unsigned int bucket_offset, bucket_index = 0, num_buckets = 1;
-  ot_vector  * bucket_list = &peer_list->peers;
+/* Peers are stored densely, so every offset below peers.size is a peer */
+static size_t return_peers_selection( struct ot_workstruct *ws, ot_peerlist *peer_list, size_t amount, char *reply ) {
+  ot_peer    * peers = (ot_peer*)peer_list->peers.data;
+  size_t       peer_count = peer_list->peers.size;
+  unsigned int peer_offset;
   unsigned int shifted_pc = peer_list->peer_count;
   unsigned int shifted_step = 0;
   unsigned int shift = 0;
   size_t       result = OT_PEER_COMPARE_SIZE * amount;
   char       * r_end = reply + result;
-  
-  if( OT_PEERLIST_HASBUCKETS(peer_list) ) {
-    num_buckets = bucket_list->size;
-    bucket_list = (ot_vector *)bucket_list->data;
-  }
 
   /* Make fixpoint arithmetic as exact as possible */
 #define MAXPRECBIT (1<<(8*sizeof(int)-3))
@@ -232,7 +238,7 @@ static size_t return_peers_selection( ot_peerlist *peer_list, size_t amount, cha
 
   /* Initialize somewhere in the middle of peers so that
    fixpoint's aliasing doesn't alway miss the same peers */
-  bucket_offset = random() % peer_list->peer_count;
+  peer_offset = workstruct_random( ws ) % peer_list->peer_count;
 
   while( amount-- ) {
     ot_peer * peer;
@@ -240,13 +246,11 @@ static size_t return_peers_selection( ot_peerlist *peer_list, size_t amount, cha
     /* This is the aliased, non shifted range, next value may fall into */
     unsigned int diff = ( ( ( amount + 1 ) * shifted_step ) >> shift ) -
                         ( (   amount       * shifted_step ) >> shift );
-    bucket_offset += 1 + random() % diff;
+    peer_offset += 1 + workstruct_random( ws ) % diff;
 
-    while( bucket_offset >= bucket_list[bucket_index].size ) {
-      bucket_offset -= bucket_list[bucket_index].size;
-      bucket_index = ( bucket_index + 1 ) % num_buckets;
-    }
-    peer = ((ot_peer*)bucket_list[bucket_index].data) + bucket_offset;
+    while( peer_offset >= peer_count )
+      peer_offset -= peer_count;
+    peer = peers + peer_offset;
     if( OT_PEERFLAG(peer) & PEER_FLAG_SEEDING ) {
       r_end-=OT_PEER_COMPARE_SIZE;
       memcpy(r_end,peer,OT_PEER_COMPARE_SIZE);      
@@ -258,11 +262,114 @@ static size_t return_peers_selection( ot_peerlist *peer_list, size_t amount, cha
   return result;
 }
 
+static void peercache_shuffle( struct ot_workstruct *ws, uint8_t *peers, size_t count ) {
+  uint8_t swap[OT_PEER_COMPARE_SIZE];
+  while( count > 1 ) {
+    size_t pick = workstruct_random( ws ) % count--;
+    memcpy( swap, peers + OT_PEER_COMPARE_SIZE * pick, OT_PEER_COMPARE_SIZE );
+    memcpy( peers + OT_PEER_COMPARE_SIZE * pick, peers + OT_PEER_COMPARE_SIZE * count, OT_PEER_COMPARE_SIZE );
+    memcpy( peers + OT_PEER_COMPARE_SIZE * count, swap, OT_PEER_COMPARE_SIZE );
+  }
+}
+
+/* Returns the torrent's peer cache, building it when it is missing or stale.
+   NULL means the torrent is too small for a cache or memory is tight */
+static ot_peercache *peercache_get( struct ot_workstruct *ws, ot_peerlist *peer_list ) {
+  ot_peercache *cache = peer_list->cache;
+  size_t        drift;
+
+  if( !g_peer_cache_threshold || peer_list->peer_count < g_peer_cache_threshold ) {
+    if( cache ) free_peercache( peer_list );
+    return NULL;
+  }
+
+  if( cache ) {
+    drift = peer_list->peer_count > cache->peer_count ? peer_list->peer_count - cache->peer_count : cache->peer_count - peer_list->peer_count;
+    if( g_now_seconds < cache->base + OT_PEER_CACHE_MAXAGE && drift * OT_PEER_CACHE_DRIFT <= cache->peer_count )
+      return cache;
+    free_peercache( peer_list );
+  }
+
+  if( ( cache = malloc( sizeof( ot_peercache ) + OT_PEER_COMPARE_SIZE * peer_list->peers.size ) ) ) {
+    size_t count = peer_list->peers.size;
+    /* Leechers go to the front, seeders fill from the back like in return_peers_all */
+    uint8_t *r = cache->peers, *r_end = cache->peers + OT_PEER_COMPARE_SIZE * count;
+    ot_peer *peer = (ot_peer*)peer_list->peers.data;
+
+    while( count-- ) {
+      if( OT_PEERFLAG(peer) & PEER_FLAG_SEEDING ) {
+        r_end -= OT_PEER_COMPARE_SIZE;
+        memcpy( r_end, peer++, OT_PEER_COMPARE_SIZE );
+      } else {
+        memcpy( r, peer++, OT_PEER_COMPARE_SIZE );
+        r += OT_PEER_COMPARE_SIZE;
+      }
+    }
+    cache->base       = g_now_seconds;
+    cache->peer_count = peer_list->peers.size;
+    cache->seed_count = cache->peer_count - ( r - cache->peers ) / OT_PEER_COMPARE_SIZE;
+    peercache_shuffle( ws, cache->peers, cache->peer_count - cache->seed_count );
+    peercache_shuffle( ws, r_end, cache->seed_count );
+    peer_list->cache = cache;
+  }
+  return cache;
+}
+
+/* Takes a stopped peer out of the cache, so that it is not handed out until
+   the next rebuild. The last leecher or seeder fills its slot, leechers
+   give their last slot to the last seeder, so both blocks stay shuffled */
+static void peercache_remove( ot_peercache *cache, ot_peer *peer ) {
+  size_t   leech_count = cache->peer_count - cache->seed_count, i;
+  uint8_t *slot = cache->peers;
+
+  for( i=0; i<cache->peer_count; ++i, slot += OT_PEER_COMPARE_SIZE )
+    if( !memcmp( slot, peer, OT_PEER_COMPARE_SIZE ) )
+      break;
+  if( i == cache->peer_count )
+    return;
+
+  if( i < leech_count ) {
+    memmove( slot, cache->peers + OT_PEER_COMPARE_SIZE * ( leech_count - 1 ), OT_PEER_COMPARE_SIZE );
+    slot = cache->peers + OT_PEER_COMPARE_SIZE * ( leech_count - 1 );
+  } else
+    cache->seed_count--;
+  memmove( slot, cache->peers + OT_PEER_COMPARE_SIZE * ( cache->peer_count - 1 ), OT_PEER_COMPARE_SIZE );
+  cache->peer_count--;
+}
+
+/* Copies amount peers, starting at a random offset, out of a shuffled block
+   treated as a ring */
+static char *peercache_window( struct ot_workstruct *ws, const uint8_t *peers, size_t count, size_t amount, char *reply ) {
+  size_t start, first;
+  if( !amount ) return reply;
+  start = workstruct_random( ws ) % count;
+  first = count - start < amount ? count - start : amount;
+  memcpy( reply, peers + OT_PEER_COMPARE_SIZE * start, OT_PEER_COMPARE_SIZE * first );
+  memcpy( reply + OT_PEER_COMPARE_SIZE * first, peers, OT_PEER_COMPARE_SIZE * ( amount - first ) );
+  return reply + OT_PEER_COMPARE_SIZE * amount;
+}
+
+/* Splits amount between leechers and seeders in proportion to the swarm,
+   rounding randomly, so the reply has the same mix return_peers_selection
+   would produce. amount must not exceed the cache's peer_count */
+static size_t return_peers_cached( struct ot_workstruct *ws, ot_peercache *cache, size_t amount, char *reply ) {
+  size_t leech_count = cache->peer_count - cache->seed_count;
+  size_t seeds = ( amount * cache->seed_count + workstruct_random( ws ) % cache->peer_count ) / cache->peer_count;
+  char  *r = reply;
+
+  if( seeds > cache->seed_count ) seeds = cache->seed_count;
+  if( amount - seeds > leech_count ) seeds = amount - leech_count;
+
+  r = peercache_window( ws, cache->peers, leech_count, amount - seeds, r );
+  r = peercache_window( ws, cache->peers + OT_PEER_COMPARE_SIZE * leech_count, cache->seed_count, seeds, r );
+  return r - reply;
+}
+
 /* Compiles a list of random peers for a torrent
    * reply must have enough space to hold 92+6*amount bytes
    * does not yet check not to return self
 */
-size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto ) {
+size_t return_peers_for_torrent( struct ot_workstruct *ws, ot_torrent *torrent, size_t amount, char *reply, PROTO_FLAG proto ) {
   ot_peerlist *peer_list = torrent->peer_list;
   char        *r = reply;
 
@@ -270,20 +377,28 @@ size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply
     amount = peer_list->peer_count;
 
   if( proto == FLAG_TCP ) {
-    int erval = OT_CLIENT_REQUEST_INTERVAL_RANDOM;
-    r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zde8:intervali%ie12:min intervali%ie" PEERS_BENCODED "%zd:", peer_list->seed_count, peer_list->down_count, peer_list->peer_count-peer_list->seed_count, erval, erval/2, OT_PEER_COMPARE_SIZE*amount );
+    int erval = OT_CLIENT_REQUEST_INTERVAL_RANDOM( ws );
+    r += bencode_literal( r, "d8:complete" );      r += bencode_int( r, peer_list->seed_count );
+    r += bencode_literal( r, "10:downloaded" );    r += bencode_int( r, peer_list->down_count );
+    r += bencode_literal( r, "10:incomplete" );    r += bencode_int( r, peer_list->peer_count-peer_list->seed_count );
+    r += bencode_literal( r, "8:interval" );       r += bencode_int( r, erval );
+    r += bencode_literal( r, "12:min interval" );  r += bencode_int( r, erval/2 );
+    r += bencode_literal( r, PEERS_BENCODED );     r += bencode_string_length( r, OT_PEER_COMPARE_SIZE*amount );
   } else {
-    *(uint32_t*)(r+0) = htonl( OT_CLIENT_REQUEST_INTERVAL_RANDOM );
+    *(uint32_t*)(r+0) = htonl( OT_CLIENT_REQUEST_INTERVAL_RANDOM( ws ) );
     *(uint32_t*)(r+4) = htonl( peer_list->peer_count - peer_list->seed_count );
     *(uint32_t*)(r+8) = htonl( peer_list->seed_count );
     r += 12;
   }
 
   if( amount ) {
+    ot_peercache *cache;
     if( amount == peer_list->peer_count )
       r += return_peers_all( peer_list, r );
+    else if( ( cache = peercache_get( ws, peer_list ) ) && amount <= cache->peer_count )
+      r += return_peers_cached( ws, cache, amount, r );
     else
-      r += return_peers_selection( peer_list, amount, r );
+      r += return_peers_selection( ws, peer_list, amount, r );
   }
 
   if( proto == FLAG_TCP )
@@ -294,11 +409,11 @@ size_t return_peers_for_torrent( ot_torrent *torrent, size_t amount, char *reply
 
 /* Fetches scrape info for a specific torrent */
 size_t return_udp_scrape_for_torrent( ot_hash hash, char *reply ) {
-  int          exactmatch, delta_torrentcount = 0;
+  int          delta_torrentcount = 0;
   ot_vector   *torrents_list = mutex_bucket_lock_by_hash( hash );
-  ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  ot_torrent  *torrent = vector_find_torrent( torrents_list, hash );
 
-  if( !exactmatch ) {
+  if( !torrent ) {
     memset( reply, 0, 12);
   } else {
     uint32_t *r = (uint32_t*) reply;
@@ -320,25 +435,26 @@ size_t return_udp_scrape_for_torrent( ot_hash hash, char *reply ) {
 /* Fetches scrape info for a specific torrent */
 size_t return_tcp_scrape_for_torrent( ot_hash *hash_list, int amount, char *reply ) {
   char *r = reply;
-  int   exactmatch, i;
+  int   i;
 
-  r += sprintf( r, "d5:filesd" );
+  r += bencode_literal( r, "d5:filesd" );
 
   for( i=0; i<amount; ++i ) {
     int          delta_torrentcount = 0;
     ot_hash     *hash = hash_list + i;
     ot_vector   *torrents_list = mutex_bucket_lock_by_hash( *hash );
-    ot_torrent  *torrent = binary_search( hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+    ot_torrent  *torrent = vector_find_torrent( torrents_list, *hash );
 
-    if( exactmatch ) {
+    if( torrent ) {
       if( clean_single_torrent( torrent ) ) {
         vector_remove_torrent( torrents_list, torrent );
         delta_torrentcount = -1;
       } else {
-        *r++='2';*r++='0';*r++=':';
-        memcpy( r, hash, sizeof(ot_hash) ); r+=sizeof(ot_hash);
-        r += sprintf( r, "d8:completei%zde10:downloadedi%zde10:incompletei%zdee",
-          torrent->peer_list->seed_count, torrent->peer_list->down_count, torrent->peer_list->peer_count-torrent->peer_list->seed_count );
+        r += bencode_string( r, hash, sizeof(ot_hash) );
+        r += bencode_literal( r, "d8:complete" );    r += bencode_int( r, torrent->peer_list->seed_count );
+        r += bencode_literal( r, "10:downloaded" );  r += bencode_int( r, torrent->peer_list->down_count );
+        r += bencode_literal( r, "10:incomplete" );  r += bencode_int( r, torrent->peer_list->peer_count-torrent->peer_list->seed_count );
+        *r++ = 'e';
       }
     }
     mutex_bucket_unlock_by_hash( *hash, delta_torrentcount );
@@ -350,9 +466,8 @@ size_t return_tcp_scrape_for_torrent( ot_hash *hash_list, int amount, char *repl
 
 static ot_peerlist dummy_list;
 size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
-  int          exactmatch;
   ot_vector   *torrents_list = mutex_bucket_lock_by_hash( *ws->hash );
-  ot_torrent  *torrent = binary_search( ws->hash, torrents_list->data, torrents_list->size, sizeof( ot_torrent ), OT_HASH_COMPARE_SIZE, &exactmatch );
+  ot_torrent  *torrent = vector_find_torrent( torrents_list, *ws->hash );
   ot_peerlist *peer_list = &dummy_list;
 
 #ifdef WANT_SYNC_LIVE
@@ -362,23 +477,31 @@ size_t remove_peer_from_torrent( PROTO_FLAG proto, struct ot_workstruct *ws ) {
   }
 #endif
 
-  if( exactmatch ) {
+  if( torrent ) {
     peer_list = torrent->peer_list;
     switch( vector_remove_peer( &peer_list->peers, &ws->peer ) ) {
       case 2:  peer_list->seed_count--; /* Fall throughs intended */
-      case 1:  peer_list->peer_count--; /* Fall throughs intended */
+      case 1:  peer_list->peer_count--;
+               if( peer_list->cache ) peercache_remove( peer_list->cache, &ws->peer );
+               mutex_bucket_changed( torrent ); /* Fall throughs intended */
       default: break;
     }
   }
 
   if( proto == FLAG_TCP ) {
-    int erval = OT_CLIENT_REQUEST_INTERVAL_RANDOM;
-    ws->reply_size = sprintf( ws->reply, "d8:completei%zde10:incompletei%zde8:intervali%ie12:min intervali%ie" PEERS_BENCODED "0:e", peer_list->seed_count, peer_list->peer_count - peer_list->seed_count, erval, erval / 2 );
+    int   erval = OT_CLIENT_REQUEST_INTERVAL_RANDOM( ws );
+    char *r = ws->reply;
+    r += bencode_literal( r, "d8:complete" );      r += bencode_int( r, peer_list->seed_count );
+    r += bencode_literal( r, "10:incomplete" );    r += bencode_int( r, peer_list->peer_count - peer_list->seed_count );
+    r += bencode_literal( r, "8:interval" );       r += bencode_int( r, erval );
+    r += bencode_literal( r, "12:min interval" );  r += bencode_int( r, erval / 2 );
+    r += bencode_literal( r, PEERS_BENCODED "0:e" );
+    ws->reply_size = r - ws->reply;
   }
 
   /* Handle UDP reply */
   if( proto == FLAG_UDP ) {
-    ((uint32_t*)ws->reply)[2] = htonl( OT_CLIENT_REQUEST_INTERVAL_RANDOM );
+    ((uint32_t*)ws->reply)[2] = htonl( OT_CLIENT_REQUEST_INTERVAL_RANDOM( ws ) );
     ((uint32_t*)ws->reply)[3] = htonl( peer_list->peer_count - peer_list->seed_count );
     ((uint32_t*)ws->reply)[4] = htonl( peer_list->seed_count);
     ws->reply_size = 20;
@@ -405,6 +528,13 @@ void iterate_all_torrents( int (*for_each)( ot_torrent* torrent, uintptr_t data
   }
 }
 
+void workstruct_seed_random( struct ot_workstruct *ws ) {
+  /* Each worker draws its seed from the shared generator once */
+  ws->random_state = ( (uint64_t)random() << 32 ) ^ (uint64_t)random() ^ (uintptr_t)ws;
+  if( !ws->random_state )
+    ws->random_state = 1;
+}
+
 void exerr( char * message ) {
   fprintf( stderr, "%s\n", message );
   exit( 111 );
@@ -418,6 +548,7 @@ void trackerlogic_init( ) {
   g_stats_path_len = strlen( g_stats_path );
 
   /* Initialise background worker threads */
+  slab_init( );
   mutex_init( );
   clean_init( );
   fullscrape_init( );
@@ -452,6 +583,7 @@ void trackerlogic_deinit( void ) {
   clean_deinit( );
   /* Release mutexes */
   mutex_deinit( );
+  slab_deinit( );
 }
 
 const char *g_version_trackerlogic_c = "$Source$: $Revision$\n";
@@ -34,7 +34,7 @@ typedef struct { ot_ip6 address; int bits; }
 #define OT_TORRENT_TIMEOUT_HOURS 24
 #define OT_TORRENT_TIMEOUT      (60*OT_TORRENT_TIMEOUT_HOURS)
 
-#define OT_CLIENT_REQUEST_INTERVAL_RANDOM ( OT_CLIENT_REQUEST_INTERVAL - OT_CLIENT_REQUEST_VARIATION/2 + (int)( random( ) % OT_CLIENT_REQUEST_VARIATION ) )
+#define OT_CLIENT_REQUEST_INTERVAL_RANDOM(ws) ( OT_CLIENT_REQUEST_INTERVAL - OT_CLIENT_REQUEST_VARIATION/2 + (int)( workstruct_random( ws ) % OT_CLIENT_REQUEST_VARIATION ) )
 
 /* If WANT_MODEST_FULLSCRAPES is on, ip addresses may not
    fullscrape more frequently than this amount in seconds */
@@ -49,13 +49,32 @@ typedef struct { ot_ip6 address; int bits; }
 
 #define OT_PEER_TIMEOUT 45
 
-/* We maintain a list of 1024 pointers to sorted list of ot_torrent structs
- Sort key is, of course, its hash */
-#define OT_BUCKET_COUNT_BITS 10
+/* Torrents with at least this many peers answer announces from a cache of
+   pre-shuffled compact peers, see tracker.peer_cache_threshold. A cache is
+   rebuilt once it is older than OT_PEER_CACHE_MAXAGE seconds or the swarm
+   has changed its size by more than 1/OT_PEER_CACHE_DRIFT */
+#define OT_PEER_CACHE_THRESHOLD_DEFAULT 1024
+#define OT_PEER_CACHE_MAXAGE 30
+#define OT_PEER_CACHE_DRIFT 8
+
+/* We maintain a list of pointers to hash indexed lists of ot_torrent
+ structs, the bucket being selected by the top bits of the hash. The
+ amount of buckets is a power of two chosen at start up via the
+ tracker.buckets config option */
+#define OT_BUCKET_COUNT_BITS_DEFAULT 10
+#define OT_BUCKET_COUNT_BITS_MIN 8
+#define OT_BUCKET_COUNT_BITS_MAX 16
+
+/* From ot_mutex.c */
+extern int g_bucket_count_bits;
+#define OT_BUCKET_COUNT_BITS g_bucket_count_bits
 
 #define OT_BUCKET_COUNT (1<<OT_BUCKET_COUNT_BITS)
 #define OT_BUCKET_COUNT_SHIFT (32-OT_BUCKET_COUNT_BITS)
 
+/* From trackerlogic.c, 0 disables the peer cache */
+extern size_t g_peer_cache_threshold;
+
 /* From opentracker.c */
 extern time_t g_now_seconds;
 extern volatile int g_opentracker_running;
@@ -87,6 +106,7 @@ static const uint8_t PEER_FLAG_LEECHING  = 0x00;
 
 struct ot_peerlist;
 typedef struct ot_peerlist ot_peerlist;
+typedef struct ot_peercache ot_peercache;
 typedef struct {
   ot_hash      hash;
   ot_peerlist *peer_list;
@@ -94,17 +114,24 @@ typedef struct {
 
 #include "ot_vector.h"
 
+/* Torrents with only a few peers keep them right inside their peer list,
+   saving an allocation and a pointer to chase for the long tail */
+#define OT_PEERLIST_INLINE_PEERS OT_VECTOR_MIN_MEMBERS
+
 struct ot_peerlist {
   ot_time        base;
   size_t         seed_count;
   size_t         peer_count;
   size_t         down_count;
-/* normal peers vector or
-   pointer to ot_vector[32] buckets if data != NULL and space == 0
-*/
+/* last time the counts changed, for delta full scrapes */
+  ot_time        changed;
+/* hashed peers vector, see ot_vector.h. Its data points to peers_inline
+   as long as there is room for no more than OT_PEERLIST_INLINE_PEERS */
   ot_vector      peers;
+  ot_peer        peers_inline[OT_PEERLIST_INLINE_PEERS];
+/* shuffled compact copy of the peers of hot torrents, NULL for all others */
+  ot_peercache  *cache;
 };
-#define OT_PEERLIST_HASBUCKETS(peer_list) ((peer_list)->peers.size > (peer_list)->peers.space)
 
 struct ot_workstruct {
   /* Thread specific, static */
@@ -112,10 +139,17 @@ struct ot_workstruct {
 #define   G_INBUF_SIZE    8192
   char    *outbuf;
 #define   G_OUTBUF_SIZE   8192
+  /* UDP workers receive and answer OT_UDP_BATCH datagrams at once, each
+     one in its own slot of these */
+  char    *udp_inbufs;
+#define   G_UDP_INBUF_SIZE  2048
+  char    *udp_outbufs;
+#define   G_UDP_OUTBUF_SIZE 4096
 #ifdef    _DEBUG_HTTPERROR
   char    *debugbuf;
 #define   G_DEBUGBUF_SIZE 8192
 #endif
+  uint64_t random_state;
 
   /* The peer currently in the working */
   ot_peer  peer;
@@ -125,6 +159,7 @@ struct ot_workstruct {
   char    *peer_id;
 
   /* HTTP specific, non static */
+  struct http_data *cookie;
   int      keep_alive;
   char    *request;
   ssize_t  request_size;
@@ -133,6 +168,18 @@ struct ot_workstruct {
   ssize_t  reply_size;
 };
 
+/* Per thread pseudo random numbers (xorshift64*) for peer selection and
+   announce interval jitter. libc's random() takes a global lock */
+void workstruct_seed_random( struct ot_workstruct *ws );
+static inline uint32_t workstruct_random( struct ot_workstruct *ws ) {
+  uint64_t x = ws->random_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  ws->random_state = x;
+  return (uint32_t)( ( x * 0x2545F4914F6CDD1DULL ) >> 32 );
+}
+
 /*
    Exported functions
 */
@@ -168,5 +215,6 @@ void iterate_all_torrents( int (*for_each)( ot_torrent* torrent, uintptr_t data
 
 /* Helper, before it moves to its own object */
 void free_peerlist( ot_peerlist *peer_list );
+void free_peercache( ot_peerlist *peer_list );
 
 #endif